@@ -0,0 +1,875 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+
+#include "helpers.c"
+
+// Every allocation is padded to a multiple of this, which is also the step
+// between the smallest TLSF size classes.
+#define ALLOCATOR_MIN_ALIGNMENT 16ull
+#define ALLOCATOR_DEFAULT_BLOCK_SIZE (64ull * 1024 * 1024)
+
+// Two-level segregated fit: the first level splits sizes by power of two,
+// the second splits each power of two into TLSF_SL_COUNT linear classes.
+#define TLSF_SL_BITS 5
+#define TLSF_SL_COUNT (1u << TLSF_SL_BITS)
+// below this, first level 0 holds TLSF_SL_COUNT classes of the min alignment
+#define TLSF_SMALL_SIZE (ALLOCATOR_MIN_ALIGNMENT * TLSF_SL_COUNT)
+#define TLSF_FL_SHIFT 9 // log2(TLSF_SMALL_SIZE)
+#define TLSF_FL_COUNT 32
+#define NO_REGION UINT32_MAX
+
+// A span of a block, either one allocation or one free range. Regions of a
+// block form a list in address order, free ones also sit in a size class.
+typedef struct {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    uint32_t prevPhysical;
+    uint32_t nextPhysical;
+    uint32_t prevFree;
+    uint32_t nextFree; // also links records of regions that were merged away
+    bool free;
+} TlsfRegion;
+
+// One VkDeviceMemory allocation, sub-allocated either with TLSF or, for
+// linear blocks, by bumping an offset that is reset all at once.
+typedef struct {
+    VkDeviceMemory memory; // VK_NULL_HANDLE for CPU-only blocks
+    VkDeviceSize size;
+    uint32_t memoryTypeIndex;
+    uint32_t kind; // ResourceKind of the pool it belongs to
+    char *mapped; // whole block, NULL unless host visible
+    bool linear;
+    VkDeviceSize linearHead;
+    VkDeviceSize usedBytes;
+    uint32_t allocationCount;
+    uint32_t flBitmap;
+    uint32_t slBitmaps[TLSF_FL_COUNT];
+    uint32_t freeLists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    TlsfRegion *regions;
+    uint32_t regionCount;
+    uint32_t regionCapacity;
+    uint32_t unusedRegions;
+} MemoryBlock;
+
+uint32_t floorLog2(uint64_t value) {
+    return 63 - __builtin_clzll(value);
+}
+
+VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+void tlsfMapping(VkDeviceSize size, uint32_t *fl, uint32_t *sl) {
+    if (size < TLSF_SMALL_SIZE) {
+        *fl = 0;
+        *sl = size / ALLOCATOR_MIN_ALIGNMENT;
+        return;
+    }
+
+    uint32_t log2 = floorLog2(size);
+    *sl = (uint32_t)(size >> (log2 - TLSF_SL_BITS)) - TLSF_SL_COUNT;
+    *fl = log2 - TLSF_FL_SHIFT + 1;
+}
+
+// Smallest size whose class only holds free regions that fit size bytes at
+// any offset once aligned.
+VkDeviceSize tlsfSearchSize(VkDeviceSize size, VkDeviceSize alignment) {
+    if (alignment < ALLOCATOR_MIN_ALIGNMENT) {
+        alignment = ALLOCATOR_MIN_ALIGNMENT;
+    }
+
+    // region offsets are multiples of the min alignment, so this is the most
+    // padding aligning one can take
+    VkDeviceSize searchSize = size + alignment - ALLOCATOR_MIN_ALIGNMENT;
+
+    if (searchSize >= TLSF_SMALL_SIZE) {
+        searchSize += (1ull << (floorLog2(searchSize) - TLSF_SL_BITS)) - 1;
+    }
+
+    return searchSize;
+}
+
+uint32_t newRegion(MemoryBlock *block) {
+    if (block->unusedRegions != NO_REGION) {
+        uint32_t index = block->unusedRegions;
+        block->unusedRegions = block->regions[index].nextFree;
+        return index;
+    }
+
+    if (block->regionCount == block->regionCapacity) {
+        block->regionCapacity =
+            block->regionCapacity ? block->regionCapacity * 2 : 64;
+        block->regions =
+            realloc(block->regions, block->regionCapacity * sizeof(TlsfRegion));
+
+        if (!block->regions) {
+            fprintf(stderr, "ERROR: failed to allocate allocator regions.\n");
+            exit(1);
+        }
+    }
+
+    return block->regionCount++;
+}
+
+void releaseRegion(MemoryBlock *block, uint32_t index) {
+    block->regions[index].nextFree = block->unusedRegions;
+    block->unusedRegions = index;
+}
+
+void insertFreeRegion(MemoryBlock *block, uint32_t index) {
+    TlsfRegion *region = &block->regions[index];
+
+    uint32_t fl, sl;
+    tlsfMapping(region->size, &fl, &sl);
+
+    region->free = true;
+    region->prevFree = NO_REGION;
+    region->nextFree = block->freeLists[fl][sl];
+
+    if (region->nextFree != NO_REGION) {
+        block->regions[region->nextFree].prevFree = index;
+    }
+
+    block->freeLists[fl][sl] = index;
+    block->flBitmap |= 1u << fl;
+    block->slBitmaps[fl] |= 1u << sl;
+}
+
+void removeFreeRegion(MemoryBlock *block, uint32_t index) {
+    TlsfRegion *region = &block->regions[index];
+
+    uint32_t fl, sl;
+    tlsfMapping(region->size, &fl, &sl);
+
+    if (region->prevFree != NO_REGION) {
+        block->regions[region->prevFree].nextFree = region->nextFree;
+    } else {
+        block->freeLists[fl][sl] = region->nextFree;
+    }
+
+    if (region->nextFree != NO_REGION) {
+        block->regions[region->nextFree].prevFree = region->prevFree;
+    }
+
+    if (block->freeLists[fl][sl] == NO_REGION) {
+        block->slBitmaps[fl] &= ~(1u << sl);
+
+        if (block->slBitmaps[fl] == 0) {
+            block->flBitmap &= ~(1u << fl);
+        }
+    }
+
+    region->free = false;
+}
+
+// Sets up block bookkeeping for size bytes, without any device memory.
+void initMemoryBlock(MemoryBlock *block, VkDeviceSize size, bool linear) {
+    *block = (MemoryBlock){
+        .memory = VK_NULL_HANDLE,
+        .size = size,
+        .linear = linear,
+        .unusedRegions = NO_REGION,
+    };
+
+    memset(block->freeLists, 0xff, sizeof(block->freeLists));
+
+    if (linear) {
+        return;
+    }
+
+    uint32_t index = newRegion(block);
+    block->regions[index] = (TlsfRegion){
+        .offset = 0,
+        .size = size,
+        .prevPhysical = NO_REGION,
+        .nextPhysical = NO_REGION,
+    };
+    insertFreeRegion(block, index);
+}
+
+/**
+ * Finds room for size bytes at the given power of two alignment in constant
+ * time, splitting the padding in front and the rest behind off as free
+ * regions. Returns false when no free region is large enough.
+ */
+bool blockAllocate(MemoryBlock *block, VkDeviceSize size,
+                   VkDeviceSize alignment, VkDeviceSize *offset,
+                   uint32_t *regionIndex) {
+    size = alignUp(size, ALLOCATOR_MIN_ALIGNMENT);
+    if (alignment < ALLOCATOR_MIN_ALIGNMENT) {
+        alignment = ALLOCATOR_MIN_ALIGNMENT;
+    }
+
+    uint32_t fl, sl;
+    tlsfMapping(tlsfSearchSize(size, alignment), &fl, &sl);
+
+    if (fl >= TLSF_FL_COUNT) {
+        return false;
+    }
+
+    uint32_t slMap = block->slBitmaps[fl] & (~0u << sl);
+
+    if (slMap == 0) {
+        uint32_t flMap =
+            fl + 1 < TLSF_FL_COUNT ? block->flBitmap & (~0u << (fl + 1)) : 0;
+
+        if (flMap == 0) {
+            return false;
+        }
+
+        fl = __builtin_ctz(flMap);
+        slMap = block->slBitmaps[fl];
+    }
+
+    sl = __builtin_ctz(slMap);
+
+    uint32_t index = block->freeLists[fl][sl];
+    removeFreeRegion(block, index);
+
+    VkDeviceSize alignedOffset =
+        alignUp(block->regions[index].offset, alignment);
+    VkDeviceSize padding = alignedOffset - block->regions[index].offset;
+
+    // free regions never touch, so the neighbors of both splits are in use
+    if (padding > 0) {
+        uint32_t front = newRegion(block);
+        TlsfRegion *region = &block->regions[index];
+
+        block->regions[front] = (TlsfRegion){
+            .offset = region->offset,
+            .size = padding,
+            .prevPhysical = region->prevPhysical,
+            .nextPhysical = index,
+        };
+
+        if (region->prevPhysical != NO_REGION) {
+            block->regions[region->prevPhysical].nextPhysical = front;
+        }
+
+        region->prevPhysical = front;
+        region->offset = alignedOffset;
+        region->size -= padding;
+
+        insertFreeRegion(block, front);
+    }
+
+    if (block->regions[index].size > size) {
+        uint32_t back = newRegion(block);
+        TlsfRegion *region = &block->regions[index];
+
+        block->regions[back] = (TlsfRegion){
+            .offset = region->offset + size,
+            .size = region->size - size,
+            .prevPhysical = index,
+            .nextPhysical = region->nextPhysical,
+        };
+
+        if (region->nextPhysical != NO_REGION) {
+            block->regions[region->nextPhysical].prevPhysical = back;
+        }
+
+        region->nextPhysical = back;
+        region->size = size;
+
+        insertFreeRegion(block, back);
+    }
+
+    block->usedBytes += size;
+    block->allocationCount++;
+
+    *offset = alignedOffset;
+    *regionIndex = index;
+
+    return true;
+}
+
+void blockFree(MemoryBlock *block, uint32_t index) {
+    TlsfRegion *region = &block->regions[index];
+
+    block->usedBytes -= region->size;
+    block->allocationCount--;
+
+    uint32_t prev = region->prevPhysical;
+    if (prev != NO_REGION && block->regions[prev].free) {
+        removeFreeRegion(block, prev);
+
+        block->regions[prev].size += region->size;
+        block->regions[prev].nextPhysical = region->nextPhysical;
+
+        if (region->nextPhysical != NO_REGION) {
+            block->regions[region->nextPhysical].prevPhysical = prev;
+        }
+
+        releaseRegion(block, index);
+        index = prev;
+        region = &block->regions[index];
+    }
+
+    uint32_t next = region->nextPhysical;
+    if (next != NO_REGION && block->regions[next].free) {
+        removeFreeRegion(block, next);
+
+        region->size += block->regions[next].size;
+        region->nextPhysical = block->regions[next].nextPhysical;
+
+        if (region->nextPhysical != NO_REGION) {
+            block->regions[region->nextPhysical].prevPhysical = index;
+        }
+
+        releaseRegion(block, next);
+    }
+
+    insertFreeRegion(block, index);
+}
+
+bool linearAllocateOffset(MemoryBlock *block, VkDeviceSize size,
+                          VkDeviceSize alignment, VkDeviceSize *offset) {
+    VkDeviceSize alignedOffset = alignUp(block->linearHead, alignment);
+
+    if (alignedOffset + size > block->size) {
+        return false;
+    }
+
+    block->linearHead = alignedOffset + size;
+    block->usedBytes = block->linearHead;
+    block->allocationCount++;
+
+    *offset = alignedOffset;
+
+    return true;
+}
+
+// Drops every allocation of a linear block at once
+void resetLinearBlock(MemoryBlock *block) {
+    block->linearHead = 0;
+    block->usedBytes = 0;
+    block->allocationCount = 0;
+}
+
+typedef enum {
+    RESOURCE_LINEAR,  // buffers and linear tiling images
+    RESOURCE_OPTIMAL, // optimal tiling images
+    RESOURCE_KIND_COUNT,
+} ResourceKind;
+
+typedef struct {
+    MemoryBlock **blocks;
+    uint32_t blockCount;
+    uint32_t blockCapacity;
+} MemoryPool;
+
+/**
+ * Sub-allocates device memory out of large blocks, one pool of blocks per
+ * memory type. When bufferImageGranularity is above 1, buffers and optimal
+ * images get separate pools, so they never share a granularity page and
+ * need no padding between them.
+ */
+typedef struct {
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties memProperties;
+    VkDeviceSize bufferImageGranularity;
+    uint32_t maxAllocationCount;
+    uint32_t deviceAllocationCount; // live vkAllocateMemory calls
+    MemoryPool pools[VK_MAX_MEMORY_TYPES][RESOURCE_KIND_COUNT];
+    MemoryPool linearBlocks;
+    pthread_mutex_t mutex;
+} Allocator;
+
+typedef struct {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    void *mapped; // NULL unless the memory is host visible
+    MemoryBlock *block;
+    uint32_t region; // NO_REGION for linear allocations
+} Allocation;
+
+typedef struct {
+    uint32_t blockCount;
+    VkDeviceSize blockBytes;
+    VkDeviceSize usedBytes;
+    uint32_t allocationCount;
+    uint32_t freeRegionCount;
+    VkDeviceSize largestFreeRegion;
+    double fragmentation; // 1 - largest free region / free bytes, TLSF only
+} AllocatorStats;
+
+void createAllocator(Allocator *allocator, VkDevice device,
+                     VkPhysicalDevice physicalDevice) {
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProps);
+
+    *allocator = (Allocator){
+        .device = device,
+        .bufferImageGranularity = deviceProps.limits.bufferImageGranularity,
+        .maxAllocationCount = deviceProps.limits.maxMemoryAllocationCount,
+        .deviceAllocationCount = 0,
+    };
+
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice,
+                                        &allocator->memProperties);
+
+    pthread_mutex_init(&allocator->mutex, NULL);
+}
+
+uint32_t chooseMemoryType(const Allocator *allocator, uint32_t typeFilter,
+                          VkMemoryPropertyFlags properties) {
+    const VkPhysicalDeviceMemoryProperties *memProperties =
+        &allocator->memProperties;
+
+    for (uint32_t i = 0; i < memProperties->memoryTypeCount; i++) {
+        if ((typeFilter & (1u << i)) &&
+            (memProperties->memoryTypes[i].propertyFlags & properties) ==
+                properties) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "ERROR: failed to find suitable memory type.\n");
+    exit(1);
+}
+
+// Default block size of a memory type, smaller on heaps too small to hold a
+// few of them.
+VkDeviceSize getBlockSize(const Allocator *allocator,
+                          uint32_t memoryTypeIndex) {
+    uint32_t heapIndex =
+        allocator->memProperties.memoryTypes[memoryTypeIndex].heapIndex;
+    VkDeviceSize heapSize =
+        allocator->memProperties.memoryHeaps[heapIndex].size;
+
+    if (heapSize / 8 < ALLOCATOR_DEFAULT_BLOCK_SIZE) {
+        return alignUp(heapSize / 8, ALLOCATOR_MIN_ALIGNMENT);
+    }
+
+    return ALLOCATOR_DEFAULT_BLOCK_SIZE;
+}
+
+MemoryBlock *createMemoryBlock(Allocator *allocator, uint32_t memoryTypeIndex,
+                               VkDeviceSize size, bool linear) {
+    if (allocator->deviceAllocationCount >= allocator->maxAllocationCount) {
+        fprintf(stderr, "ERROR: maxMemoryAllocationCount of %d reached.\n",
+                allocator->maxAllocationCount);
+        exit(1);
+    }
+
+    MemoryBlock *block = malloc(sizeof(MemoryBlock));
+
+    if (!block) {
+        fprintf(stderr, "ERROR: failed to allocate memory block.\n");
+        exit(1);
+    }
+
+    initMemoryBlock(block, size, linear);
+    block->memoryTypeIndex = memoryTypeIndex;
+
+    VkMemoryAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize = size,
+        .memoryTypeIndex = memoryTypeIndex,
+    };
+
+    if (vkAllocateMemory(allocator->device, &allocInfo, NULL,
+                         &block->memory) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to allocate %llu bytes of device "
+                        "memory.\n",
+                (unsigned long long)size);
+        exit(1);
+    }
+
+    allocator->deviceAllocationCount++;
+
+    VkMemoryPropertyFlags flags =
+        allocator->memProperties.memoryTypes[memoryTypeIndex].propertyFlags;
+
+    if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        void *mapped;
+        if (vkMapMemory(allocator->device, block->memory, 0, VK_WHOLE_SIZE, 0,
+                        &mapped) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to map memory block.\n");
+            exit(1);
+        }
+        block->mapped = mapped;
+    }
+
+    return block;
+}
+
+void destroyMemoryBlock(Allocator *allocator, MemoryBlock *block) {
+    if (block->memory != VK_NULL_HANDLE) {
+        // freeing implicitly unmaps
+        vkFreeMemory(allocator->device, block->memory, NULL);
+        allocator->deviceAllocationCount--;
+    }
+
+    free(block->regions);
+    free(block);
+}
+
+void addPoolBlock(MemoryPool *pool, MemoryBlock *block) {
+    if (pool->blockCount == pool->blockCapacity) {
+        pool->blockCapacity = pool->blockCapacity ? pool->blockCapacity * 2 : 4;
+        pool->blocks =
+            realloc(pool->blocks, pool->blockCapacity * sizeof(MemoryBlock *));
+
+        if (!pool->blocks) {
+            fprintf(stderr, "ERROR: failed to allocate memory pool.\n");
+            exit(1);
+        }
+    }
+
+    pool->blocks[pool->blockCount++] = block;
+}
+
+void removePoolBlock(MemoryPool *pool, MemoryBlock *block) {
+    for (uint32_t i = 0; i < pool->blockCount; i++) {
+        if (pool->blocks[i] == block) {
+            pool->blocks[i] = pool->blocks[--pool->blockCount];
+            return;
+        }
+    }
+}
+
+MemoryPool *getMemoryPool(Allocator *allocator, uint32_t memoryTypeIndex,
+                          ResourceKind kind) {
+    if (allocator->bufferImageGranularity <= 1) {
+        kind = RESOURCE_LINEAR;
+    }
+
+    return &allocator->pools[memoryTypeIndex][kind];
+}
+
+Allocation makeAllocation(MemoryBlock *block, VkDeviceSize offset,
+                          VkDeviceSize size, uint32_t region) {
+    Allocation allocation = {
+        .memory = block->memory,
+        .offset = offset,
+        .size = size,
+        .mapped = block->mapped ? block->mapped + offset : NULL,
+        .block = block,
+        .region = region,
+    };
+
+    return allocation;
+}
+
+/**
+ * Sub-allocates memory for a resource with the given requirements, adding a
+ * block to the pool when no existing one has room. Requests larger than a
+ * block get a block of their own.
+ */
+Allocation allocateMemory(Allocator *allocator,
+                          VkMemoryRequirements requirements,
+                          VkMemoryPropertyFlags properties, ResourceKind kind) {
+    pthread_mutex_lock(&allocator->mutex);
+
+    uint32_t memoryTypeIndex =
+        chooseMemoryType(allocator, requirements.memoryTypeBits, properties);
+    MemoryPool *pool = getMemoryPool(allocator, memoryTypeIndex, kind);
+
+    VkDeviceSize offset;
+    uint32_t region;
+
+    for (uint32_t i = 0; i < pool->blockCount; i++) {
+        MemoryBlock *block = pool->blocks[i];
+
+        if (blockAllocate(block, requirements.size, requirements.alignment,
+                          &offset, &region)) {
+            pthread_mutex_unlock(&allocator->mutex);
+            return makeAllocation(block, offset, requirements.size, region);
+        }
+    }
+
+    VkDeviceSize blockSize = getBlockSize(allocator, memoryTypeIndex);
+    VkDeviceSize searchSize = alignUp(
+        tlsfSearchSize(alignUp(requirements.size, ALLOCATOR_MIN_ALIGNMENT),
+                       requirements.alignment),
+        ALLOCATOR_MIN_ALIGNMENT);
+
+    if (searchSize > blockSize) {
+        blockSize = searchSize;
+    }
+
+    MemoryBlock *block =
+        createMemoryBlock(allocator, memoryTypeIndex, blockSize, false);
+    block->kind = kind;
+    addPoolBlock(pool, block);
+
+    if (!blockAllocate(block, requirements.size, requirements.alignment,
+                       &offset, &region)) {
+        fprintf(stderr, "ERROR: failed to sub-allocate from a new block.\n");
+        exit(1);
+    }
+
+    pthread_mutex_unlock(&allocator->mutex);
+
+    return makeAllocation(block, offset, requirements.size, region);
+}
+
+void freeAllocation(Allocator *allocator, Allocation *allocation) {
+    if (!allocation->block || allocation->region == NO_REGION) {
+        return;
+    }
+
+    pthread_mutex_lock(&allocator->mutex);
+
+    MemoryBlock *block = allocation->block;
+    blockFree(block, allocation->region);
+
+    // keep one empty block around per pool, so a pool that drains and
+    // refills doesn't keep allocating device memory
+    if (block->allocationCount == 0) {
+        MemoryPool *pool =
+            getMemoryPool(allocator, block->memoryTypeIndex, block->kind);
+
+        for (uint32_t i = 0; i < pool->blockCount; i++) {
+            MemoryBlock *other = pool->blocks[i];
+
+            if (other != block && other->allocationCount == 0) {
+                removePoolBlock(pool, block);
+                destroyMemoryBlock(allocator, block);
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&allocator->mutex);
+
+    *allocation = (Allocation){};
+}
+
+/**
+ * Creates a block for a linear allocator, for data that lives one frame.
+ * memoryTypeBits normally come from the requirements of a buffer that is
+ * bound over the whole block.
+ */
+MemoryBlock *createLinearBlock(Allocator *allocator, VkDeviceSize size,
+                               uint32_t memoryTypeBits,
+                               VkMemoryPropertyFlags properties) {
+    pthread_mutex_lock(&allocator->mutex);
+
+    uint32_t memoryTypeIndex =
+        chooseMemoryType(allocator, memoryTypeBits, properties);
+    MemoryBlock *block =
+        createMemoryBlock(allocator, memoryTypeIndex, size, true);
+    addPoolBlock(&allocator->linearBlocks, block);
+
+    pthread_mutex_unlock(&allocator->mutex);
+
+    return block;
+}
+
+bool linearAllocate(MemoryBlock *block, VkDeviceSize size,
+                    VkDeviceSize alignment, Allocation *allocation) {
+    VkDeviceSize offset;
+
+    if (!linearAllocateOffset(block, size, alignment, &offset)) {
+        return false;
+    }
+
+    *allocation = makeAllocation(block, offset, size, NO_REGION);
+
+    return true;
+}
+
+void destroyLinearBlock(Allocator *allocator, MemoryBlock *block) {
+    pthread_mutex_lock(&allocator->mutex);
+
+    removePoolBlock(&allocator->linearBlocks, block);
+    destroyMemoryBlock(allocator, block);
+
+    pthread_mutex_unlock(&allocator->mutex);
+}
+
+void addBlockStats(AllocatorStats *stats, const MemoryBlock *block,
+                   VkDeviceSize *freeBytes) {
+    stats->blockCount++;
+    stats->blockBytes += block->size;
+    stats->usedBytes += block->usedBytes;
+    stats->allocationCount += block->allocationCount;
+
+    if (block->linear) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < block->regionCount; i++) {
+        const TlsfRegion *region = &block->regions[i];
+
+        // merged away records sit on the unused list and aren't free
+        if (!region->free) {
+            continue;
+        }
+
+        stats->freeRegionCount++;
+        *freeBytes += region->size;
+
+        if (region->size > stats->largestFreeRegion) {
+            stats->largestFreeRegion = region->size;
+        }
+    }
+}
+
+AllocatorStats getAllocatorStats(Allocator *allocator) {
+    AllocatorStats stats = {};
+    VkDeviceSize freeBytes = 0;
+
+    pthread_mutex_lock(&allocator->mutex);
+
+    for (uint32_t type = 0; type < VK_MAX_MEMORY_TYPES; type++) {
+        for (uint32_t kind = 0; kind < RESOURCE_KIND_COUNT; kind++) {
+            MemoryPool *pool = &allocator->pools[type][kind];
+
+            for (uint32_t i = 0; i < pool->blockCount; i++) {
+                addBlockStats(&stats, pool->blocks[i], &freeBytes);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < allocator->linearBlocks.blockCount; i++) {
+        addBlockStats(&stats, allocator->linearBlocks.blocks[i], &freeBytes);
+    }
+
+    pthread_mutex_unlock(&allocator->mutex);
+
+    stats.fragmentation =
+        freeBytes > 0 ? 1.0 - (double)stats.largestFreeRegion / freeBytes : 0.0;
+
+    return stats;
+}
+
+void printAllocatorStats(const char *label, AllocatorStats stats) {
+    fprintf(stdout,
+            "%s: %d blocks, %.1f MiB reserved, %.1f MiB in use by %d "
+            "allocations, %d free regions, %.1f%% fragmentation\n",
+            label, stats.blockCount, stats.blockBytes / (1024.0 * 1024.0),
+            stats.usedBytes / (1024.0 * 1024.0), stats.allocationCount,
+            stats.freeRegionCount, stats.fragmentation * 100.0);
+}
+
+void destroyAllocator(Allocator *allocator) {
+    for (uint32_t type = 0; type < VK_MAX_MEMORY_TYPES; type++) {
+        for (uint32_t kind = 0; kind < RESOURCE_KIND_COUNT; kind++) {
+            MemoryPool *pool = &allocator->pools[type][kind];
+
+            for (uint32_t i = 0; i < pool->blockCount; i++) {
+                destroyMemoryBlock(allocator, pool->blocks[i]);
+            }
+            free(pool->blocks);
+        }
+    }
+
+    for (uint32_t i = 0; i < allocator->linearBlocks.blockCount; i++) {
+        destroyMemoryBlock(allocator, allocator->linearBlocks.blocks[i]);
+    }
+    free(allocator->linearBlocks.blocks);
+
+    pthread_mutex_destroy(&allocator->mutex);
+}
+
+uint32_t xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *state = x;
+}
+
+/**
+ * Times the CPU side of both allocation paths on a block without device
+ * memory behind it: a random mix of TLSF allocations and frees with sizes
+ * from 64 B to 256 KiB, then linear allocations with a reset every 1024.
+ */
+void benchmarkAllocator(uint32_t operationCount) {
+    const uint32_t slotCount = 4096;
+
+    MemoryBlock block;
+    initMemoryBlock(&block, 1ull << 30, false);
+
+    uint32_t *regions = malloc(slotCount * sizeof(uint32_t));
+
+    if (!regions) {
+        fprintf(stderr, "ERROR: failed to allocate benchmark slots.\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < slotCount; i++) {
+        regions[i] = NO_REGION;
+    }
+
+    uint32_t seed = 0x9e3779b9;
+    uint32_t failed = 0;
+
+    double start = getTimeMs();
+
+    for (uint32_t i = 0; i < operationCount; i++) {
+        uint32_t slot = xorshift32(&seed) % slotCount;
+
+        if (regions[slot] != NO_REGION) {
+            blockFree(&block, regions[slot]);
+            regions[slot] = NO_REGION;
+            continue;
+        }
+
+        // log-uniform sizes, most allocations are small
+        uint32_t random = xorshift32(&seed);
+        VkDeviceSize size = 64ull << (random % 13);
+        size += (random >> 8) % size;
+        VkDeviceSize alignment = 16ull << ((random >> 4) % 5);
+
+        VkDeviceSize offset;
+        if (!blockAllocate(&block, size, alignment, &offset, &regions[slot])) {
+            regions[slot] = NO_REGION;
+            failed++;
+        }
+    }
+
+    double tlsfMs = getTimeMs() - start;
+
+    AllocatorStats stats = {};
+    VkDeviceSize freeBytes = 0;
+    addBlockStats(&stats, &block, &freeBytes);
+    stats.fragmentation =
+        freeBytes > 0 ? 1.0 - (double)stats.largestFreeRegion / freeBytes : 0.0;
+
+    fprintf(stdout, "tlsf: %d operations in %.3f ms, %.1f ns each, %d failed\n",
+            operationCount, tlsfMs, tlsfMs * 1000000.0 / operationCount,
+            failed);
+    printAllocatorStats("tlsf block after the run", stats);
+
+    free(regions);
+    free(block.regions);
+
+    initMemoryBlock(&block, 1ull << 30, true);
+
+    // printed, so the compiler cannot drop the allocations
+    VkDeviceSize offsetSum = 0;
+
+    start = getTimeMs();
+
+    for (uint32_t i = 0; i < operationCount; i++) {
+        if (i % 1024 == 0) {
+            resetLinearBlock(&block);
+        }
+
+        VkDeviceSize offset;
+        linearAllocateOffset(&block, 64 + (xorshift32(&seed) % 4096), 256,
+                             &offset);
+        offsetSum += offset;
+    }
+
+    double linearMs = getTimeMs() - start;
+
+    fprintf(stdout,
+            "linear: %d allocations in %.3f ms, %.1f ns each, offset sum "
+            "%llu\n",
+            operationCount, linearMs, linearMs * 1000000.0 / operationCount,
+            (unsigned long long)offsetSum);
+}
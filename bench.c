@@ -0,0 +1,235 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    PHASE_FENCE_WAIT,
+    PHASE_ACQUIRE,
+    PHASE_RECORD,
+    PHASE_SUBMIT,
+    PHASE_PRESENT,
+    PHASE_FRAME, // whole loop iteration, start to end
+    PHASE_GPU_CULL_PASS, // GPU time, 0 without --gpu-cull
+    PHASE_GPU_RENDER_PASS, // GPU time, read back frames in flight later
+    PHASE_GPU_SIMULATE, // GPU time of the particle step, on either queue
+    PHASE_GPU_GRAPHICS_BUSY, // GPU time the frame kept the graphics queue
+    PHASE_INPUT_TO_PRESENT, // input poll until vkQueuePresentKHR returns,
+                            // or the submit does offscreen
+    PHASE_COUNT,
+} FramePhase;
+
+const char *phaseNames[PHASE_COUNT] = {
+    "fence_wait",    "acquire",         "record",
+    "submit",        "present",         "frame",
+    "gpu_cull_pass", "gpu_render_pass", "gpu_simulate",
+    "gpu_queue_busy", "input_to_present",
+};
+
+// Time spent in each phase of a single frame, in milliseconds
+typedef struct {
+    double phases[PHASE_COUNT];
+} FrameTiming;
+
+typedef struct {
+    double mean;
+    double p50;
+    double p95;
+    double p99;
+    double max;
+} BenchStats;
+
+// long enough for the configuration labels of the sweeps
+#define BENCH_LABEL_SIZE 128
+
+// Samples of one benchmark configuration, one FrameTiming per measured frame.
+typedef struct {
+    char label[BENCH_LABEL_SIZE];
+    uint32_t warmupCount;
+    uint32_t frameCount;
+    uint32_t capacity;
+    FrameTiming *frames;
+    double elapsedMs;
+} BenchRun;
+
+BenchRun createBenchRun(const char *label, uint32_t warmupCount,
+                        uint32_t capacity) {
+    BenchRun run = {
+        .warmupCount = warmupCount,
+        .frameCount = 0,
+        .capacity = capacity,
+        .frames = calloc(capacity, sizeof(FrameTiming)),
+        .elapsedMs = 0.0,
+    };
+
+    if (!run.frames) {
+        fprintf(stderr, "ERROR: failed to allocate benchmark samples.\n");
+        exit(1);
+    }
+
+    snprintf(run.label, sizeof(run.label), "%s", label);
+
+    return run;
+}
+
+void destroyBenchRun(BenchRun *run) {
+    free(run->frames);
+    run->frames = NULL;
+}
+
+void recordBenchFrame(BenchRun *run, const FrameTiming *timing) {
+    if (run->frameCount < run->capacity) {
+        run->frames[run->frameCount++] = *timing;
+    }
+}
+
+double benchFps(const BenchRun *run) {
+    if (run->elapsedMs <= 0.0) {
+        return 0.0;
+    }
+
+    return run->frameCount * 1000.0 / run->elapsedMs;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+// nearest-rank percentile of an already sorted array
+double percentile(const double *sorted, uint32_t count, uint32_t percent) {
+    if (count == 0) {
+        return 0.0;
+    }
+
+    uint32_t rank = (uint32_t)(((uint64_t)percent * count + 99) / 100);
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+BenchStats computeBenchStats(const BenchRun *run, FramePhase phase) {
+    BenchStats stats = {};
+
+    if (run->frameCount == 0) {
+        return stats;
+    }
+
+    double *sorted = malloc(run->frameCount * sizeof(double));
+
+    if (!sorted) {
+        fprintf(stderr, "ERROR: failed to allocate benchmark statistics.\n");
+        exit(1);
+    }
+
+    double sum = 0.0;
+    for (uint32_t i = 0; i < run->frameCount; i++) {
+        sorted[i] = run->frames[i].phases[phase];
+        sum += sorted[i];
+    }
+
+    qsort(sorted, run->frameCount, sizeof(double), compareDoubles);
+
+    stats.mean = sum / run->frameCount;
+    stats.p50 = percentile(sorted, run->frameCount, 50);
+    stats.p95 = percentile(sorted, run->frameCount, 95);
+    stats.p99 = percentile(sorted, run->frameCount, 99);
+    stats.max = sorted[run->frameCount - 1];
+
+    free(sorted);
+
+    return stats;
+}
+
+void printBenchRun(const BenchRun *run) {
+    fprintf(stdout,
+            "benchmark %s: %d frames after %d warm-up, %.1f ms, %.1f fps\n",
+            run->label, run->frameCount, run->warmupCount, run->elapsedMs,
+            benchFps(run));
+    fprintf(stdout, "\t%-16s %9s %9s %9s %9s %9s\n", "phase (ms)", "mean",
+            "p50", "p95", "p99", "max");
+
+    for (uint32_t phase = 0; phase < PHASE_COUNT; phase++) {
+        BenchStats stats = computeBenchStats(run, phase);
+        fprintf(stdout, "\t%-16s %9.4f %9.4f %9.4f %9.4f %9.4f\n",
+                phaseNames[phase], stats.mean, stats.p50, stats.p95,
+                stats.p99, stats.max);
+    }
+    fprintf(stdout, "\n");
+}
+
+void writeBenchJson(FILE *file, const BenchRun *runs, uint32_t runCount) {
+    fprintf(file, "{\n  \"runs\": [\n");
+
+    for (uint32_t i = 0; i < runCount; i++) {
+        const BenchRun *run = &runs[i];
+
+        fprintf(file,
+                "    {\n      \"label\": \"%s\",\n      \"warmup\": %d,\n"
+                "      \"frames\": %d,\n      \"elapsed_ms\": %.4f,\n"
+                "      \"fps\": %.4f,\n      \"phases_ms\": {\n",
+                run->label, run->warmupCount, run->frameCount, run->elapsedMs,
+                benchFps(run));
+
+        for (uint32_t phase = 0; phase < PHASE_COUNT; phase++) {
+            BenchStats stats = computeBenchStats(run, phase);
+            fprintf(file,
+                    "        \"%s\": {\"mean\": %.6f, \"p50\": %.6f, "
+                    "\"p95\": %.6f, \"p99\": %.6f, \"max\": %.6f}%s\n",
+                    phaseNames[phase], stats.mean, stats.p50, stats.p95,
+                    stats.p99, stats.max, phase + 1 < PHASE_COUNT ? "," : "");
+        }
+
+        fprintf(file, "      }\n    }%s\n", i + 1 < runCount ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+}
+
+void writeBenchCsv(FILE *file, const BenchRun *runs, uint32_t runCount) {
+    fprintf(file, "label,warmup,frames,elapsed_ms,fps,phase,mean_ms,p50_ms,"
+                  "p95_ms,p99_ms,max_ms\n");
+
+    for (uint32_t i = 0; i < runCount; i++) {
+        const BenchRun *run = &runs[i];
+
+        for (uint32_t phase = 0; phase < PHASE_COUNT; phase++) {
+            BenchStats stats = computeBenchStats(run, phase);
+            fprintf(file, "%s,%d,%d,%.4f,%.4f,%s,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+                    run->label, run->warmupCount, run->frameCount,
+                    run->elapsedMs, benchFps(run), phaseNames[phase],
+                    stats.mean, stats.p50, stats.p95, stats.p99, stats.max);
+        }
+    }
+}
+
+/**
+ * Writes the summary of every run to path, as CSV when the path ends in
+ * ".csv" and as JSON otherwise.
+ */
+void writeBenchReport(const char *path, const BenchRun *runs,
+                      uint32_t runCount) {
+    FILE *file = fopen(path, "w");
+
+    if (!file) {
+        fprintf(stderr, "ERROR: failed to open %s.\n", path);
+        return;
+    }
+
+    size_t length = strlen(path);
+    bool csv = length >= 4 && strcmp(path + length - 4, ".csv") == 0;
+
+    if (csv) {
+        writeBenchCsv(file, runs, runCount);
+    } else {
+        writeBenchJson(file, runs, runCount);
+    }
+
+    fclose(file);
+
+    fprintf(stdout, "benchmark report written to %s\n", path);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define MAX_WATCHED_FILES 8
+
+/**
+ * Watches a few files of one directory for being rewritten, through inotify.
+ * The directory is watched rather than the files, since compilers usually
+ * replace a file instead of writing into it, which would end a watch on the
+ * file itself.
+ */
+typedef struct {
+    int fd; // non-blocking, -1 when not watching
+    uint32_t fileCount;
+    const char *files[MAX_WATCHED_FILES]; // names within the directory
+} FileWatch;
+
+// Returns false, leaving watch inactive, when inotify is not available
+bool startFileWatch(FileWatch *watch, const char *directory,
+                    const char **files, uint32_t fileCount) {
+    *watch = (FileWatch){
+        .fd = -1,
+        .fileCount = fileCount < MAX_WATCHED_FILES ? fileCount
+                                                   : MAX_WATCHED_FILES,
+    };
+
+    memcpy(watch->files, files, watch->fileCount * sizeof(const char *));
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (fd == -1) {
+        return false;
+    }
+
+    if (inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) ==
+        -1) {
+        close(fd);
+        return false;
+    }
+
+    watch->fd = fd;
+
+    return true;
+}
+
+// Drains the pending events without blocking, true if any of them rewrote
+// one of the watched files
+bool pollFileWatch(FileWatch *watch) {
+    if (watch->fd == -1) {
+        return false;
+    }
+
+    // aligned for the events read into it
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+
+    while (true) {
+        ssize_t length = read(watch->fd, buffer, sizeof(buffer));
+
+        if (length <= 0) {
+            if (length == -1 && errno != EAGAIN) {
+                fprintf(stderr, "ERROR: failed to read file events.\n");
+            }
+            break;
+        }
+
+        for (char *next = buffer; next < buffer + length;) {
+            const struct inotify_event *event = (void *)next;
+            next += sizeof(struct inotify_event) + event->len;
+
+            for (uint32_t i = 0; i < watch->fileCount && event->len > 0; i++) {
+                if (strcmp(event->name, watch->files[i]) == 0) {
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    return changed;
+}
+
+void stopFileWatch(FileWatch *watch) {
+    if (watch->fd != -1) {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+}
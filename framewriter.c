@@ -0,0 +1,260 @@
+#pragma once
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "helpers.c"
+
+typedef enum {
+    FRAME_FORMAT_PPM,
+    FRAME_FORMAT_RAW, // the pixels as read back, 4 bytes each
+    FRAME_FORMAT_COUNT,
+} FrameFormat;
+
+const char *frameFormatNames[FRAME_FORMAT_COUNT] = {"ppm", "raw"};
+
+// upper bound of frames queued at once, the caller keeps fewer in flight
+#define FRAME_WRITER_QUEUE_SIZE 16
+
+// One frame handed to the writer, tightly packed 4 byte pixels
+typedef struct {
+    const uint8_t *pixels;
+    uint32_t width;
+    uint32_t height;
+    bool bgra; // red and blue swapped, as in most swapchain formats
+    uint32_t frameNumber;
+    double submitMs; // when the frame that copied it was submitted
+    // when it was handed to the writer, at the next wait on its frame slot's
+    // fence, so it includes the frames queued behind it
+    double readyMs;
+} FrameWrite;
+
+/**
+ * Encodes frames to disk on a thread of its own, in the order they were
+ * queued, so the render loop never waits for the disk. Writes are numbered
+ * from 0 as they are queued; once writtenCount passes a write's number the
+ * writer is done with its pixels. The writer must not move once started.
+ */
+typedef struct {
+    const char *directory;
+    FrameFormat format;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t workReady;
+    pthread_cond_t workDone;
+    FrameWrite queue[FRAME_WRITER_QUEUE_SIZE];
+    uint64_t queuedCount;
+    uint64_t writtenCount;
+    bool shutdown;
+    // written by the writer thread only, read once it has stopped
+    double readbackTotalMs;
+    double readbackMaxMs;
+    double diskTotalMs;
+    double diskMaxMs;
+    double firstSubmitMs;
+    double lastWrittenMs;
+    uint64_t bytesWritten;
+} FrameWriter;
+
+void encodeFrame(FrameWriter *writer, const FrameWrite *write) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/frame_%06u.%s", writer->directory,
+             write->frameNumber, frameFormatNames[writer->format]);
+
+    FILE *file = fopen(path, "wb");
+
+    if (!file) {
+        fprintf(stderr, "ERROR: failed to open %s.\n", path);
+        exit(1);
+    }
+
+    size_t rowSize = (size_t)write->width * 4;
+
+    if (writer->format == FRAME_FORMAT_RAW) {
+        fwrite(write->pixels, rowSize, write->height, file);
+        writer->bytesWritten += rowSize * write->height;
+    } else {
+        int headerSize = fprintf(file, "P6\n%u %u\n255\n", write->width,
+                                 write->height);
+
+        uint8_t row[write->width * 3];
+        uint32_t red = write->bgra ? 2 : 0;
+        uint32_t blue = write->bgra ? 0 : 2;
+
+        for (uint32_t y = 0; y < write->height; y++) {
+            const uint8_t *pixel = write->pixels + y * rowSize;
+
+            for (uint32_t x = 0; x < write->width; x++, pixel += 4) {
+                row[x * 3 + 0] = pixel[red];
+                row[x * 3 + 1] = pixel[1];
+                row[x * 3 + 2] = pixel[blue];
+            }
+
+            fwrite(row, 1, sizeof(row), file);
+        }
+
+        writer->bytesWritten += headerSize + sizeof(row) * write->height;
+    }
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "ERROR: failed to write %s.\n", path);
+        exit(1);
+    }
+}
+
+void *frameWriterThread(void *arg) {
+    FrameWriter *writer = arg;
+
+    pthread_mutex_lock(&writer->mutex);
+
+    while (true) {
+        while (!writer->shutdown &&
+               writer->writtenCount == writer->queuedCount) {
+            pthread_cond_wait(&writer->workReady, &writer->mutex);
+        }
+
+        if (writer->writtenCount == writer->queuedCount) {
+            break;
+        }
+
+        FrameWrite write =
+            writer->queue[writer->writtenCount % FRAME_WRITER_QUEUE_SIZE];
+
+        pthread_mutex_unlock(&writer->mutex);
+
+        encodeFrame(writer, &write);
+
+        double now = getTimeMs();
+        double readbackMs = write.readyMs - write.submitMs;
+        double diskMs = now - write.submitMs;
+
+        writer->readbackTotalMs += readbackMs;
+        writer->diskTotalMs += diskMs;
+        writer->readbackMaxMs = readbackMs > writer->readbackMaxMs
+                                    ? readbackMs
+                                    : writer->readbackMaxMs;
+        writer->diskMaxMs =
+            diskMs > writer->diskMaxMs ? diskMs : writer->diskMaxMs;
+        writer->lastWrittenMs = now;
+
+        pthread_mutex_lock(&writer->mutex);
+
+        if (writer->writtenCount == 0) {
+            writer->firstSubmitMs = write.submitMs;
+        }
+
+        writer->writtenCount++;
+        pthread_cond_broadcast(&writer->workDone);
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+
+    return NULL;
+}
+
+void startFrameWriter(FrameWriter *writer, const char *directory,
+                      FrameFormat format) {
+    *writer = (FrameWriter){
+        .directory = directory,
+        .format = format,
+        .queuedCount = 0,
+        .writtenCount = 0,
+        .shutdown = false,
+    };
+
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: failed to create %s.\n", directory);
+        exit(1);
+    }
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->workReady, NULL);
+    pthread_cond_init(&writer->workDone, NULL);
+
+    if (pthread_create(&writer->thread, NULL, frameWriterThread, writer) !=
+        0) {
+        fprintf(stderr, "ERROR: failed to create frame writer thread.\n");
+        exit(1);
+    }
+}
+
+// Queues a frame and returns its number. The pixels must stay untouched until
+// writtenCount passes that number.
+uint64_t queueFrameWrite(FrameWriter *writer, const FrameWrite *write) {
+    pthread_mutex_lock(&writer->mutex);
+
+    if (writer->queuedCount - writer->writtenCount == FRAME_WRITER_QUEUE_SIZE) {
+        fprintf(stderr, "ERROR: frame writer queue overflow.\n");
+        exit(1);
+    }
+
+    uint64_t number = writer->queuedCount++;
+    writer->queue[number % FRAME_WRITER_QUEUE_SIZE] = *write;
+
+    pthread_cond_signal(&writer->workReady);
+    pthread_mutex_unlock(&writer->mutex);
+
+    return number;
+}
+
+uint64_t getWrittenCount(FrameWriter *writer) {
+    pthread_mutex_lock(&writer->mutex);
+    uint64_t count = writer->writtenCount;
+    pthread_mutex_unlock(&writer->mutex);
+
+    return count;
+}
+
+// Blocks until every queued frame is on disk
+void flushFrameWriter(FrameWriter *writer) {
+    pthread_mutex_lock(&writer->mutex);
+
+    while (writer->writtenCount != writer->queuedCount) {
+        pthread_cond_wait(&writer->workDone, &writer->mutex);
+    }
+
+    pthread_mutex_unlock(&writer->mutex);
+}
+
+// Writes what is still queued, then stops the thread
+void stopFrameWriter(FrameWriter *writer) {
+    pthread_mutex_lock(&writer->mutex);
+    writer->shutdown = true;
+    pthread_cond_signal(&writer->workReady);
+    pthread_mutex_unlock(&writer->mutex);
+
+    pthread_join(writer->thread, NULL);
+
+    pthread_cond_destroy(&writer->workDone);
+    pthread_cond_destroy(&writer->workReady);
+    pthread_mutex_destroy(&writer->mutex);
+}
+
+void printFrameWriterStats(const FrameWriter *writer) {
+    uint64_t count = writer->writtenCount;
+
+    if (count == 0) {
+        fprintf(stdout, "readback: no frames written\n");
+        return;
+    }
+
+    double spanMs = writer->lastWrittenMs - writer->firstSubmitMs;
+
+    fprintf(stdout,
+            "readback: %llu frames written to %s, %.1f fps, %.1f MiB/s\n",
+            (unsigned long long)count, writer->directory,
+            spanMs > 0.0 ? count * 1000.0 / spanMs : 0.0,
+            spanMs > 0.0
+                ? writer->bytesWritten / (1024.0 * 1024.0) / (spanMs / 1000.0)
+                : 0.0);
+    fprintf(stdout,
+            "\tsubmit to hand-over (the slot's next fence wait) %.3f ms "
+            "mean, %.3f ms max; submit to disk %.3f ms mean, %.3f ms max\n",
+            writer->readbackTotalMs / count, writer->readbackMaxMs,
+            writer->diskTotalMs / count, writer->diskMaxMs);
+}
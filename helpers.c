@@ -3,8 +3,19 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <vulkan/vulkan_core.h>
 
+/**
+ * Monotonic clock in milliseconds, used to time frames and startup phases.
+ */
+double getTimeMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
 void displayInstanceExtensions() {
     uint32_t extensionCount = 0;
 
@@ -60,12 +71,25 @@ void displayDevice(VkPhysicalDevice *device) {
     VkPhysicalDeviceProperties deviceProps;
     vkGetPhysicalDeviceProperties(*device, &deviceProps);
 
-    fprintf(stdout, "physical device: %s\n", deviceProps.deviceName);
+    fprintf(stdout, "physical device: %s (Vulkan %d.%d.%d)\n",
+            deviceProps.deviceName,
+            VK_API_VERSION_MAJOR(deviceProps.apiVersion),
+            VK_API_VERSION_MINOR(deviceProps.apiVersion),
+            VK_API_VERSION_PATCH(deviceProps.apiVersion));
 }
 
-void displayDevices(VkPhysicalDevice *devices, uint32_t deviceCount) {
+// One device per line, each prefixed with its entry of notes unless that is
+// NULL
+void displayDevices(VkPhysicalDevice *devices, uint32_t deviceCount,
+                    const char **notes) {
 
     for (uint32_t i = 0; i < deviceCount; i++) {
+        fprintf(stdout, "\t");
+
+        if (notes) {
+            fprintf(stdout, "[%s] ", notes[i]);
+        }
+
         displayDevice(&devices[i]);
     }
 }
@@ -1,4 +1,11 @@
+#include "allocator.c"
+#include "bench.c"
+#include "filewatch.c"
+#include "framewriter.c"
 #include "helpers.c"
+#include "shaders.c"
+#include "taskgraph.c"
+#include "threadpool.c"
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -6,8 +13,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <vulkan/vulkan_core.h>
 
 #define GLFW_INCLUDE_VULKAN
@@ -16,11 +25,51 @@
 #include <cglm/cglm.h>
 #include <cglm/mat4.h>
 #include <cglm/vec4.h>
+#include <math.h>
 
 const uint32_t WIDTH = 800;
 const uint32_t HEIGHT = 600;
 
-const uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+// upper bound of --frames-in-flight, sizes the per-frame context ring
+#define MAX_FRAMES_IN_FLIGHT 4
+
+const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+
+// upper bound of --record-threads, each one gets a command pool per frame slot
+#define MAX_RECORD_THREADS 16
+
+// local size of particles.comp, one invocation per particle
+#define PARTICLE_GROUP_SIZE 256
+
+// draw calls in the scene, --draws raises it to load the recording path
+const uint32_t DEFAULT_DRAW_COUNT = 1;
+
+// copies of the mesh each draw call renders, set with --instances
+const uint32_t DEFAULT_INSTANCE_COUNT = 1;
+
+// size of each chunk --compare-streaming uploads unless --stream-mib is given
+const uint32_t DEFAULT_STREAM_MIB = 16;
+
+// particles simulated by --async-compute unless --particles says otherwise
+const uint32_t DEFAULT_PARTICLE_COUNT = 1 << 20;
+
+// CPU waits on the timeline longer than this are reported as slow frames
+const uint32_t DEFAULT_SLOW_FRAME_MS = 100;
+
+// as many as the startup graph has independent branches after the device
+const uint32_t DEFAULT_STARTUP_THREADS = 4;
+
+// headless runs have no window to close, so they stop after this many frames
+// unless --frames says otherwise
+const uint32_t DEFAULT_HEADLESS_FRAMES = 1000;
+
+const char *PIPELINE_CACHE_PATH = "pipeline_cache.bin";
+
+const uint32_t DEFAULT_BENCH_WARMUP_FRAMES = 100;
+const uint32_t DEFAULT_BENCH_FRAMES = 1000;
+
+// offscreen color target, mandatory color attachment format on every device
+const VkFormat OFFSCREEN_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
 
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
@@ -34,6 +83,493 @@ const uint32_t validationLayerCount = 1;
 const char *deviceExtensions[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
 const uint32_t deviceExtensionsCount = 1;
 
+typedef enum {
+    PRESENT_POWER_SAVING, // vsync locked, FIFO_RELAXED then FIFO
+    PRESENT_LOW_LATENCY,  // MAILBOX, then IMMEDIATE, then FIFO
+    PRESENT_UNCAPPED,     // IMMEDIATE, then MAILBOX, then FIFO
+    PRESENT_POLICY_COUNT,
+} PresentPolicy;
+
+const char *presentPolicyNames[PRESENT_POLICY_COUNT] = {
+    "power-saving",
+    "low-latency",
+    "uncapped",
+};
+
+typedef enum {
+    BLEND_OPAQUE, // blending off, the fragment replaces what is there
+    BLEND_ALPHA,  // over what is there, by the fragment's alpha
+    BLEND_ADDITIVE,
+    BLEND_MODE_COUNT,
+} BlendMode;
+
+const char *blendModeNames[BLEND_MODE_COUNT] = {
+    "opaque",
+    "alpha",
+    "additive",
+};
+
+// indexed by VkCullModeFlags, front and back together is left out
+#define CULL_MODE_COUNT 3
+
+const char *cullModeNames[CULL_MODE_COUNT] = {"none", "front", "back"};
+
+typedef struct {
+    bool headless;
+    uint32_t frameCount; // 0 runs until the window is closed
+    bool bench;
+    uint32_t warmupCount;
+    const char *benchOut; // .json or .csv, NULL for text only
+    bool pipelineCache;
+    PresentPolicy presentPolicy;
+    uint32_t framesInFlight;
+    bool sweepFramesInFlight;
+    uint32_t swapchainImages; // 0 picks the count from the present mode
+    bool replay;
+    bool compareRecording;
+    uint32_t drawCount;
+    uint32_t instanceCount;
+    uint32_t sweepInstances; // largest count of the sweep, 0 for no sweep
+    uint32_t recordThreads; // 0 records on the main thread
+    bool sweepRecordThreads;
+    uint32_t meshGrid; // 0 draws the single triangle
+    bool gpuCull;
+    uint32_t streamMib; // chunk uploaded per frame, 0 streams nothing
+    bool compareStreaming;
+    uint32_t particleCount; // 0 runs no simulation
+    bool asyncCompute;
+    bool compareAsyncCompute;
+    bool timelineSync;
+    uint32_t slowFrameMs;
+    bool renderPass; // keep the render pass where dynamic rendering works
+    const char *device; // index, UUID or part of the name, NULL to rank
+    const char *readbackDir; // NULL copies no frames out
+    FrameFormat readbackFormat;
+    bool watchShaders;
+    bool shadersFromDisk; // instead of the SPIR-V built into the binary
+    uint32_t startupThreads;
+    BlendMode blend;
+    VkCullModeFlags cullMode;
+    uint32_t alphaPercent;
+    bool instanceColors;
+    bool prewarmPipelines;
+    bool compareBlend;
+    uint32_t benchAllocator; // operations, 0 to render as usual
+} Options;
+
+void printUsage(const char *program) {
+    fprintf(stdout,
+            "usage: %s [--headless] [--frames N] [--bench] [--warmup N]\n"
+            "          [--bench-out FILE]\n"
+            "\t--headless        render offscreen, without a window or "
+            "swapchain\n"
+            "\t--frames N        stop after N frames (headless default: %d)\n"
+            "\t--bench           time N measured frames (default: %d) and "
+            "report per-phase percentiles\n"
+            "\t--warmup N        frames to skip before measuring (default: "
+            "%d)\n"
+            "\t--bench-out FILE  also write the report as JSON, or CSV for "
+            "*.csv\n"
+            "\t--no-pipeline-cache  neither load nor save %s\n"
+            "\t--present-mode POLICY  power-saving (default), low-latency "
+            "or uncapped\n"
+            "\t--frames-in-flight N  CPU/GPU overlap depth, 1 to %d "
+            "(default: %d)\n"
+            "\t--sweep-frames-in-flight  benchmark every depth from 1 to %d\n"
+            "\t--swapchain-images N  ask for N swapchain images instead of "
+            "the present mode's default\n"
+            "\t--replay          record one command buffer per image up "
+            "front and resubmit it\n"
+            "\t--compare-recording  benchmark per-frame recording against "
+            "replay\n"
+            "\t--draws N         draw calls per frame (default: %d)\n"
+            "\t--instances N     instances of the mesh per draw call "
+            "(default: %d)\n"
+            "\t--sweep-instances N  benchmark 1, 10, 100... up to N objects "
+            "as instances of one draw and as one draw each\n"
+            "\t--record-threads N  record secondary command buffers on N "
+            "worker threads, up to %d\n"
+            "\t--sweep-record-threads  benchmark recording on the main "
+            "thread and on 1, 2, 4... workers\n"
+            "\t--mesh-grid N     draw an N x N grid of quads instead of the "
+            "triangle\n"
+            "\t--gpu-cull        frustum cull instances in a compute pass "
+            "and draw the rest indirectly\n"
+            "\t--stream-mib N    upload an N MiB chunk on the transfer "
+            "queue every frame while rendering\n"
+            "\t--compare-streaming  benchmark without and with streaming "
+            "(default chunk: %d MiB)\n"
+            "\t--particles N     simulate N particles in a compute pass "
+            "every frame\n"
+            "\t--async-compute   run the simulation on a compute queue, "
+            "overlapping rendering (default: %d particles)\n"
+            "\t--compare-async-compute  benchmark the simulation on the "
+            "graphics queue and on the compute queue\n"
+            "\t--timeline-sync   synchronize frames and queues with timeline "
+            "semaphores instead of fences\n"
+            "\t--slow-frame-ms N  with --timeline-sync, report frames the "
+            "CPU waits on longer than N ms (default: %d)\n"
+            "\t--render-pass     render through a render pass and "
+            "framebuffers even where dynamic rendering is supported\n"
+            "\t--device ID       use the device with this index, UUID or "
+            "name (part of it) instead of the best ranked one\n"
+            "\t--readback DIR    copy every frame back and write it to DIR "
+            "on a worker thread\n"
+            "\t--readback-format FORMAT  ppm (default) or raw, 4 bytes per "
+            "pixel as rendered\n"
+            "\t--watch-shaders   rebuild the graphics pipeline in the "
+            "background when vert.spv or frag.spv change\n"
+            "\t--shaders-from-disk  load the *.spv files from the working "
+            "directory instead of the SPIR-V built in\n"
+            "\t--startup-threads N  threads running the startup phases, 1 "
+            "runs them in sequence (default: %d)\n"
+            "\t--blend MODE      opaque (default), alpha or additive\n"
+            "\t--cull MODE       none, front or back (default)\n"
+            "\t--alpha-percent N  alpha of every fragment, to blend by "
+            "(default: 100)\n"
+            "\t--no-instance-colors  draw the vertex colors untinted\n"
+            "\t--prewarm-pipelines  create every blend and cull variant "
+            "at startup, on the startup threads\n"
+            "\t--compare-blend   benchmark the alpha blended pipeline "
+            "against the opaque one\n"
+            "\t--bench-allocator N  time N CPU-side allocator operations "
+            "and exit\n",
+            program, DEFAULT_HEADLESS_FRAMES, DEFAULT_BENCH_FRAMES,
+            DEFAULT_BENCH_WARMUP_FRAMES, PIPELINE_CACHE_PATH,
+            MAX_FRAMES_IN_FLIGHT, DEFAULT_FRAMES_IN_FLIGHT,
+            MAX_FRAMES_IN_FLIGHT, DEFAULT_DRAW_COUNT, DEFAULT_INSTANCE_COUNT,
+            MAX_RECORD_THREADS, DEFAULT_STREAM_MIB, DEFAULT_PARTICLE_COUNT,
+            DEFAULT_SLOW_FRAME_MS, DEFAULT_STARTUP_THREADS);
+}
+
+uint32_t parseCount(const char *option, const char *value) {
+    char *end;
+    unsigned long count = strtoul(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || count > UINT32_MAX) {
+        fprintf(stderr, "ERROR: %s expects a non-negative integer, got '%s'.\n",
+                option, value);
+        exit(1);
+    }
+
+    return (uint32_t)count;
+}
+
+PresentPolicy parsePresentPolicy(const char *value) {
+    for (uint32_t i = 0; i < PRESENT_POLICY_COUNT; i++) {
+        if (strcmp(value, presentPolicyNames[i]) == 0) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "ERROR: unknown present mode policy '%s'.\n", value);
+    exit(1);
+}
+
+BlendMode parseBlendMode(const char *value) {
+    for (uint32_t i = 0; i < BLEND_MODE_COUNT; i++) {
+        if (strcmp(value, blendModeNames[i]) == 0) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "ERROR: unknown blend mode '%s'.\n", value);
+    exit(1);
+}
+
+VkCullModeFlags parseCullMode(const char *value) {
+    for (uint32_t i = 0; i < CULL_MODE_COUNT; i++) {
+        if (strcmp(value, cullModeNames[i]) == 0) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "ERROR: unknown cull mode '%s'.\n", value);
+    exit(1);
+}
+
+FrameFormat parseFrameFormat(const char *value) {
+    for (uint32_t i = 0; i < FRAME_FORMAT_COUNT; i++) {
+        if (strcmp(value, frameFormatNames[i]) == 0) {
+            return i;
+        }
+    }
+
+    fprintf(stderr, "ERROR: unknown readback format '%s'.\n", value);
+    exit(1);
+}
+
+Options parseOptions(int argc, char **argv) {
+    Options options = {
+        .headless = false,
+        .frameCount = 0,
+        .bench = false,
+        .warmupCount = DEFAULT_BENCH_WARMUP_FRAMES,
+        .benchOut = NULL,
+        .pipelineCache = true,
+        .presentPolicy = PRESENT_POWER_SAVING,
+        .framesInFlight = DEFAULT_FRAMES_IN_FLIGHT,
+        .sweepFramesInFlight = false,
+        .swapchainImages = 0,
+        .replay = false,
+        .compareRecording = false,
+        .drawCount = DEFAULT_DRAW_COUNT,
+        .instanceCount = DEFAULT_INSTANCE_COUNT,
+        .sweepInstances = 0,
+        .recordThreads = 0,
+        .sweepRecordThreads = false,
+        .meshGrid = 0,
+        .gpuCull = false,
+        .streamMib = 0,
+        .compareStreaming = false,
+        .particleCount = 0,
+        .asyncCompute = false,
+        .compareAsyncCompute = false,
+        .timelineSync = false,
+        .slowFrameMs = DEFAULT_SLOW_FRAME_MS,
+        .renderPass = false,
+        .device = NULL,
+        .readbackDir = NULL,
+        .readbackFormat = FRAME_FORMAT_PPM,
+        .watchShaders = false,
+        .shadersFromDisk = false,
+        .startupThreads = DEFAULT_STARTUP_THREADS,
+        .blend = BLEND_OPAQUE,
+        .cullMode = VK_CULL_MODE_BACK_BIT,
+        .alphaPercent = 100,
+        .instanceColors = true,
+        .prewarmPipelines = false,
+        .compareBlend = false,
+        .benchAllocator = 0,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            options.headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.frameCount = parseCount(argv[i], argv[i + 1]);
+            i++;
+
+            // 0 is what leaving --frames out means
+            if (options.frameCount == 0) {
+                fprintf(stderr, "ERROR: --frames must be at least 1.\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            options.bench = true;
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            options.warmupCount = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--bench-out") == 0 && i + 1 < argc) {
+            options.bench = true;
+            options.benchOut = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "--no-pipeline-cache") == 0) {
+            options.pipelineCache = false;
+        } else if (strcmp(argv[i], "--present-mode") == 0 && i + 1 < argc) {
+            options.presentPolicy = parsePresentPolicy(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--frames-in-flight") == 0 &&
+                   i + 1 < argc) {
+            options.framesInFlight = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--swapchain-images") == 0 &&
+                   i + 1 < argc) {
+            options.swapchainImages = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--draws") == 0 && i + 1 < argc) {
+            options.drawCount = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            options.instanceCount = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--sweep-instances") == 0 &&
+                   i + 1 < argc) {
+            options.bench = true;
+            options.sweepInstances = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--record-threads") == 0 && i + 1 < argc) {
+            options.recordThreads = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--sweep-record-threads") == 0) {
+            options.bench = true;
+            options.sweepRecordThreads = true;
+        } else if (strcmp(argv[i], "--mesh-grid") == 0 && i + 1 < argc) {
+            options.meshGrid = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--bench-allocator") == 0 &&
+                   i + 1 < argc) {
+            options.benchAllocator = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--gpu-cull") == 0) {
+            options.gpuCull = true;
+        } else if (strcmp(argv[i], "--stream-mib") == 0 && i + 1 < argc) {
+            options.streamMib = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--compare-streaming") == 0) {
+            options.bench = true;
+            options.compareStreaming = true;
+        } else if (strcmp(argv[i], "--particles") == 0 && i + 1 < argc) {
+            options.particleCount = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--async-compute") == 0) {
+            options.asyncCompute = true;
+        } else if (strcmp(argv[i], "--compare-async-compute") == 0) {
+            options.bench = true;
+            options.compareAsyncCompute = true;
+        } else if (strcmp(argv[i], "--timeline-sync") == 0) {
+            options.timelineSync = true;
+        } else if (strcmp(argv[i], "--render-pass") == 0) {
+            options.renderPass = true;
+        } else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+            options.device = argv[++i];
+        } else if (strcmp(argv[i], "--readback") == 0 && i + 1 < argc) {
+            options.readbackDir = argv[++i];
+        } else if (strcmp(argv[i], "--readback-format") == 0 &&
+                   i + 1 < argc) {
+            options.readbackFormat = parseFrameFormat(argv[++i]);
+        } else if (strcmp(argv[i], "--watch-shaders") == 0) {
+            options.watchShaders = true;
+        } else if (strcmp(argv[i], "--shaders-from-disk") == 0) {
+            options.shadersFromDisk = true;
+        } else if (strcmp(argv[i], "--startup-threads") == 0 &&
+                   i + 1 < argc) {
+            options.startupThreads = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--blend") == 0 && i + 1 < argc) {
+            options.blend = parseBlendMode(argv[++i]);
+        } else if (strcmp(argv[i], "--cull") == 0 && i + 1 < argc) {
+            options.cullMode = parseCullMode(argv[++i]);
+        } else if (strcmp(argv[i], "--alpha-percent") == 0 && i + 1 < argc) {
+            options.alphaPercent = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--no-instance-colors") == 0) {
+            options.instanceColors = false;
+        } else if (strcmp(argv[i], "--prewarm-pipelines") == 0) {
+            options.prewarmPipelines = true;
+        } else if (strcmp(argv[i], "--compare-blend") == 0) {
+            options.bench = true;
+            options.compareBlend = true;
+        } else if (strcmp(argv[i], "--slow-frame-ms") == 0 && i + 1 < argc) {
+            options.slowFrameMs = parseCount(argv[i], argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            options.replay = true;
+        } else if (strcmp(argv[i], "--compare-recording") == 0) {
+            options.bench = true;
+            options.compareRecording = true;
+        } else if (strcmp(argv[i], "--sweep-frames-in-flight") == 0) {
+            options.bench = true;
+            options.sweepFramesInFlight = true;
+        } else if (strcmp(argv[i], "--help") == 0) {
+            printUsage(argv[0]);
+            exit(0);
+        } else {
+            fprintf(stderr, "ERROR: unknown option '%s'.\n", argv[i]);
+            printUsage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (options.framesInFlight < 1 ||
+        options.framesInFlight > MAX_FRAMES_IN_FLIGHT) {
+        fprintf(stderr, "ERROR: --frames-in-flight must be between 1 and %d.\n",
+                MAX_FRAMES_IN_FLIGHT);
+        exit(1);
+    }
+
+    if (options.instanceCount < 1) {
+        fprintf(stderr, "ERROR: --instances must be at least 1.\n");
+        exit(1);
+    }
+
+    // replayed command buffers are re-recorded with the device idle, which
+    // would stall the render loop on every reload
+    if (options.watchShaders && (options.replay || options.compareRecording)) {
+        fprintf(stderr, "ERROR: --watch-shaders swaps pipelines without "
+                        "waiting for the GPU, it cannot be combined with "
+                        "--replay or --compare-recording.\n");
+        exit(1);
+    }
+
+    if (options.alphaPercent > 100) {
+        fprintf(stderr, "ERROR: --alpha-percent must be at most 100.\n");
+        exit(1);
+    }
+
+    // replayed command buffers would share one set of cull outputs between
+    // submissions that can overlap
+    if (options.gpuCull && (options.replay || options.compareRecording)) {
+        fprintf(stderr, "ERROR: --gpu-cull records every frame, it cannot be "
+                        "combined with --replay or --compare-recording.\n");
+        exit(1);
+    }
+
+    if (options.compareStreaming && options.streamMib == 0) {
+        options.streamMib = DEFAULT_STREAM_MIB;
+    }
+
+    // the graphics queue acquires each chunk inside the frame's own commands
+    if (options.streamMib > 0 &&
+        (options.replay || options.compareRecording)) {
+        fprintf(stderr, "ERROR: streaming records every frame, it cannot be "
+                        "combined with --replay or --compare-recording.\n");
+        exit(1);
+    }
+
+    if ((options.asyncCompute || options.compareAsyncCompute) &&
+        options.particleCount == 0) {
+        options.particleCount = DEFAULT_PARTICLE_COUNT;
+    }
+
+    if (options.particleCount > PARTICLE_GROUP_SIZE * 65535) {
+        fprintf(stderr, "ERROR: --particles must be at most %d.\n",
+                PARTICLE_GROUP_SIZE * 65535);
+        exit(1);
+    }
+
+    if (options.particleCount > 0 &&
+        (options.replay || options.compareRecording)) {
+        fprintf(stderr, "ERROR: the particle simulation is recorded every "
+                        "frame, it cannot be combined with --replay or "
+                        "--compare-recording.\n");
+        exit(1);
+    }
+
+    // replayed command buffers would all copy into the same buffers
+    if (options.readbackDir && (options.replay || options.compareRecording)) {
+        fprintf(stderr, "ERROR: --readback records every frame, it cannot be "
+                        "combined with --replay or --compare-recording.\n");
+        exit(1);
+    }
+
+    if (options.slowFrameMs == 0) {
+        fprintf(stderr, "ERROR: --slow-frame-ms must be at least 1.\n");
+        exit(1);
+    }
+
+    if (options.startupThreads < 1) {
+        fprintf(stderr, "ERROR: --startup-threads must be at least 1.\n");
+        exit(1);
+    }
+
+    if (options.recordThreads > MAX_RECORD_THREADS) {
+        fprintf(stderr, "ERROR: --record-threads must be at most %d.\n",
+                MAX_RECORD_THREADS);
+        exit(1);
+    }
+
+    if (options.bench && options.frameCount == 0) {
+        options.frameCount = DEFAULT_BENCH_FRAMES;
+    }
+
+    if (options.headless && options.frameCount == 0) {
+        options.frameCount = DEFAULT_HEADLESS_FRAMES;
+    }
+
+    return options;
+}
+
 bool checkValidationLayerSupport() {
     uint32_t availableLayerCount;
     vkEnumerateInstanceLayerProperties(&availableLayerCount, NULL);
@@ -92,6 +628,42 @@ bool checkDeviceExtensionSupport(VkPhysicalDevice device) {
     return true;
 }
 
+bool hasDeviceExtension(VkPhysicalDevice device, const char *name) {
+    uint32_t availableExtensionCount;
+    vkEnumerateDeviceExtensionProperties(device, NULL, &availableExtensionCount,
+                                         NULL);
+
+    VkExtensionProperties availableExtensions[availableExtensionCount];
+    vkEnumerateDeviceExtensionProperties(device, NULL, &availableExtensionCount,
+                                         availableExtensions);
+
+    for (uint32_t i = 0; i < availableExtensionCount; i++) {
+        if (strcmp(name, availableExtensions[i].extensionName) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool hasInstanceExtension(const char *name) {
+    uint32_t availableExtensionCount;
+    vkEnumerateInstanceExtensionProperties(NULL, &availableExtensionCount,
+                                           NULL);
+
+    VkExtensionProperties availableExtensions[availableExtensionCount];
+    vkEnumerateInstanceExtensionProperties(NULL, &availableExtensionCount,
+                                           availableExtensions);
+
+    for (uint32_t i = 0; i < availableExtensionCount; i++) {
+        if (strcmp(name, availableExtensions[i].extensionName) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static VKAPI_ATTR VkBool32 VKAPI_CALL
 debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
               VkDebugUtilsMessageTypeFlagsEXT messageType,
@@ -160,54 +732,116 @@ void DestroyDebugUtilsMessengerEXT(VkInstance instance,
     }
 }
 
-GLFWwindow *initWindow() {
+void framebufferResizeCallback(GLFWwindow *window, int width, int height) {
+    bool *framebufferResized = glfwGetWindowUserPointer(window);
+    *framebufferResized = true;
+}
+
+GLFWwindow *initWindow(bool *framebufferResized) {
     glfwInit();
 
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
-    return glfwCreateWindow(WIDTH, HEIGHT, "Vulkan window", NULL, NULL);
-}
+    GLFWwindow *window =
+        glfwCreateWindow(WIDTH, HEIGHT, "Vulkan window", NULL, NULL);
 
-const char **getRequiredExtensions(uint32_t *extensionCount) {
-    const char **required;
+    glfwSetWindowUserPointer(window, framebufferResized);
+    glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
 
-    required = glfwGetRequiredInstanceExtensions(extensionCount);
+    return window;
+}
+
+// properties2 adds VK_KHR_get_physical_device_properties2, which device
+// extensions such as VK_KHR_timeline_semaphore depend on below Vulkan 1.1
+const char **getRequiredExtensions(bool headless, bool properties2,
+                                   uint32_t *extensionCount) {
+    const char **required = NULL;
+    uint32_t requiredCount = 0;
 
-    if (!enableValidationLayers) {
-        return required;
+    // without a window there is no surface, so no WSI extensions are needed
+    if (!headless) {
+        required = glfwGetRequiredInstanceExtensions(&requiredCount);
     }
 
-    const char **result = malloc((*extensionCount + 1) * sizeof(const char *));
+    const char **result = malloc((requiredCount + 2) * sizeof(const char *));
 
     // no free called, must outlive instance which is end of program
 
     if (!result) {
-        return required;
+        fprintf(stderr, "ERROR: failed to allocate instance extensions.\n");
+        exit(1);
+    }
+
+    if (requiredCount > 0) {
+        memcpy(result, required, requiredCount * sizeof(const char *));
     }
 
-    memcpy(result, required, *extensionCount * sizeof(const char *));
+    *extensionCount = requiredCount;
+
+    if (properties2) {
+        result[(*extensionCount)++] =
+            VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME;
+    }
 
-    result[*extensionCount] = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
-    ++*extensionCount;
+    if (enableValidationLayers) {
+        result[(*extensionCount)++] = VK_EXT_DEBUG_UTILS_EXTENSION_NAME;
+    }
 
     return result;
 }
 
-VkInstance createInstance() {
+/**
+ * Creates the instance for Vulkan 1.3 when the loader supports it, which
+ * dynamic rendering needs, and for 1.0 otherwise. Returns the version in
+ * apiVersion.
+ *
+ * timelineSemaphores makes sure VK_KHR_timeline_semaphore can be enabled on
+ * the device, a 1.0 instance needs an extension of its own for that.
+ */
+VkInstance createInstance(bool headless, bool timelineSemaphores,
+                          uint32_t *apiVersion) {
+    // a 1.0 loader does not have the query at all
+    PFN_vkEnumerateInstanceVersion enumerateInstanceVersion =
+        (PFN_vkEnumerateInstanceVersion)vkGetInstanceProcAddr(
+            NULL, "vkEnumerateInstanceVersion");
+
+    uint32_t loaderVersion = VK_API_VERSION_1_0;
+
+    if (enumerateInstanceVersion) {
+        enumerateInstanceVersion(&loaderVersion);
+    }
+
+    *apiVersion = loaderVersion >= VK_API_VERSION_1_3 ? VK_API_VERSION_1_3
+                                                      : VK_API_VERSION_1_0;
+
     VkApplicationInfo appInfo = {
         .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
         .pApplicationName = "Hello Triangle",
         .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
         .pEngineName = "No Engine",
         .engineVersion = VK_MAKE_VERSION(1, 0, 0),
-        .apiVersion = VK_API_VERSION_1_0,
+        .apiVersion = *apiVersion,
     };
 
     // displayInstanceExtensions();
 
+    bool properties2 =
+        timelineSemaphores && *apiVersion < VK_API_VERSION_1_1;
+
+    if (properties2 &&
+        !hasInstanceExtension(
+            VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)) {
+        fprintf(stderr,
+                "ERROR: --timeline-sync needs Vulkan 1.1 or the %s "
+                "extension.\n",
+                VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+        exit(1);
+    }
+
     uint32_t extensionCount;
-    const char **extensions = getRequiredExtensions(&extensionCount);
+    const char **extensions =
+        getRequiredExtensions(headless, properties2, &extensionCount);
 
     VkInstanceCreateInfo createInfo = {
         .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -253,6 +887,9 @@ VkSurfaceKHR createSurface(VkInstance instance, GLFWwindow *window) {
     return surface;
 }
 
+// The cull pass is dispatched in the frame's command buffer, so the family
+// has to run compute as well. The spec guarantees one such family whenever
+// there is a graphics one.
 int32_t getGraphicsFamily(VkPhysicalDevice device) {
 
     uint32_t queueFamilyCount;
@@ -263,7 +900,9 @@ int32_t getGraphicsFamily(VkPhysicalDevice device) {
                                              queueFamilies);
 
     for (int32_t i = 0; i < queueFamilyCount; i++) {
-        if (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+        VkQueueFlags flags = queueFamilies[i].queueFlags;
+
+        if ((flags & VK_QUEUE_GRAPHICS_BIT) && (flags & VK_QUEUE_COMPUTE_BIT)) {
             return i;
         }
     }
@@ -292,13 +931,99 @@ int32_t getPresentationFamily(VkPhysicalDevice device, VkSurfaceKHR surface) {
     return -1;
 }
 
-bool isDeviceSuitable(VkPhysicalDevice device, VkSurfaceKHR surface) {
-    VkPhysicalDeviceProperties deviceProps;
-    vkGetPhysicalDeviceProperties(device, &deviceProps);
+/**
+ * Returns a family that can transfer but not render, usually backed by the
+ * copy engines so its work overlaps the graphics queue's, or -1. Families
+ * without compute are preferred, those are the plain copy engines.
+ */
+int32_t getTransferFamily(VkPhysicalDevice device) {
+    uint32_t queueFamilyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, NULL);
+
+    VkQueueFamilyProperties queueFamilies[queueFamilyCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+                                             queueFamilies);
+
+    int32_t found = -1;
+
+    for (uint32_t i = 0; i < queueFamilyCount; i++) {
+        VkQueueFlags flags = queueFamilies[i].queueFlags;
+
+        if (!(flags & VK_QUEUE_TRANSFER_BIT) ||
+            (flags & VK_QUEUE_GRAPHICS_BIT)) {
+            continue;
+        }
+
+        if (!(flags & VK_QUEUE_COMPUTE_BIT)) {
+            return i;
+        }
+
+        if (found == -1) {
+            found = i;
+        }
+    }
+
+    return found;
+}
+
+// Returns a family that can compute but not render, whose queue runs
+// alongside the graphics one on most GPUs, or -1
+int32_t getComputeFamily(VkPhysicalDevice device) {
+    uint32_t queueFamilyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, NULL);
+
+    VkQueueFamilyProperties queueFamilies[queueFamilyCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+                                             queueFamilies);
+
+    for (uint32_t i = 0; i < queueFamilyCount; i++) {
+        VkQueueFlags flags = queueFamilies[i].queueFlags;
 
-    if (deviceProps.deviceType != VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
+        if ((flags & VK_QUEUE_COMPUTE_BIT) &&
+            !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// How the draw count of the cull pass reaches the draws
+typedef enum {
+    INDIRECT_COUNT_NONE,      // every command is drawn, the culled ones empty
+    INDIRECT_COUNT_EXTENSION, // VK_KHR_draw_indirect_count
+    INDIRECT_COUNT_CORE,      // the drawIndirectCount feature of Vulkan 1.2
+} IndirectCountSupport;
+
+// What the options need from a device on top of graphics and presentation
+typedef struct {
+    bool indirectDraws;      // --gpu-cull
+    bool timelineSemaphores; // --timeline-sync
+} DeviceRequirements;
+
+bool isDeviceSuitable(VkPhysicalDevice device, VkSurfaceKHR surface,
+                      const DeviceRequirements *requirements) {
+    if (getGraphicsFamily(device) == -1)
         return false;
 
+    if (requirements->indirectDraws) {
+        VkPhysicalDeviceFeatures features;
+        vkGetPhysicalDeviceFeatures(device, &features);
+
+        if (!features.multiDrawIndirect || !features.drawIndirectFirstInstance)
+            return false;
+    }
+
+    if (requirements->timelineSemaphores &&
+        !hasDeviceExtension(device, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME))
+        return false;
+
+    // headless (surface is VK_NULL_HANDLE) only needs a graphics queue, so
+    // integrated GPUs and software rasterizers such as lavapipe are fine
+    if (surface == VK_NULL_HANDLE) {
+        return true;
+    }
+
     if (!checkDeviceExtensionSupport(device)) {
         return false;
     }
@@ -315,117 +1040,484 @@ bool isDeviceSuitable(VkPhysicalDevice device, VkSurfaceKHR surface) {
     if (presentationCount == 0)
         return false;
 
-    if (getGraphicsFamily(device) == -1)
-        return false;
-
     if (getPresentationFamily(device, surface) == -1)
         return false;
 
     return true;
 }
 
-VkPhysicalDevice pickPhysicalDevice(VkInstance instance, VkSurfaceKHR surface) {
-    VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+/**
+ * Ranks a suitable device, -1 for an unsuitable one.
+ *
+ * The type dominates, discrete before integrated before virtual before
+ * software, then come the largest device local heap, the API version and
+ * dedicated transfer and compute families. The heap is capped so that a
+ * large shared heap never lifts an integrated GPU above a discrete one.
+ */
+int64_t scoreDevice(VkPhysicalDevice device, VkSurfaceKHR surface,
+                    const DeviceRequirements *requirements) {
+    if (!isDeviceSuitable(device, surface, requirements)) {
+        return -1;
+    }
 
-    uint32_t deviceCount = 0;
-    vkEnumeratePhysicalDevices(instance, &deviceCount, NULL);
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(device, &deviceProps);
 
-    if (deviceCount == 0) {
-        fprintf(stderr, "ERROR: failed to find GPUs with Vulkan support.\n");
-        exit(1);
+    int64_t score = 0;
+
+    switch (deviceProps.deviceType) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        score += 100000;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        score += 50000;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        score += 20000;
+        break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        score += 10000;
+        break;
+    default:
+        break;
     }
 
-    VkPhysicalDevice devices[deviceCount];
-    vkEnumeratePhysicalDevices(instance, &deviceCount, devices);
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties(device, &memProperties);
 
-    // displayDevices(devices, deviceCount);
+    VkDeviceSize localHeap = 0;
+    for (uint32_t i = 0; i < memProperties.memoryHeapCount; i++) {
+        VkMemoryHeap *heap = &memProperties.memoryHeaps[i];
 
-    for (uint32_t i = 0; i < deviceCount; i++) {
-        if (isDeviceSuitable(devices[i], surface)) {
-            physicalDevice = devices[i];
-            break;
+        if ((heap->flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) &&
+            heap->size > localHeap) {
+            localHeap = heap->size;
         }
     }
 
-    if (physicalDevice == VK_NULL_HANDLE) {
-        fprintf(stderr, "ERROR: failed to find a suitable GPU.\n");
-        exit(1);
-    }
-
-    fprintf(stdout, "using ");
-    displayDevice(&physicalDevice);
-
-    return physicalDevice;
-}
+    // a point per 16 MiB, up to 625 GiB
+    int64_t heapScore = (int64_t)(localHeap / (16 * 1024 * 1024));
+    score += heapScore < 40000 ? heapScore : 40000;
 
-VkDevice createLogicalDevice(VkPhysicalDevice physicalDevice,
-                             VkSurfaceKHR surface) {
-    int32_t graphicsIndex = getGraphicsFamily(physicalDevice);
-    int32_t presentaionIndex = getPresentationFamily(physicalDevice, surface);
+    // the major version outweighs any minor, and the whole stays below the
+    // gap to the next type; a variant other than Vulkan itself, such as
+    // Vulkan SC, gets nothing for its version
+    uint32_t apiVersion = deviceProps.apiVersion;
 
-    if (graphicsIndex == -1 || presentaionIndex == -1) {
-        fprintf(stderr,
-                "ERROR: failed to get graphics and presentation families.\n");
-        exit(1);
+    if (VK_API_VERSION_VARIANT(apiVersion) == 0) {
+        int64_t minor = VK_API_VERSION_MINOR(apiVersion);
+        int64_t apiScore = VK_API_VERSION_MAJOR(apiVersion) * 4000 +
+                           (minor < 7 ? minor : 7) * 500;
+        score += apiScore < 8000 ? apiScore : 8000;
     }
 
-    uint32_t queueCreateInfoCount;
+    if (getTransferFamily(device) != -1) {
+        score += 500;
+    }
 
-    if (graphicsIndex == presentaionIndex) {
-        queueCreateInfoCount = 1;
-    } else {
-        queueCreateInfoCount = 2;
+    if (getComputeFamily(device) != -1) {
+        score += 500;
     }
 
-    VkDeviceQueueCreateInfo queueCreateInfos[queueCreateInfoCount];
+    return score;
+}
 
-    float queuePriority = 1.0f;
+const char *deviceTypeName(VkPhysicalDeviceType type) {
+    switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:
+        return "discrete";
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:
+        return "integrated";
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:
+        return "virtual";
+    case VK_PHYSICAL_DEVICE_TYPE_CPU:
+        return "cpu";
+    default:
+        return "other";
+    }
+}
 
-    for (uint32_t i = 0; i < queueCreateInfoCount; i++) {
+// A device of the ranking, with what --device can pick it by
+typedef struct {
+    VkPhysicalDevice device;
+    uint32_t index; // enumeration order
+    int64_t score;  // -1 when unsuitable
+    char uuid[2 * VK_UUID_SIZE + 5]; // empty without Vulkan 1.1
+} DeviceCandidate;
 
-        VkDeviceQueueCreateInfo queueCreateInfo = {
-            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-            .queueCount = 1,
-            .pQueuePriorities = &queuePriority,
+// Formats the device UUID as 8-4-4-4-12 hex digits; the query needs
+// Vulkan 1.1 on both the instance and the device
+void getDeviceUuid(VkInstance instance, uint32_t instanceVersion,
+                   VkPhysicalDevice device, char *uuid) {
+    uuid[0] = '\0';
 
-        };
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(device, &deviceProps);
 
-        queueCreateInfos[i] = queueCreateInfo;
+    if (instanceVersion < VK_API_VERSION_1_1 ||
+        deviceProps.apiVersion < VK_API_VERSION_1_1) {
+        return;
     }
 
-    if (queueCreateInfoCount == 2) {
-        queueCreateInfos[0].queueFamilyIndex = graphicsIndex;
-        queueCreateInfos[1].queueFamilyIndex = presentaionIndex;
-    } else {
-        queueCreateInfos[0].queueFamilyIndex = graphicsIndex;
+    PFN_vkGetPhysicalDeviceProperties2 getProperties2 =
+        (PFN_vkGetPhysicalDeviceProperties2)vkGetInstanceProcAddr(
+            instance, "vkGetPhysicalDeviceProperties2");
+
+    if (!getProperties2) {
+        return;
     }
 
-    VkPhysicalDeviceFeatures deviceFeatures = {};
+    VkPhysicalDeviceIDProperties idProps = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES,
+    };
 
-    VkDeviceCreateInfo createInfo = {
-        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .pQueueCreateInfos = queueCreateInfos,
-        .queueCreateInfoCount = queueCreateInfoCount,
-        .pEnabledFeatures = &deviceFeatures,
-        .ppEnabledExtensionNames = deviceExtensions,
-        .enabledExtensionCount = 1,
-        .enabledLayerCount = 0,
+    VkPhysicalDeviceProperties2 props2 = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &idProps,
     };
 
-    if (enableValidationLayers) {
-        createInfo.enabledLayerCount = validationLayerCount;
-        createInfo.ppEnabledLayerNames = validationLayers;
+    getProperties2(device, &props2);
+
+    char *out = uuid;
+    for (uint32_t i = 0; i < VK_UUID_SIZE; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            *out++ = '-';
+        }
+        out += sprintf(out, "%02x", idProps.deviceUUID[i]);
     }
+}
 
-    VkDevice device;
+// Whether selector, as given to --device, names the candidate
+bool matchesDevice(const DeviceCandidate *candidate, const char *selector) {
+    char *end;
+    unsigned long index = strtoul(selector, &end, 10);
 
-    if (vkCreateDevice(physicalDevice, &createInfo, NULL, &device) !=
-        VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to create logical device.\n");
-        exit(1);
+    if (*selector != '\0' && *end == '\0') {
+        return index == candidate->index;
     }
 
-    return device;
+    if (candidate->uuid[0] != '\0' &&
+        strcasecmp(selector, candidate->uuid) == 0) {
+        return true;
+    }
+
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(candidate->device, &deviceProps);
+
+    return strstr(deviceProps.deviceName, selector) != NULL;
+}
+
+int compareCandidates(const void *a, const void *b) {
+    const DeviceCandidate *x = a;
+    const DeviceCandidate *y = b;
+
+    // best first, ties keep the enumeration order
+    if (x->score != y->score) {
+        return x->score < y->score ? 1 : -1;
+    }
+
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * Ranks every device and returns the best suitable one, or the one selector
+ * names (an index, a UUID or part of the name) when it is not NULL. The
+ * ranking is printed, so a process can be pinned to a GPU with --device.
+ */
+VkPhysicalDevice pickPhysicalDevice(VkInstance instance,
+                                    uint32_t instanceVersion,
+                                    VkSurfaceKHR surface,
+                                    const DeviceRequirements *requirements,
+                                    const char *selector) {
+    uint32_t deviceCount = 0;
+    vkEnumeratePhysicalDevices(instance, &deviceCount, NULL);
+
+    if (deviceCount == 0) {
+        fprintf(stderr, "ERROR: failed to find GPUs with Vulkan support.\n");
+        exit(1);
+    }
+
+    VkPhysicalDevice devices[deviceCount];
+    vkEnumeratePhysicalDevices(instance, &deviceCount, devices);
+
+    DeviceCandidate candidates[deviceCount];
+
+    for (uint32_t i = 0; i < deviceCount; i++) {
+        candidates[i] = (DeviceCandidate){
+            .device = devices[i],
+            .index = i,
+            .score = scoreDevice(devices[i], surface, requirements),
+        };
+        getDeviceUuid(instance, instanceVersion, devices[i],
+                      candidates[i].uuid);
+    }
+
+    qsort(candidates, deviceCount, sizeof(DeviceCandidate),
+          compareCandidates);
+
+    char notes[deviceCount][96];
+    const char *notePointers[deviceCount];
+
+    for (uint32_t i = 0; i < deviceCount; i++) {
+        const DeviceCandidate *candidate = &candidates[i];
+
+        VkPhysicalDeviceProperties deviceProps;
+        vkGetPhysicalDeviceProperties(candidate->device, &deviceProps);
+
+        int length = snprintf(
+            notes[i], sizeof(notes[i]), "index %d, %s, ", candidate->index,
+            deviceTypeName(deviceProps.deviceType));
+
+        if (candidate->score < 0) {
+            snprintf(notes[i] + length, sizeof(notes[i]) - length,
+                     "unsuitable");
+        } else {
+            snprintf(notes[i] + length, sizeof(notes[i]) - length,
+                     "score %lld", (long long)candidate->score);
+        }
+
+        if (candidate->uuid[0] != '\0') {
+            length = strlen(notes[i]);
+            snprintf(notes[i] + length, sizeof(notes[i]) - length,
+                     ", uuid %s", candidate->uuid);
+        }
+
+        devices[i] = candidate->device;
+        notePointers[i] = notes[i];
+    }
+
+    fprintf(stdout, "devices, best first:\n");
+    displayDevices(devices, deviceCount, notePointers);
+
+    const DeviceCandidate *picked = &candidates[0];
+
+    if (selector) {
+        picked = NULL;
+
+        for (uint32_t i = 0; i < deviceCount && !picked; i++) {
+            if (matchesDevice(&candidates[i], selector)) {
+                picked = &candidates[i];
+            }
+        }
+
+        if (!picked) {
+            fprintf(stderr, "ERROR: no device matches '%s'.\n", selector);
+            exit(1);
+        }
+    }
+
+    if (picked->score < 0) {
+        fprintf(stderr, "ERROR: failed to find a suitable GPU.\n");
+        exit(1);
+    }
+
+    VkPhysicalDevice physicalDevice = picked->device;
+
+    fprintf(stdout, "using ");
+    displayDevice(&physicalDevice);
+
+    return physicalDevice;
+}
+
+// Dynamic rendering and synchronization2 are core, and always supported, in
+// Vulkan 1.3, which both the instance and the device have to speak
+bool supportsDynamicRendering(VkPhysicalDevice physicalDevice,
+                              uint32_t instanceVersion) {
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProps);
+
+    return instanceVersion >= VK_API_VERSION_1_3 &&
+           deviceProps.apiVersion >= VK_API_VERSION_1_3;
+}
+
+// Prefers the extension, which 1.0 and 1.1 devices have too. The core
+// feature needs a 1.2 instance to be queried.
+IndirectCountSupport getIndirectCountSupport(VkPhysicalDevice physicalDevice,
+                                             uint32_t instanceVersion) {
+    if (hasDeviceExtension(physicalDevice,
+                           VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME)) {
+        return INDIRECT_COUNT_EXTENSION;
+    }
+
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProps);
+
+    if (instanceVersion < VK_API_VERSION_1_2 ||
+        deviceProps.apiVersion < VK_API_VERSION_1_2) {
+        return INDIRECT_COUNT_NONE;
+    }
+
+    VkPhysicalDeviceVulkan12Features vulkan12Features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    };
+
+    VkPhysicalDeviceFeatures2 features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &vulkan12Features,
+    };
+
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+    return vulkan12Features.drawIndirectCount ? INDIRECT_COUNT_CORE
+                                              : INDIRECT_COUNT_NONE;
+}
+
+/**
+ * Creates the device with one queue per family in use.
+ *
+ * indirectDraws enables the features the cull pass relies on, and
+ * indirectCount how its draw count is read, see getIndirectCountSupport.
+ */
+VkDevice createLogicalDevice(VkPhysicalDevice physicalDevice,
+                             VkSurfaceKHR surface, bool indirectDraws,
+                             IndirectCountSupport indirectCount,
+                             bool timelineSemaphores, bool dynamicRendering) {
+    int32_t graphicsIndex = getGraphicsFamily(physicalDevice);
+    int32_t presentaionIndex = graphicsIndex;
+
+    if (surface != VK_NULL_HANDLE) {
+        presentaionIndex = getPresentationFamily(physicalDevice, surface);
+    }
+
+    if (graphicsIndex == -1 || presentaionIndex == -1) {
+        fprintf(stderr,
+                "ERROR: failed to get graphics and presentation families.\n");
+        exit(1);
+    }
+
+    // one queue from each distinct family, the transfer and compute ones
+    // when there are dedicated families for them
+    int32_t families[] = {graphicsIndex, presentaionIndex,
+                          getTransferFamily(physicalDevice),
+                          getComputeFamily(physicalDevice)};
+    uint32_t familyCount = sizeof(families) / sizeof(families[0]);
+
+    VkDeviceQueueCreateInfo queueCreateInfos[familyCount];
+    uint32_t queueCreateInfoCount = 0;
+
+    float queuePriority = 1.0f;
+
+    for (uint32_t i = 0; i < familyCount; i++) {
+        bool seen = families[i] == -1;
+
+        for (uint32_t j = 0; j < queueCreateInfoCount && !seen; j++) {
+            seen = queueCreateInfos[j].queueFamilyIndex == families[i];
+        }
+
+        if (seen) {
+            continue;
+        }
+
+        queueCreateInfos[queueCreateInfoCount++] = (VkDeviceQueueCreateInfo){
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = families[i],
+            .queueCount = 1,
+            .pQueuePriorities = &queuePriority,
+        };
+    }
+
+    VkPhysicalDeviceFeatures deviceFeatures = {};
+
+    const char *extensions[deviceExtensionsCount + 2];
+    uint32_t extensionCount = 0;
+
+    if (surface != VK_NULL_HANDLE) {
+        for (uint32_t i = 0; i < deviceExtensionsCount; i++) {
+            extensions[extensionCount++] = deviceExtensions[i];
+        }
+    }
+
+    if (indirectDraws) {
+        VkPhysicalDeviceFeatures supportedFeatures;
+        vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+
+        // one indirect draw of every draw's command, whose firstInstance is
+        // where its visible instances start
+        if (!supportedFeatures.multiDrawIndirect ||
+            !supportedFeatures.drawIndirectFirstInstance) {
+            fprintf(stderr, "ERROR: indirect draws need the multiDrawIndirect "
+                            "and drawIndirectFirstInstance features.\n");
+            exit(1);
+        }
+
+        deviceFeatures.multiDrawIndirect = VK_TRUE;
+        deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+
+        if (indirectCount == INDIRECT_COUNT_EXTENSION) {
+            extensions[extensionCount++] =
+                VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME;
+        }
+    }
+
+    void *features = NULL;
+
+    VkPhysicalDeviceVulkan13Features vulkan13Features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES,
+        .synchronization2 = VK_TRUE,
+        .dynamicRendering = VK_TRUE,
+    };
+
+    if (dynamicRendering) {
+        features = &vulkan13Features;
+    }
+
+    // every device with the extension supports the feature
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+        .pNext = features,
+        .timelineSemaphore = VK_TRUE,
+    };
+
+    if (timelineSemaphores) {
+        if (!hasDeviceExtension(physicalDevice,
+                                VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME)) {
+            fprintf(stderr, "ERROR: --timeline-sync needs the %s extension.\n",
+                    VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+            exit(1);
+        }
+
+        extensions[extensionCount++] = VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME;
+        features = &timelineFeatures;
+    }
+
+    // may not be chained with the timeline struct, so it takes over its
+    // feature
+    VkPhysicalDeviceVulkan12Features vulkan12Features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+        .pNext = dynamicRendering ? &vulkan13Features : NULL,
+        .drawIndirectCount = VK_TRUE,
+        .timelineSemaphore = timelineSemaphores,
+    };
+
+    if (indirectDraws && indirectCount == INDIRECT_COUNT_CORE) {
+        features = &vulkan12Features;
+    }
+
+    VkDeviceCreateInfo createInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .pNext = features,
+        .pQueueCreateInfos = queueCreateInfos,
+        .queueCreateInfoCount = queueCreateInfoCount,
+        .pEnabledFeatures = &deviceFeatures,
+        .ppEnabledExtensionNames = extensions,
+        .enabledExtensionCount = extensionCount,
+        .enabledLayerCount = 0,
+    };
+
+    if (enableValidationLayers) {
+        createInfo.enabledLayerCount = validationLayerCount;
+        createInfo.ppEnabledLayerNames = validationLayers;
+    }
+
+    VkDevice device;
+
+    if (vkCreateDevice(physicalDevice, &createInfo, NULL, &device) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create logical device.\n");
+        exit(1);
+    }
+
+    return device;
 }
 
 VkQueue getGraphicsQueue(VkDevice device, VkPhysicalDevice physicalDevice) {
@@ -476,8 +1568,24 @@ VkSurfaceFormatKHR chooseSurfaceFormat(VkPhysicalDevice device,
     return formats[0];
 }
 
+const char *presentModeName(VkPresentModeKHR presentMode) {
+    switch (presentMode) {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR:
+        return "IMMEDIATE";
+    case VK_PRESENT_MODE_MAILBOX_KHR:
+        return "MAILBOX";
+    case VK_PRESENT_MODE_FIFO_KHR:
+        return "FIFO";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+        return "FIFO_RELAXED";
+    default:
+        return "UNKNOWN";
+    }
+}
+
 VkPresentModeKHR choosePresentMode(VkPhysicalDevice device,
-                                   VkSurfaceKHR surface) {
+                                   VkSurfaceKHR surface,
+                                   PresentPolicy policy) {
     uint32_t presentModeCount;
     vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface,
                                               &presentModeCount, NULL);
@@ -485,26 +1593,75 @@ VkPresentModeKHR choosePresentMode(VkPhysicalDevice device,
     vkGetPhysicalDeviceSurfacePresentModesKHR(device, surface,
                                               &presentModeCount, presetModes);
 
-    for (uint32_t i = 0; i < presentModeCount; i++) {
-        if (presetModes[i] == VK_PRESENT_MODE_MAX_ENUM_KHR) {
-            return presetModes[i];
+    // in order of preference, FIFO is always supported so it ends every list
+    VkPresentModeKHR preferences[PRESENT_POLICY_COUNT][3] = {
+        [PRESENT_POWER_SAVING] = {VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+                                  VK_PRESENT_MODE_FIFO_KHR,
+                                  VK_PRESENT_MODE_FIFO_KHR},
+        [PRESENT_LOW_LATENCY] = {VK_PRESENT_MODE_MAILBOX_KHR,
+                                 VK_PRESENT_MODE_IMMEDIATE_KHR,
+                                 VK_PRESENT_MODE_FIFO_KHR},
+        [PRESENT_UNCAPPED] = {VK_PRESENT_MODE_IMMEDIATE_KHR,
+                              VK_PRESENT_MODE_MAILBOX_KHR,
+                              VK_PRESENT_MODE_FIFO_KHR},
+    };
+
+    for (uint32_t p = 0; p < 3; p++) {
+        for (uint32_t i = 0; i < presentModeCount; i++) {
+            if (presetModes[i] == preferences[policy][p]) {
+                return presetModes[i];
+            }
         }
     }
 
     return VK_PRESENT_MODE_FIFO_KHR;
 }
 
+/**
+ * Picks how many images the swapchain asks for, based on the present mode.
+ *
+ * FIFO modes queue every image, so each extra one is another frame of
+ * latency: they get the minimum. MAILBOX needs a third image to have one to
+ * render into while one is queued and one is on screen. IMMEDIATE never
+ * waits for vblank, one image over the minimum keeps acquire from blocking.
+ * A non-zero requestedCount overrides all of this, within the surface limits.
+ */
+uint32_t chooseImageCount(VkSurfaceCapabilitiesKHR capabilities,
+                          VkPresentModeKHR presentMode,
+                          uint32_t requestedCount) {
+    uint32_t imageCount = capabilities.minImageCount;
+
+    if (requestedCount > 0) {
+        imageCount = requestedCount > capabilities.minImageCount
+                         ? requestedCount
+                         : capabilities.minImageCount;
+    } else if (presentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+        imageCount = capabilities.minImageCount + 1;
+        if (imageCount < 3) {
+            imageCount = 3;
+        }
+    } else if (presentMode == VK_PRESENT_MODE_IMMEDIATE_KHR) {
+        imageCount = capabilities.minImageCount + 1;
+    }
+
+    if (capabilities.maxImageCount > 0 &&
+        imageCount > capabilities.maxImageCount) {
+        imageCount = capabilities.maxImageCount;
+    }
+
+    return imageCount;
+}
+
+// width and height are the window's framebuffer size, which only the main
+// thread can query
 VkExtent2D chooseExtent(VkPhysicalDevice device, VkSurfaceKHR surface,
-                        GLFWwindow *window) {
+                        int width, int height) {
     VkSurfaceCapabilitiesKHR capabilities;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, surface, &capabilities);
 
     if (capabilities.currentExtent.width != UINT32_MAX) {
         return capabilities.currentExtent;
     } else {
-        int width, height;
-        glfwGetFramebufferSize(window, &width, &height);
-
         VkExtent2D actualExtent = {(uint32_t)width, (uint32_t)height};
 
         if (actualExtent.width < capabilities.minImageExtent.width) {
@@ -528,19 +1685,24 @@ VkExtent2D chooseExtent(VkPhysicalDevice device, VkSurfaceKHR surface,
 
 VkSwapchainKHR createSwapchain(VkDevice device, VkPhysicalDevice physicalDevice,
                                VkSurfaceKHR surface, VkSurfaceFormatKHR format,
-                               VkExtent2D extent,
-                               VkPresentModeKHR presentMode) {
+                               VkExtent2D extent, VkPresentModeKHR presentMode,
+                               uint32_t requestedImageCount,
+                               VkImageUsageFlags usage,
+                               VkSwapchainKHR oldSwapchain) {
     VkSurfaceCapabilitiesKHR capabilities;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface,
                                               &capabilities);
 
-    uint32_t imageCount = capabilities.minImageCount + 1;
-
-    if (capabilities.maxImageCount > 0 &&
-        imageCount > capabilities.maxImageCount) {
-        imageCount = capabilities.maxImageCount;
+    if ((capabilities.supportedUsageFlags & usage) != usage) {
+        fprintf(stderr, "ERROR: swapchain images do not support the usage "
+                        "flags 0x%x.\n",
+                usage);
+        exit(1);
     }
 
+    uint32_t imageCount =
+        chooseImageCount(capabilities, presentMode, requestedImageCount);
+
     VkSwapchainCreateInfoKHR createInfo = {
         .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
         .surface = surface,
@@ -549,12 +1711,12 @@ VkSwapchainKHR createSwapchain(VkDevice device, VkPhysicalDevice physicalDevice,
         .imageColorSpace = format.colorSpace,
         .imageExtent = extent,
         .imageArrayLayers = 1,
-        .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+        .imageUsage = usage,
         .preTransform = capabilities.currentTransform,
         .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
         .presentMode = presentMode,
         .clipped = VK_TRUE,
-        .oldSwapchain = VK_NULL_HANDLE,
+        .oldSwapchain = oldSwapchain,
     };
 
     uint32_t graphicsFamily = getGraphicsFamily(physicalDevice);
@@ -583,107 +1745,347 @@ VkSwapchainKHR createSwapchain(VkDevice device, VkPhysicalDevice physicalDevice,
     return swapchain;
 }
 
-void createImageViews(VkDevice device, VkImageView *imageViews, VkImage *images,
-                      uint32_t imageCount, VkSurfaceFormatKHR format) {
-    for (uint32_t i = 0; i < imageCount; i++) {
-        VkImageViewCreateInfo createInfo = {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-            .image = images[i],
-            .viewType = VK_IMAGE_VIEW_TYPE_2D,
-            .format = format.format,
-            .components.r = VK_COMPONENT_SWIZZLE_IDENTITY,
-            .components.g = VK_COMPONENT_SWIZZLE_IDENTITY,
-            .components.b = VK_COMPONENT_SWIZZLE_IDENTITY,
-            .components.a = VK_COMPONENT_SWIZZLE_IDENTITY,
-            .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-            .subresourceRange.baseMipLevel = 0,
-            .subresourceRange.levelCount = 1,
-            .subresourceRange.baseArrayLayer = 0,
-            .subresourceRange.layerCount = 1,
-        };
-        if (vkCreateImageView(device, &createInfo, NULL, &imageViews[i]) !=
+void createSemaphores(VkDevice device, VkSemaphore *semaphores,
+                      uint32_t semaphoresCound) {
+    VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+
+    for (uint32_t i = 0; i < semaphoresCound; i++) {
+        if (vkCreateSemaphore(device, &semaphoreInfo, NULL, &semaphores[i]) !=
             VK_SUCCESS) {
-            fprintf(stderr, "ERROR: failed to create image view.\n");
+            fprintf(stderr, "ERROR: failed to create semaphore.\n");
             exit(1);
         }
     }
 }
 
-VkRenderPass createRenderPass(VkDevice device, VkFormat format) {
-    VkAttachmentDescription colorAttachment = {
-        .format = format,
-        .samples = VK_SAMPLE_COUNT_1_BIT,
-        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
-        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+void createFence(VkDevice device, VkFence *fences, uint32_t fencesCount) {
+    VkFenceCreateInfo fenceInfo = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .flags = VK_FENCE_CREATE_SIGNALED_BIT,
     };
 
-    VkAttachmentReference colorAttachmentRef = {
-        .attachment = 0,
-        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    for (uint32_t i = 0; i < fencesCount; i++) {
+        if (vkCreateFence(device, &fenceInfo, NULL, &fences[i]) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create fence.\n");
+            exit(1);
+        };
     };
+}
 
-    VkSubpassDescription subpass = {
-        .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-        .colorAttachmentCount = 1,
-        .pColorAttachments = &colorAttachmentRef,
-    };
+// Images the render pass draws into, either owned by a swapchain or, when
+// running headless, device-local images owned by the application.
+typedef struct {
+    VkSwapchainKHR swapchain; // VK_NULL_HANDLE when rendering offscreen
+    VkFormat format;
+    VkColorSpaceKHR colorSpace;
+    VkPresentModeKHR presentMode;
+    uint32_t requestedImageCount;
+    VkImageUsageFlags usage; // swapchain only
+    VkExtent2D extent;
+    uint32_t imageCount;
+    VkImage *images;
+    Allocator *allocator;         // offscreen only
+    Allocation *imageAllocations; // offscreen only
+    VkImageView *imageViews;
+    VkFramebuffer *framebuffers;
+    // fence of the frame that last rendered into each image, not owned
+    VkFence *imagesInFlight;
+    // with timeline sync, the graphics value of that frame instead
+    uint64_t *imageTimelineValues;
+    // signaled when an image is rendered, waited on by its present; swapchain
+    // only, kept per image since a present may hold one past its frame slot
+    VkSemaphore *presentSemaphores;
+} RenderTarget;
+
+void allocateRenderTarget(RenderTarget *target, uint32_t imageCount) {
+    target->imageCount = imageCount;
+    target->images = calloc(imageCount, sizeof(VkImage));
+    target->imageViews = calloc(imageCount, sizeof(VkImageView));
+    target->framebuffers = calloc(imageCount, sizeof(VkFramebuffer));
+    target->imagesInFlight = calloc(imageCount, sizeof(VkFence));
+    target->imageTimelineValues = calloc(imageCount, sizeof(uint64_t));
+    target->presentSemaphores = NULL;
+
+    if (!target->images || !target->imageViews || !target->framebuffers ||
+        !target->imagesInFlight || !target->imageTimelineValues) {
+        fprintf(stderr, "ERROR: failed to allocate render target.\n");
+        exit(1);
+    }
+}
 
-    VkSubpassDependency depencency = {
-        .srcSubpass = VK_SUBPASS_EXTERNAL,
-        .dstSubpass = 0,
-        .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        .srcAccessMask = 0,
-        .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-    };
+void getSwapchainImages(VkDevice device, RenderTarget *target) {
+    uint32_t imageCount;
+    vkGetSwapchainImagesKHR(device, target->swapchain, &imageCount, NULL);
 
-    VkRenderPassCreateInfo renderPassInfo = {
-        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-        .attachmentCount = 1,
-        .pAttachments = &colorAttachment,
-        .subpassCount = 1,
-        .pSubpasses = &subpass,
-        .dependencyCount = 1,
-        .pDependencies = &depencency,
-    };
+    allocateRenderTarget(target, imageCount);
+    target->imageAllocations = NULL;
 
-    VkRenderPass renderPass;
+    vkGetSwapchainImagesKHR(device, target->swapchain, &imageCount,
+                            target->images);
 
-    if (vkCreateRenderPass(device, &renderPassInfo, NULL, &renderPass) !=
-        VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to create reander pass.\n");
+    target->presentSemaphores = calloc(imageCount, sizeof(VkSemaphore));
+
+    if (!target->presentSemaphores) {
+        fprintf(stderr, "ERROR: failed to allocate render target.\n");
         exit(1);
-    };
+    }
 
-    return renderPass;
+    createSemaphores(device, target->presentSemaphores, imageCount);
 }
 
-VkShaderModule createShaderModule(VkDevice device, const char *filename) {
-    size_t codeCount;
-    void *code = mmap_file_read(filename, &codeCount);
-    if (!code) {
-        fprintf(stderr, "ERROR: failed to read %s.\n", filename);
+void createOffscreenImages(VkDevice device, Allocator *allocator,
+                           RenderTarget *target, uint32_t imageCount) {
+    allocateRenderTarget(target, imageCount);
+    target->swapchain = VK_NULL_HANDLE;
+    target->allocator = allocator;
+    target->imageAllocations = calloc(imageCount, sizeof(Allocation));
+
+    if (!target->imageAllocations) {
+        fprintf(stderr, "ERROR: failed to allocate render target.\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < imageCount; i++) {
+        VkImageCreateInfo imageInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = target->format,
+            .extent.width = target->extent.width,
+            .extent.height = target->extent.height,
+            .extent.depth = 1,
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = VK_SAMPLE_COUNT_1_BIT,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                     VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        };
+
+        if (vkCreateImage(device, &imageInfo, NULL, &target->images[i]) !=
+            VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create offscreen image.\n");
+            exit(1);
+        }
+
+        VkMemoryRequirements memRequirements;
+        vkGetImageMemoryRequirements(device, target->images[i],
+                                     &memRequirements);
+
+        target->imageAllocations[i] =
+            allocateMemory(allocator, memRequirements,
+                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                           RESOURCE_OPTIMAL);
+
+        vkBindImageMemory(device, target->images[i],
+                          target->imageAllocations[i].memory,
+                          target->imageAllocations[i].offset);
+    }
+}
+
+void createBuffer(Allocator *allocator, VkDeviceSize size,
+                  VkBufferUsageFlags usage, VkMemoryPropertyFlags properties,
+                  VkBuffer *buffer, Allocation *allocation) {
+    VkBufferCreateInfo bufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = size,
+        .usage = usage,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+
+    if (vkCreateBuffer(allocator->device, &bufferInfo, NULL, buffer) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create buffer.\n");
+        exit(1);
+    }
+
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(allocator->device, *buffer,
+                                  &memRequirements);
+
+    *allocation = allocateMemory(allocator, memRequirements, properties,
+                                 RESOURCE_LINEAR);
+
+    vkBindBufferMemory(allocator->device, *buffer, allocation->memory,
+                       allocation->offset);
+}
+
+// Releases everything built on top of the images, but keeps the swapchain
+// alive so it can be handed to its replacement as oldSwapchain.
+void destroyRenderTargetViews(VkDevice device, RenderTarget *target) {
+    for (uint32_t i = 0; i < target->imageCount; i++) {
+        vkDestroyFramebuffer(device, target->framebuffers[i], NULL);
+        vkDestroyImageView(device, target->imageViews[i], NULL);
+    }
+
+    if (target->imageAllocations) {
+        for (uint32_t i = 0; i < target->imageCount; i++) {
+            vkDestroyImage(device, target->images[i], NULL);
+            freeAllocation(target->allocator, &target->imageAllocations[i]);
+        }
+        free(target->imageAllocations);
+        target->imageAllocations = NULL;
+    }
+
+    if (target->presentSemaphores) {
+        for (uint32_t i = 0; i < target->imageCount; i++) {
+            vkDestroySemaphore(device, target->presentSemaphores[i], NULL);
+        }
+        free(target->presentSemaphores);
+        target->presentSemaphores = NULL;
+    }
+
+    free(target->images);
+    free(target->imageViews);
+    free(target->framebuffers);
+    free(target->imagesInFlight);
+    free(target->imageTimelineValues);
+    target->imageCount = 0;
+}
+
+void destroyRenderTarget(VkDevice device, RenderTarget *target) {
+    destroyRenderTargetViews(device, target);
+
+    if (target->swapchain != VK_NULL_HANDLE) {
+        vkDestroySwapchainKHR(device, target->swapchain, NULL);
+    }
+}
+
+void createImageViews(VkDevice device, VkImageView *imageViews, VkImage *images,
+                      uint32_t imageCount, VkFormat format) {
+    for (uint32_t i = 0; i < imageCount; i++) {
+        VkImageViewCreateInfo createInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = images[i],
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = format,
+            .components.r = VK_COMPONENT_SWIZZLE_IDENTITY,
+            .components.g = VK_COMPONENT_SWIZZLE_IDENTITY,
+            .components.b = VK_COMPONENT_SWIZZLE_IDENTITY,
+            .components.a = VK_COMPONENT_SWIZZLE_IDENTITY,
+            .subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .subresourceRange.baseMipLevel = 0,
+            .subresourceRange.levelCount = 1,
+            .subresourceRange.baseArrayLayer = 0,
+            .subresourceRange.layerCount = 1,
+        };
+        if (vkCreateImageView(device, &createInfo, NULL, &imageViews[i]) !=
+            VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create image view.\n");
+            exit(1);
+        }
+    }
+}
+
+VkRenderPass createRenderPass(VkDevice device, VkFormat format,
+                              VkImageLayout finalLayout) {
+    VkAttachmentDescription colorAttachment = {
+        .format = format,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+        .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+        .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .finalLayout = finalLayout,
+    };
+
+    VkAttachmentReference colorAttachmentRef = {
+        .attachment = 0,
+        .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+
+    VkSubpassDescription subpass = {
+        .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+        .colorAttachmentCount = 1,
+        .pColorAttachments = &colorAttachmentRef,
+    };
+
+    VkSubpassDependency dependencies[] = {
+        {
+            .srcSubpass = VK_SUBPASS_EXTERNAL,
+            .dstSubpass = 0,
+            .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .srcAccessMask = 0,
+            .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        },
+        // orders the final layout transition before frames read back,
+        // which the implicit dependency to bottom of pipe does not
+        {
+            .srcSubpass = 0,
+            .dstSubpass = VK_SUBPASS_EXTERNAL,
+            .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+            .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+            .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+            .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        },
+    };
+
+    VkRenderPassCreateInfo renderPassInfo = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+        .attachmentCount = 1,
+        .pAttachments = &colorAttachment,
+        .subpassCount = 1,
+        .pSubpasses = &subpass,
+        .dependencyCount = 2,
+        .pDependencies = dependencies,
+    };
+
+    VkRenderPass renderPass;
+
+    if (vkCreateRenderPass(device, &renderPassInfo, NULL, &renderPass) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create reander pass.\n");
         exit(1);
+    };
+
+    return renderPass;
+}
+
+#define SPIRV_MAGIC 0x07230203
+
+// Returns VK_NULL_HANDLE when code is not SPIR-V or the driver rejects it,
+// name is only used in the error message
+VkShaderModule createShaderModuleFromCode(VkDevice device, const char *name,
+                                          const uint32_t *code, size_t size) {
+    if (size < 4 || size % 4 != 0 || code[0] != SPIRV_MAGIC) {
+        fprintf(stderr, "ERROR: %s is not SPIR-V.\n", name);
+        return VK_NULL_HANDLE;
     }
 
     VkShaderModuleCreateInfo createInfo = {
         .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-        .codeSize = codeCount,
+        .codeSize = size,
         .pCode = code,
     };
 
     VkShaderModule shaderModule;
     if (vkCreateShaderModule(device, &createInfo, NULL, &shaderModule) !=
         VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to create %s shader module.\n",
-                filename);
-        exit(1);
+        fprintf(stderr, "ERROR: failed to create %s shader module.\n", name);
+        return VK_NULL_HANDLE;
+    }
+
+    return shaderModule;
+}
+
+// Returns VK_NULL_HANDLE when filename can't be read or is not SPIR-V, as a
+// shader being rewritten may well be
+VkShaderModule loadShaderModule(VkDevice device, const char *filename) {
+    size_t codeCount;
+    void *code = mmap_file_read(filename, &codeCount);
+    if (!code) {
+        fprintf(stderr, "ERROR: failed to read %s.\n", filename);
+        return VK_NULL_HANDLE;
     }
 
+    VkShaderModule shaderModule =
+        createShaderModuleFromCode(device, filename, code, codeCount);
+
     if (munmap(code, codeCount) == -1) {
         fprintf(stderr, "ERROR: failed to close %s.\n", filename);
     }
@@ -691,12 +2093,131 @@ VkShaderModule createShaderModule(VkDevice device, const char *filename) {
     return shaderModule;
 }
 
-VkPipelineLayout createGraphicsPipelineLayout(VkDevice device) {
+/**
+ * Creates the module built into the binary from filename, or with fromDisk
+ * reads filename from the working directory like the hot reload does.
+ */
+VkShaderModule createShaderModule(VkDevice device, const char *filename,
+                                  bool fromDisk) {
+    VkShaderModule shaderModule;
+
+    if (fromDisk) {
+        shaderModule = loadShaderModule(device, filename);
+    } else {
+        const EmbeddedShader *shader = findEmbeddedShader(filename);
+
+        if (!shader) {
+            fprintf(stderr, "ERROR: %s is not built in.\n", filename);
+            exit(1);
+        }
+
+        shaderModule = createShaderModuleFromCode(device, filename,
+                                                  shader->code, shader->size);
+    }
+
+    if (shaderModule == VK_NULL_HANDLE) {
+        exit(1);
+    }
+
+    return shaderModule;
+}
+
+// Set 0: camera and object uniforms and the instance array, all read at
+// dynamic offsets so one descriptor set covers a whole frame's data.
+VkDescriptorSetLayout createUniformSetLayout(VkDevice device) {
+    VkDescriptorSetLayoutBinding bindings[] = {
+        {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        },
+        {
+            .binding = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        },
+        {
+            .binding = 2,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        },
+        // the visible instances of a cull pass, see createGpuCuller
+        {
+            .binding = 3,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        },
+        // the whole arena, where the culled draws find their model matrices
+        {
+            .binding = 4,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+        },
+    };
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 5,
+        .pBindings = bindings,
+    };
+
+    VkDescriptorSetLayout setLayout;
+
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, NULL, &setLayout) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor set layout.\n");
+        exit(1);
+    }
+
+    return setLayout;
+}
+
+VkDescriptorPool createDescriptorPool(VkDevice device, uint32_t setCount) {
+    VkDescriptorPoolSize poolSizes[] = {
+        {
+            .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .descriptorCount = setCount * 2,
+        },
+        {
+            .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+            .descriptorCount = setCount,
+        },
+        {
+            .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = setCount * 2,
+        },
+    };
+
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = setCount,
+        .poolSizeCount = 3,
+        .pPoolSizes = poolSizes,
+    };
+
+    VkDescriptorPool descriptorPool;
+
+    if (vkCreateDescriptorPool(device, &poolInfo, NULL, &descriptorPool) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor pool.\n");
+        exit(1);
+    }
+
+    return descriptorPool;
+}
+
+VkPipelineLayout createGraphicsPipelineLayout(VkDevice device,
+                                              VkDescriptorSetLayout setLayout) {
 
     VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-        .setLayoutCount = 0,         // Optional
-        .pSetLayouts = NULL,         // Optional
+        .setLayoutCount = 1,
+        .pSetLayouts = &setLayout,
         .pushConstantRangeCount = 0, // Optional
         .pPushConstantRanges = NULL, // Optional
     };
@@ -712,17 +2233,211 @@ VkPipelineLayout createGraphicsPipelineLayout(VkDevice device) {
     return pipelineLayout;
 }
 
-VkPipeline createGraphicsPipeline(VkDevice device,
-                                  VkPipelineLayout pipelineLayout,
-                                  VkRenderPass renderPass, VkExtent2D extent,
-                                  VkShaderModule vertShaderModule,
-                                  VkShaderModule fragShaderModule) {
+/**
+ * Checks that cache data was written by this driver for this device.
+ *
+ * Drivers are meant to reject foreign data themselves, but not all of them
+ * do it gracefully, so stale files are thrown away before they get there.
+ */
+bool isPipelineCacheCompatible(VkPhysicalDevice physicalDevice,
+                               const void *data, size_t size) {
+    VkPipelineCacheHeaderVersionOne header;
+
+    if (size < sizeof(header)) {
+        return false;
+    }
+
+    memcpy(&header, data, sizeof(header));
+
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProps);
+
+    return header.headerSize >= sizeof(header) &&
+           header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+           header.vendorID == deviceProps.vendorID &&
+           header.deviceID == deviceProps.deviceID &&
+           memcmp(header.pipelineCacheUUID, deviceProps.pipelineCacheUUID,
+                  VK_UUID_SIZE) == 0;
+}
+
+VkPipelineCache createPipelineCache(VkDevice device,
+                                    VkPhysicalDevice physicalDevice,
+                                    const char *path, bool *warm) {
+    VkPipelineCacheCreateInfo createInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = 0,
+        .pInitialData = NULL,
+    };
+
+    size_t size = 0;
+    void *data = path ? mmap_file_read(path, &size) : NULL;
+
+    if (data && isPipelineCacheCompatible(physicalDevice, data, size)) {
+        createInfo.initialDataSize = size;
+        createInfo.pInitialData = data;
+    } else if (data) {
+        fprintf(stdout, "discarding stale pipeline cache %s\n", path);
+    }
+
+    *warm = createInfo.pInitialData != NULL;
+
+    VkPipelineCache pipelineCache;
+
+    if (vkCreatePipelineCache(device, &createInfo, NULL, &pipelineCache) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create pipeline cache.\n");
+        exit(1);
+    }
+
+    if (data && munmap(data, size) == -1) {
+        fprintf(stderr, "ERROR: failed to close %s.\n", path);
+    }
+
+    return pipelineCache;
+}
+
+void savePipelineCache(VkDevice device, VkPipelineCache pipelineCache,
+                       const char *path) {
+    size_t size;
+    if (vkGetPipelineCacheData(device, pipelineCache, &size, NULL) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to query pipeline cache size.\n");
+        return;
+    }
+
+    void *data = malloc(size);
+
+    if (!data || vkGetPipelineCacheData(device, pipelineCache, &size, data) !=
+                     VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to read pipeline cache.\n");
+        free(data);
+        return;
+    }
+
+    // write next to the old file and rename, so a crash never leaves a
+    // truncated cache behind
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+    FILE *file = fopen(tmpPath, "wb");
+
+    if (!file) {
+        fprintf(stderr, "ERROR: failed to open %s.\n", tmpPath);
+        free(data);
+        return;
+    }
+
+    bool written = fwrite(data, 1, size, file) == size;
+
+    if (fclose(file) != 0 || !written || rename(tmpPath, path) != 0) {
+        fprintf(stderr, "ERROR: failed to write %s.\n", path);
+        remove(tmpPath);
+    }
+
+    free(data);
+}
+
+// Interleaved vertex layout of every mesh, matches shader.vert's inputs
+typedef struct {
+    vec2 position;
+    vec3 color;
+} Vertex;
+
+VkVertexInputBindingDescription getVertexBindingDescription() {
+    VkVertexInputBindingDescription bindingDescription = {
+        .binding = 0,
+        .stride = sizeof(Vertex),
+        .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+    };
+
+    return bindingDescription;
+}
+
+#define VERTEX_ATTRIBUTE_COUNT 2
+
+void getVertexAttributeDescriptions(
+    VkVertexInputAttributeDescription *attributeDescriptions) {
+    attributeDescriptions[0] = (VkVertexInputAttributeDescription){
+        .location = 0,
+        .binding = 0,
+        .format = VK_FORMAT_R32G32_SFLOAT,
+        .offset = offsetof(Vertex, position),
+    };
+
+    attributeDescriptions[1] = (VkVertexInputAttributeDescription){
+        .location = 1,
+        .binding = 0,
+        .format = VK_FORMAT_R32G32B32_SFLOAT,
+        .offset = offsetof(Vertex, color),
+    };
+}
+
+// The specialization constants of shader.vert and shader.frag, in
+// constant_id order
+typedef struct {
+    float alpha;             // of every fragment
+    VkBool32 instanceColors; // tint vertex colors by the instance's
+    VkBool32 culledInstances; // look instances up in a cull pass' output
+} ShaderConstants;
+
+// Everything graphics pipeline variants differ in. All members are 4 bytes,
+// so a key has no padding and is hashed and compared as bytes; zero-init
+// keys before filling them in all the same.
+typedef struct {
+    BlendMode blend;
+    VkCullModeFlags cullMode;
+    VkPrimitiveTopology topology;
+    VkSampleCountFlagBits samples; // must match the render target's
+    ShaderConstants constants;
+} PipelineKey;
+
+/**
+ * Builds the variant key of the pipeline for subpass 0 of renderPass, or with
+ * renderPass VK_NULL_HANDLE for dynamic rendering into a single colorFormat
+ * attachment. With basePipeline VK_NULL_HANDLE the pipeline allows
+ * derivatives, otherwise it is derived from basePipeline, which must allow
+ * them. Safe to call from any thread, the pipeline cache synchronizes itself.
+ */
+VkResult buildGraphicsPipeline(VkDevice device, VkPipelineCache pipelineCache,
+                               VkPipelineLayout pipelineLayout,
+                               VkRenderPass renderPass, VkFormat colorFormat,
+                               VkExtent2D extent,
+                               VkShaderModule vertShaderModule,
+                               VkShaderModule fragShaderModule,
+                               const PipelineKey *key,
+                               VkPipeline basePipeline, VkPipeline *pipeline) {
+    VkSpecializationMapEntry specializationEntries[] = {
+        {
+            .constantID = 0,
+            .offset = offsetof(ShaderConstants, alpha),
+            .size = sizeof(float),
+        },
+        {
+            .constantID = 1,
+            .offset = offsetof(ShaderConstants, instanceColors),
+            .size = sizeof(VkBool32),
+        },
+        {
+            .constantID = 2,
+            .offset = offsetof(ShaderConstants, culledInstances),
+            .size = sizeof(VkBool32),
+        },
+    };
+
+    // both stages get all of them, each only reads the ones it declares
+    VkSpecializationInfo specializationInfo = {
+        .mapEntryCount = 3,
+        .pMapEntries = specializationEntries,
+        .dataSize = sizeof(ShaderConstants),
+        .pData = &key->constants,
+    };
 
     VkPipelineShaderStageCreateInfo vertShaderStageInfo = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
         .stage = VK_SHADER_STAGE_VERTEX_BIT,
         .module = vertShaderModule,
         .pName = "main",
+        .pSpecializationInfo = &specializationInfo,
     };
 
     VkPipelineShaderStageCreateInfo fragShaderStageInfo = {
@@ -730,22 +2445,30 @@ VkPipeline createGraphicsPipeline(VkDevice device,
         .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
         .module = fragShaderModule,
         .pName = "main",
+        .pSpecializationInfo = &specializationInfo,
     };
 
     VkPipelineShaderStageCreateInfo shaderStages[] = {vertShaderStageInfo,
                                                       fragShaderStageInfo};
 
+    VkVertexInputBindingDescription bindingDescription =
+        getVertexBindingDescription();
+
+    VkVertexInputAttributeDescription
+        attributeDescriptions[VERTEX_ATTRIBUTE_COUNT];
+    getVertexAttributeDescriptions(attributeDescriptions);
+
     VkPipelineVertexInputStateCreateInfo vertexInputInfo = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-        .vertexBindingDescriptionCount = 0,
-        .pVertexBindingDescriptions = NULL,
-        .vertexAttributeDescriptionCount = 0,
-        .pVertexAttributeDescriptions = NULL,
+        .vertexBindingDescriptionCount = 1,
+        .pVertexBindingDescriptions = &bindingDescription,
+        .vertexAttributeDescriptionCount = VERTEX_ATTRIBUTE_COUNT,
+        .pVertexAttributeDescriptions = attributeDescriptions,
     };
 
     VkPipelineInputAssemblyStateCreateInfo inputAssembly = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-        .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+        .topology = key->topology,
         .primitiveRestartEnable = VK_FALSE,
     };
 
@@ -792,7 +2515,7 @@ VkPipeline createGraphicsPipeline(VkDevice device,
         .rasterizerDiscardEnable = VK_FALSE,
         .polygonMode = VK_POLYGON_MODE_FILL,
         .lineWidth = 1.0f,
-        .cullMode = VK_CULL_MODE_BACK_BIT,
+        .cullMode = key->cullMode,
         .frontFace = VK_FRONT_FACE_CLOCKWISE,
         .depthBiasEnable = VK_FALSE,
         .depthBiasConstantFactor = 0.0f, // Optional
@@ -803,15 +2526,17 @@ VkPipeline createGraphicsPipeline(VkDevice device,
     VkPipelineMultisampleStateCreateInfo multisampling = {
         .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
         .sampleShadingEnable = VK_FALSE,
-        .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+        .rasterizationSamples = key->samples,
     };
 
     VkPipelineColorBlendAttachmentState colorBlendAttachment = {
         .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
                           VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
-        .blendEnable = VK_TRUE,
+        .blendEnable = key->blend != BLEND_OPAQUE,
         .srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
-        .dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+        .dstColorBlendFactor = key->blend == BLEND_ADDITIVE
+                                   ? VK_BLEND_FACTOR_ONE
+                                   : VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
         .colorBlendOp = VK_BLEND_OP_ADD,
         .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
         .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
@@ -827,8 +2552,18 @@ VkPipeline createGraphicsPipeline(VkDevice device,
         .blendConstants = {0.0f, 0.0f, 0.0f, 0.0f}, // Optional
     };
 
+    VkPipelineRenderingCreateInfo renderingInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
+        .colorAttachmentCount = 1,
+        .pColorAttachmentFormats = &colorFormat,
+    };
+
     VkGraphicsPipelineCreateInfo pipelineInfo = {
         .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .pNext = renderPass == VK_NULL_HANDLE ? &renderingInfo : NULL,
+        .flags = basePipeline == VK_NULL_HANDLE
+                     ? VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT
+                     : VK_PIPELINE_CREATE_DERIVATIVE_BIT,
         .stageCount = 2,
         .pStages = shaderStages,
         .pVertexInputState = &vertexInputInfo,
@@ -842,14 +2577,29 @@ VkPipeline createGraphicsPipeline(VkDevice device,
         .layout = pipelineLayout,
         .renderPass = renderPass,
         .subpass = 0,
-        .basePipelineHandle = VK_NULL_HANDLE, // Optional
-        .basePipelineIndex = -1,              // Optional
+        .basePipelineHandle = basePipeline,
+        .basePipelineIndex = -1,
     };
 
+    return vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo,
+                                     NULL, pipeline);
+}
+
+VkPipeline createGraphicsPipeline(VkDevice device,
+                                  VkPipelineCache pipelineCache,
+                                  VkPipelineLayout pipelineLayout,
+                                  VkRenderPass renderPass,
+                                  VkFormat colorFormat, VkExtent2D extent,
+                                  VkShaderModule vertShaderModule,
+                                  VkShaderModule fragShaderModule,
+                                  const PipelineKey *key,
+                                  VkPipeline basePipeline) {
     VkPipeline graphicsPipeline;
 
-    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo,
-                                  NULL, &graphicsPipeline) != VK_SUCCESS) {
+    if (buildGraphicsPipeline(device, pipelineCache, pipelineLayout,
+                              renderPass, colorFormat, extent,
+                              vertShaderModule, fragShaderModule, key,
+                              basePipeline, &graphicsPipeline) != VK_SUCCESS) {
         fprintf(stderr, "ERROR: failed to create graphics pipeline.\n");
         exit(1);
     }
@@ -857,39 +2607,380 @@ VkPipeline createGraphicsPipeline(VkDevice device,
     return graphicsPipeline;
 };
 
-void createFramebuffers(VkDevice device, VkFramebuffer *swapchainFramebuffers,
-                        uint32_t swapchainFramebuffersCount,
-                        VkImageView *swapchainImageViews,
-                        VkRenderPass renderPass, VkExtent2D extent) {
-    for (uint32_t i = 0; i < swapchainFramebuffersCount; i++) {
-        VkImageView attachments[] = {swapchainImageViews[i]};
+// a power of two, well above the variants a run ever creates
+#define PIPELINE_VARIANT_SLOTS 64
+
+typedef struct {
+    bool used;
+    PipelineKey key;
+    VkPipeline pipeline; // VK_NULL_HANDLE once dropped by a shader reload
+    double createMs;
+    const char *origin; // base, prewarmed, on demand or reloaded
+    uint32_t hits;
+} PipelineVariant;
+
+/**
+ * The graphics pipeline variants created so far, in an open addressing hash
+ * map keyed by PipelineKey. Every variant but the base is derived from the
+ * base. Lookups happen on the main thread only; prewarming compiles on
+ * workers, into slots reserved before they start.
+ */
+typedef struct {
+    // what every variant is created from
+    VkDevice device;
+    VkPipelineCache pipelineCache;
+    VkPipelineLayout pipelineLayout;
+    VkRenderPass renderPass;
+    VkFormat colorFormat;
+    VkExtent2D extent;
+    VkShaderModule vertShaderModule;
+    VkShaderModule fragShaderModule;
+    bool ownsShaderModules; // reloaded ones, the startup ones are the caller's
+    VkPipeline base;
+    PipelineVariant slots[PIPELINE_VARIANT_SLOTS];
+    uint32_t count;
+    uint32_t hits;
+    uint32_t misses;
+} PipelineVariants;
+
+// FNV-1a over the bytes of the key
+uint32_t hashPipelineKey(const PipelineKey *key) {
+    const uint8_t *bytes = (const uint8_t *)key;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(*key); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
 
-        VkFramebufferCreateInfo framebufferInfo = {
-            .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-            .renderPass = renderPass,
-            .attachmentCount = 1,
-            .pAttachments = attachments,
-            .width = extent.width,
-            .height = extent.height,
-            .layers = 1,
-        };
+    return hash;
+}
 
-        if (vkCreateFramebuffer(device, &framebufferInfo, NULL,
-                                &swapchainFramebuffers[i]) != VK_SUCCESS) {
-            fprintf(stderr, "ERROR: failed to create framebuffer.\n");
-            exit(1);
+// The slot holding key, or the unused slot it would go in
+PipelineVariant *findPipelineVariant(PipelineVariants *variants,
+                                     const PipelineKey *key) {
+    uint32_t hash = hashPipelineKey(key);
+
+    for (uint32_t probe = 0; probe < PIPELINE_VARIANT_SLOTS; probe++) {
+        PipelineVariant *slot =
+            &variants->slots[(hash + probe) % PIPELINE_VARIANT_SLOTS];
+
+        if (!slot->used || memcmp(&slot->key, key, sizeof(*key)) == 0) {
+            return slot;
         }
+    }
+
+    fprintf(stderr, "ERROR: too many graphics pipeline variants.\n");
+    exit(1);
+}
+
+// Claims an unused slot for key
+void reservePipelineVariant(PipelineVariants *variants, PipelineVariant *slot,
+                            const PipelineKey *key, const char *origin) {
+    *slot = (PipelineVariant){
+        .used = true,
+        .key = *key,
+        .pipeline = VK_NULL_HANDLE,
+        .origin = origin,
+        .hits = 0,
     };
+    variants->count++;
 }
 
-VkCommandPool createCommandPool(VkDevice device,
-                                VkPhysicalDevice physicalDevice) {
-    int32_t graphicsFamilyIndex = getGraphicsFamily(physicalDevice);
+// Creates the pipeline of a reserved slot, derived from the base
+void compilePipelineVariant(PipelineVariants *variants,
+                            PipelineVariant *slot) {
+    double start = getTimeMs();
+
+    slot->pipeline = createGraphicsPipeline(
+        variants->device, variants->pipelineCache, variants->pipelineLayout,
+        variants->renderPass, variants->colorFormat, variants->extent,
+        variants->vertShaderModule, variants->fragShaderModule, &slot->key,
+        variants->base);
+    slot->createMs = getTimeMs() - start;
+}
 
+// Creates the base variant, the one the others are derived from
+void createPipelineVariants(PipelineVariants *variants, VkDevice device,
+                            VkPipelineCache pipelineCache,
+                            VkPipelineLayout pipelineLayout,
+                            VkRenderPass renderPass, VkFormat colorFormat,
+                            VkExtent2D extent, VkShaderModule vertShaderModule,
+                            VkShaderModule fragShaderModule,
+                            const PipelineKey *baseKey) {
+    *variants = (PipelineVariants){
+        .device = device,
+        .pipelineCache = pipelineCache,
+        .pipelineLayout = pipelineLayout,
+        .renderPass = renderPass,
+        .colorFormat = colorFormat,
+        .extent = extent,
+        .vertShaderModule = vertShaderModule,
+        .fragShaderModule = fragShaderModule,
+        .ownsShaderModules = false,
+        .base = VK_NULL_HANDLE,
+        .count = 0,
+        .hits = 0,
+        .misses = 0,
+    };
+
+    PipelineVariant *slot = findPipelineVariant(variants, baseKey);
+    reservePipelineVariant(variants, slot, baseKey, "base");
+
+    // with no base yet, it allows derivatives instead of being one
+    compilePipelineVariant(variants, slot);
+    variants->base = slot->pipeline;
+}
+
+// Returns the variant for key, creating it on the spot on a miss
+VkPipeline getPipelineVariant(PipelineVariants *variants,
+                              const PipelineKey *key) {
+    PipelineVariant *slot = findPipelineVariant(variants, key);
+
+    if (slot->used && slot->pipeline != VK_NULL_HANDLE) {
+        slot->hits++;
+        variants->hits++;
+        return slot->pipeline;
+    }
+
+    variants->misses++;
+
+    if (slot->used) {
+        slot->origin = "on demand";
+    } else {
+        reservePipelineVariant(variants, slot, key, "on demand");
+    }
+
+    compilePipelineVariant(variants, slot);
+
+    return slot->pipeline;
+}
+
+typedef struct {
+    PipelineVariants *variants;
+    PipelineVariant *slots[PIPELINE_VARIANT_SLOTS];
+} PrewarmJob;
+
+void prewarmPipelineVariant(void *context, uint32_t index) {
+    PrewarmJob *job = context;
+
+    compilePipelineVariant(job->variants, job->slots[index]);
+}
+
+// Creates the variants of keys not created yet on up to threadCount workers,
+// and returns once all of them are done. Lookups of them are hits after.
+void prewarmPipelineVariants(PipelineVariants *variants,
+                             const PipelineKey *keys, uint32_t keyCount,
+                             uint32_t threadCount) {
+    PrewarmJob job = {.variants = variants};
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < keyCount; i++) {
+        PipelineVariant *slot = findPipelineVariant(variants, &keys[i]);
+
+        if (!slot->used) {
+            reservePipelineVariant(variants, slot, &keys[i], "prewarmed");
+            job.slots[count++] = slot;
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    threadCount = threadCount < 1 ? 1 : threadCount;
+
+    ThreadPool pool;
+    createThreadPool(&pool, threadCount < count ? threadCount : count);
+    runThreadPoolTasks(&pool, prewarmPipelineVariant, &job, count);
+    destroyThreadPool(&pool);
+}
+
+/**
+ * Switches to reloaded shaders, taking over their modules. pipeline, built
+ * from them without a base, becomes key's variant and the new base. Every
+ * other variant is dropped and recompiled from the new shaders on its next
+ * lookup.
+ *
+ * Writes the pipelines dropped or replaced to retired, for the caller to
+ * destroy once no frame uses them, and returns how many there are.
+ */
+uint32_t reloadPipelineVariants(PipelineVariants *variants,
+                                const PipelineKey *key, VkPipeline pipeline,
+                                double createMs,
+                                VkShaderModule vertShaderModule,
+                                VkShaderModule fragShaderModule,
+                                VkPipeline *retired) {
+    // pipelines keep working without the modules they were created from
+    if (variants->ownsShaderModules) {
+        vkDestroyShaderModule(variants->device, variants->vertShaderModule,
+                              NULL);
+        vkDestroyShaderModule(variants->device, variants->fragShaderModule,
+                              NULL);
+    }
+
+    variants->vertShaderModule = vertShaderModule;
+    variants->fragShaderModule = fragShaderModule;
+    variants->ownsShaderModules = true;
+
+    uint32_t retiredCount = 0;
+
+    for (uint32_t i = 0; i < PIPELINE_VARIANT_SLOTS; i++) {
+        PipelineVariant *slot = &variants->slots[i];
+
+        if (slot->used && slot->pipeline != VK_NULL_HANDLE) {
+            retired[retiredCount++] = slot->pipeline;
+            slot->pipeline = VK_NULL_HANDLE;
+        }
+    }
+
+    PipelineVariant *slot = findPipelineVariant(variants, key);
+
+    if (!slot->used) {
+        reservePipelineVariant(variants, slot, key, "reloaded");
+    }
+
+    slot->pipeline = pipeline;
+    slot->createMs = createMs;
+    slot->origin = "reloaded";
+
+    // derivatives stay valid without their base
+    variants->base = pipeline;
+
+    return retiredCount;
+}
+
+void destroyPipelineVariants(PipelineVariants *variants) {
+    for (uint32_t i = 0; i < PIPELINE_VARIANT_SLOTS; i++) {
+        if (variants->slots[i].used) {
+            vkDestroyPipeline(variants->device, variants->slots[i].pipeline,
+                              NULL);
+        }
+    }
+
+    if (variants->ownsShaderModules) {
+        vkDestroyShaderModule(variants->device, variants->vertShaderModule,
+                              NULL);
+        vkDestroyShaderModule(variants->device, variants->fragShaderModule,
+                              NULL);
+        variants->ownsShaderModules = false;
+    }
+
+    variants->count = 0;
+    variants->base = VK_NULL_HANDLE;
+}
+
+// One line per variant, how long it took to create and how often it was
+// looked up since, which every recorded frame does once
+void printPipelineVariants(const PipelineVariants *variants) {
+    uint32_t lookups = variants->hits + variants->misses;
+
+    fprintf(stdout,
+            "%u graphics pipeline variants, %u lookups, %.1f%% hit rate\n",
+            variants->count, lookups,
+            lookups > 0 ? variants->hits * 100.0 / lookups : 0.0);
+
+    for (uint32_t i = 0; i < PIPELINE_VARIANT_SLOTS; i++) {
+        const PipelineVariant *slot = &variants->slots[i];
+
+        if (!slot->used || slot->pipeline == VK_NULL_HANDLE) {
+            continue;
+        }
+
+        fprintf(stdout,
+                "\tblend=%s cull=%s topology=%u samples=%u alpha=%.2f "
+                "instance_colors=%s culled=%s: %.3f ms (%s), %u hits\n",
+                blendModeNames[slot->key.blend],
+                cullModeNames[slot->key.cullMode], slot->key.topology,
+                slot->key.samples, slot->key.constants.alpha,
+                slot->key.constants.instanceColors ? "on" : "off",
+                slot->key.constants.culledInstances ? "on" : "off",
+                slot->createMs, slot->origin, slot->hits);
+    }
+}
+
+void createFramebuffers(VkDevice device, VkFramebuffer *swapchainFramebuffers,
+                        uint32_t swapchainFramebuffersCount,
+                        VkImageView *swapchainImageViews,
+                        VkRenderPass renderPass, VkExtent2D extent) {
+    for (uint32_t i = 0; i < swapchainFramebuffersCount; i++) {
+        VkImageView attachments[] = {swapchainImageViews[i]};
+
+        VkFramebufferCreateInfo framebufferInfo = {
+            .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+            .renderPass = renderPass,
+            .attachmentCount = 1,
+            .pAttachments = attachments,
+            .width = extent.width,
+            .height = extent.height,
+            .layers = 1,
+        };
+
+        if (vkCreateFramebuffer(device, &framebufferInfo, NULL,
+                                &swapchainFramebuffers[i]) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create framebuffer.\n");
+            exit(1);
+        }
+    };
+}
+
+/**
+ * Rebuilds the swapchain and the objects that depend on its images, without
+ * framebuffers when renderPass is VK_NULL_HANDLE for dynamic rendering.
+ *
+ * The render pass and the pipeline only depend on the format, which does not
+ * change, and viewport and scissor are dynamic state, so both are kept.
+ * Returns the time spent, in milliseconds, including the wait for the device
+ * to go idle.
+ */
+double recreateSwapchain(VkDevice device, VkPhysicalDevice physicalDevice,
+                         VkSurfaceKHR surface, GLFWwindow *window,
+                         RenderTarget *target, VkRenderPass renderPass) {
+    // a minimized window has no extent to render to, wait until it's back
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(window, &width, &height);
+    while (width == 0 || height == 0) {
+        glfwWaitEvents();
+        glfwGetFramebufferSize(window, &width, &height);
+    }
+
+    double start = getTimeMs();
+
+    vkDeviceWaitIdle(device);
+
+    VkSwapchainKHR oldSwapchain = target->swapchain;
+    destroyRenderTargetViews(device, target);
+
+    target->extent = chooseExtent(physicalDevice, surface, width, height);
+
+    VkSurfaceFormatKHR format = {
+        .format = target->format,
+        .colorSpace = target->colorSpace,
+    };
+
+    target->swapchain = createSwapchain(
+        device, physicalDevice, surface, format, target->extent,
+        target->presentMode, target->requestedImageCount, target->usage,
+        oldSwapchain);
+    vkDestroySwapchainKHR(device, oldSwapchain, NULL);
+
+    getSwapchainImages(device, target);
+    createImageViews(device, target->imageViews, target->images,
+                     target->imageCount, target->format);
+
+    if (renderPass != VK_NULL_HANDLE) {
+        createFramebuffers(device, target->framebuffers, target->imageCount,
+                           target->imageViews, renderPass, target->extent);
+    }
+
+    return getTimeMs() - start;
+}
+
+VkCommandPool createCommandPool(VkDevice device, uint32_t queueFamilyIndex,
+                                VkCommandPoolCreateFlags flags) {
     VkCommandPoolCreateInfo poolInfo = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-        .queueFamilyIndex = graphicsFamilyIndex,
+        .flags = flags,
+        .queueFamilyIndex = queueFamilyIndex,
     };
 
     VkCommandPool commandPool;
@@ -922,285 +3013,4493 @@ void createCommandBuffers(VkDevice device, VkCommandPool commandPool,
     }
 }
 
-void recordCommandBuffer(VkCommandBuffer commandBuffer, VkRenderPass renderPass,
-                         VkFramebuffer framebuffer, VkPipeline graphicsPipeline,
-                         VkExtent2D extent) {
-    VkCommandBufferBeginInfo beginInfo = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        .flags = 0,               // Optional
-        .pInheritanceInfo = NULL, // Optional
-    };
+// A buffer in DEVICE_LOCAL memory, filled once through a staging copy
+typedef struct {
+    VkBuffer buffer;
+    Allocation allocation;
+    VkDeviceSize size;
+} GpuBuffer;
+
+void destroyGpuBuffer(Allocator *allocator, GpuBuffer *buffer) {
+    vkDestroyBuffer(allocator->device, buffer->buffer, NULL);
+    freeAllocation(allocator, &buffer->allocation);
+    *buffer = (GpuBuffer){};
+}
 
-    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to begin recording command buffer.\n");
+typedef struct {
+    GpuBuffer vertices;
+    GpuBuffer indices;
+    uint32_t indexCount;
+} Mesh;
+
+// Ends commandBuffer, submits it on queue and waits for it to complete
+void submitUpload(VkDevice device, VkQueue queue,
+                  VkCommandBuffer commandBuffer, const char *what) {
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to record %s command buffer.\n", what);
         exit(1);
+    }
+
+    VkFence fence;
+    VkFenceCreateInfo fenceInfo = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
     };
+    vkCreateFence(device, &fenceInfo, NULL, &fence);
 
-    VkOffset2D offset = {
-        .x = 0.0f,
-        .y = 0.0f,
+    VkSubmitInfo submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &commandBuffer,
     };
 
-    VkClearValue clearColor = {.color = {0.0f, 0.0f, 0.0f, 0.0f}};
+    if (vkQueueSubmit(queue, 1, &submitInfo, fence) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to submit %s.\n", what);
+        exit(1);
+    }
 
-    VkRenderPassBeginInfo renderPassInfo = {
-        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-        .renderPass = renderPass,
-        .framebuffer = framebuffer,
-        .renderArea.offset = offset,
-        .renderArea.extent = extent,
-        .clearValueCount = 1,
-        .pClearValues = &clearColor,
+    vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+    vkDestroyFence(device, fence, NULL);
+}
+
+/**
+ * Uploads vertices and indices into two DEVICE_LOCAL buffers.
+ *
+ * Both go through one host-visible staging buffer and one transfer submission
+ * on queue, which is waited on before returning. uploadMs receives the time
+ * from the start of the staging memcpy to the end of the copy.
+ */
+Mesh createMesh(Allocator *allocator, VkCommandPool commandPool,
+                VkQueue queue,
+                const Vertex *vertices, uint32_t vertexCount,
+                const uint32_t *indices, uint32_t indexCount,
+                double *uploadMs) {
+    Mesh mesh = {
+        .vertices.size = vertexCount * sizeof(Vertex),
+        .indices.size = indexCount * sizeof(uint32_t),
+        .indexCount = indexCount,
     };
 
-    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
-                         VK_SUBPASS_CONTENTS_INLINE);
+    VkDevice device = allocator->device;
+    VkDeviceSize stagingSize = mesh.vertices.size + mesh.indices.size;
 
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                      graphicsPipeline);
+    // host visible allocations stay mapped for their whole lifetime
+    VkBuffer stagingBuffer;
+    Allocation stagingAllocation;
+    createBuffer(allocator, stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &stagingBuffer, &stagingAllocation);
 
-    VkViewport viewport = {
-        .x = 0.0f,
-        .y = 0.0f,
-        .width = (float)(extent.width),
-        .height = (float)(extent.height),
-        .minDepth = 0.0f,
-        .maxDepth = 1.0f,
-    };
-    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    createBuffer(allocator, mesh.vertices.size,
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                     VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &mesh.vertices.buffer,
+                 &mesh.vertices.allocation);
 
-    VkRect2D scissor = {
-        .offset = offset,
-        .extent = extent,
-    };
-    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+    createBuffer(allocator, mesh.indices.size,
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                     VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &mesh.indices.buffer,
+                 &mesh.indices.allocation);
 
-    vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+    double start = getTimeMs();
 
-    vkCmdEndRenderPass(commandBuffer);
+    char *data = stagingAllocation.mapped;
+    memcpy(data, vertices, mesh.vertices.size);
+    memcpy(data + mesh.vertices.size, indices, mesh.indices.size);
 
-    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to record command buffer.\n");
-        exit(1);
-    }
-}
+    VkCommandBuffer commandBuffer;
+    createCommandBuffers(device, commandPool, &commandBuffer, 1);
 
-void createSemaphores(VkDevice device, VkSemaphore *semaphores,
-                      uint32_t semaphoresCound) {
-    VkSemaphoreCreateInfo semaphoreInfo = {
-        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
     };
 
-    for (u_int32_t i; i < semaphoresCound; i++) {
-        if (vkCreateSemaphore(device, &semaphoreInfo, NULL, &semaphores[i]) !=
-            VK_SUCCESS) {
-            fprintf(stderr, "ERROR: failed to create semaphore.\n");
-            exit(1);
-        }
-    }
-}
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
-void createFence(VkDevice device, VkFence *fences, uint32_t fencesCount) {
-    VkFenceCreateInfo fenceInfo = {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+    VkBufferCopy vertexCopy = {
+        .srcOffset = 0,
+        .dstOffset = 0,
+        .size = mesh.vertices.size,
     };
+    vkCmdCopyBuffer(commandBuffer, stagingBuffer, mesh.vertices.buffer, 1,
+                    &vertexCopy);
 
-    for (uint32_t i = 0; i < fencesCount; i++) {
-        if (vkCreateFence(device, &fenceInfo, NULL, &fences[i]) != VK_SUCCESS) {
-            fprintf(stderr, "ERROR: failed to create fence.\n");
-            exit(1);
-        };
+    VkBufferCopy indexCopy = {
+        .srcOffset = mesh.vertices.size,
+        .dstOffset = 0,
+        .size = mesh.indices.size,
     };
-}
+    vkCmdCopyBuffer(commandBuffer, stagingBuffer, mesh.indices.buffer, 1,
+                    &indexCopy);
+
+    // later submissions on this queue read the buffers as vertex input
+    VkMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+                         VK_ACCESS_INDEX_READ_BIT,
+    };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0,
+                         NULL, 0, NULL);
 
-void draw(VkDevice device, VkCommandBuffer commandBuffer,
-          VkSwapchainKHR swapchain, VkFramebuffer *swapchainFramebuffers,
-          VkPipeline graphicsPipeline, VkQueue graphicsQueue,
-          VkQueue presentQueue, VkRenderPass renderPass, VkExtent2D extent,
-          VkFence inFlightFence, VkSemaphore imageAvailableSemaphore,
-          VkSemaphore renderFinishedSemaphore) {
+    submitUpload(device, queue, commandBuffer, "mesh upload");
 
-    vkWaitForFences(device, 1, &inFlightFence, VK_TRUE, UINT64_MAX);
-    vkResetFences(device, 1, &inFlightFence);
+    *uploadMs = getTimeMs() - start;
 
-    uint32_t imageIndex;
-    vkAcquireNextImageKHR(device, swapchain, UINT64_MAX,
-                          imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
-    vkResetCommandBuffer(commandBuffer, 0);
-    recordCommandBuffer(commandBuffer, renderPass,
-                        swapchainFramebuffers[imageIndex], graphicsPipeline,
-                        extent);
+    vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    vkDestroyBuffer(device, stagingBuffer, NULL);
+    freeAllocation(allocator, &stagingAllocation);
 
-    VkSemaphore waitSemaphores[] = {imageAvailableSemaphore};
-    VkPipelineStageFlags waitStages[] = {
-        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+    return mesh;
+}
 
-    VkSemaphore signalSemaphores[] = {renderFinishedSemaphore};
+void destroyMesh(Allocator *allocator, Mesh *mesh) {
+    destroyGpuBuffer(allocator, &mesh->vertices);
+    destroyGpuBuffer(allocator, &mesh->indices);
+    mesh->indexCount = 0;
+}
 
-    VkSubmitInfo submitInfo = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .waitSemaphoreCount = 1,
-        .pWaitSemaphores = waitSemaphores,
-        .pWaitDstStageMask = waitStages,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &commandBuffer,
-        .signalSemaphoreCount = 1,
-        .pSignalSemaphores = signalSemaphores,
+/**
+ * Uploads the bounding sphere of every object into a DEVICE_LOCAL storage
+ * buffer for the cull pass, through staging like createMesh.
+ *
+ * Every object draws the one mesh, so each gets meshBounds; a scene of
+ * several meshes would write each object's own.
+ */
+GpuBuffer createObjectBounds(Allocator *allocator, VkCommandPool commandPool,
+                             VkQueue queue, const vec4 meshBounds,
+                             uint32_t objectCount) {
+    GpuBuffer bounds = {
+        .size = (VkDeviceSize)(objectCount > 0 ? objectCount : 1) *
+                sizeof(vec4),
     };
 
-    if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFence) !=
-        VK_SUCCESS) {
-        fprintf(stderr, "ERROR: failed to submit draw command buffer.\n");
-        exit(1);
-    };
+    VkDevice device = allocator->device;
 
-    VkSwapchainKHR swapchains[] = {swapchain};
+    VkBuffer stagingBuffer;
+    Allocation stagingAllocation;
+    createBuffer(allocator, bounds.size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 &stagingBuffer, &stagingAllocation);
 
-    VkPresentInfoKHR presentInfo = {
-        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-        .waitSemaphoreCount = 1,
-        .pWaitSemaphores = signalSemaphores,
-        .swapchainCount = 1,
-        .pSwapchains = swapchains,
-        .pImageIndices = &imageIndex,
-        .pResults = NULL,
-    };
+    createBuffer(allocator, bounds.size,
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &bounds.buffer,
+                 &bounds.allocation);
 
-    vkQueuePresentKHR(presentQueue, &presentInfo);
-}
+    vec4 *data = stagingAllocation.mapped;
+    for (uint32_t i = 0; i < objectCount; i++) {
+        memcpy(data[i], meshBounds, sizeof(vec4));
+    }
 
-int main() {
-    // random code to test cglm works
-    mat4 matrix;
-    vec4 vec;
-    vec4 res;
-    glm_mat4_mulv(matrix, vec, res);
+    VkCommandBuffer commandBuffer;
+    createCommandBuffers(device, commandPool, &commandBuffer, 1);
 
-    // actual code
-    GLFWwindow *window = initWindow();
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
 
-    if (enableValidationLayers && !checkValidationLayerSupport()) {
-        fprintf(stderr,
-                "ERROR: validation layers requested, but not available\n");
-        exit(1);
-    }
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
 
-    VkInstance instance = createInstance();
-    VkDebugUtilsMessengerEXT debugMessenger;
+    VkBufferCopy copy = {
+        .srcOffset = 0,
+        .dstOffset = 0,
+        .size = bounds.size,
+    };
+    vkCmdCopyBuffer(commandBuffer, stagingBuffer, bounds.buffer, 1, &copy);
 
-    if (enableValidationLayers) {
-        debugMessenger = setupDebugMessenger(instance);
+    // later submissions on this queue read them in the cull pass
+    VkMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
     };
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier,
+                         0, NULL, 0, NULL);
 
-    VkSurfaceKHR surface = createSurface(instance, window);
+    submitUpload(device, queue, commandBuffer, "object bounds upload");
 
-    VkPhysicalDevice physicalDevice = pickPhysicalDevice(instance, surface);
-    VkDevice device = createLogicalDevice(physicalDevice, surface);
+    vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    vkDestroyBuffer(device, stagingBuffer, NULL);
+    freeAllocation(allocator, &stagingAllocation);
 
-    VkQueue graphicsQueue = getGraphicsQueue(device, physicalDevice);
-    VkQueue presentQueue =
-        getPresentationQueue(device, physicalDevice, surface);
+    return bounds;
+}
 
-    VkSurfaceFormatKHR format = chooseSurfaceFormat(physicalDevice, surface);
-    VkPresentModeKHR presentMode = choosePresentMode(physicalDevice, surface);
-    VkExtent2D extent = chooseExtent(physicalDevice, surface, window);
+/**
+ * Builds a cells x cells grid of quads covering the viewport, four vertices
+ * and six indices per quad, colored by position. The arrays are malloc'ed.
+ */
+void generateGridMesh(uint32_t cells, Vertex **vertices, uint32_t *vertexCount,
+                      uint32_t **indices, uint32_t *indexCount) {
+    uint64_t quadCount = (uint64_t)cells * cells;
 
-    VkSwapchainKHR swapchain = createSwapchain(device, physicalDevice, surface,
-                                               format, extent, presentMode);
+    if (quadCount * 4 > UINT32_MAX || quadCount * 6 > UINT32_MAX) {
+        fprintf(stderr, "ERROR: mesh grid of %d is too large.\n", cells);
+        exit(1);
+    }
 
-    uint32_t imageCount;
-    vkGetSwapchainImagesKHR(device, swapchain, &imageCount, NULL);
-    VkImage swapchainImages[imageCount];
-    vkGetSwapchainImagesKHR(device, swapchain, &imageCount, swapchainImages);
+    *vertexCount = quadCount * 4;
+    *indexCount = quadCount * 6;
+    *vertices = malloc(*vertexCount * sizeof(Vertex));
+    *indices = malloc(*indexCount * sizeof(uint32_t));
 
-    VkImageView swapchainImageViews[imageCount];
-    createImageViews(device, swapchainImageViews, swapchainImages, imageCount,
-                     format);
+    if (!*vertices || !*indices) {
+        fprintf(stderr, "ERROR: failed to allocate mesh grid.\n");
+        exit(1);
+    }
 
-    VkRenderPass renderPass = createRenderPass(device, format.format);
+    float cellSize = 2.0f / cells;
+    // a small gap keeps the quads visibly apart
+    float quadSize = cellSize * 0.9f;
+
+    for (uint32_t y = 0; y < cells; y++) {
+        for (uint32_t x = 0; x < cells; x++) {
+            uint32_t quad = y * cells + x;
+            float left = -1.0f + x * cellSize;
+            float top = -1.0f + y * cellSize;
+            float r = (float)x / cells;
+            float g = (float)y / cells;
+
+            Vertex *v = &(*vertices)[quad * 4];
+            v[0] = (Vertex){{left, top}, {r, g, 1.0f}};
+            v[1] = (Vertex){{left + quadSize, top}, {r, g, 0.5f}};
+            v[2] = (Vertex){{left + quadSize, top + quadSize}, {r, g, 0.0f}};
+            v[3] = (Vertex){{left, top + quadSize}, {r, g, 0.5f}};
+
+            uint32_t *i = &(*indices)[quad * 6];
+            uint32_t base = quad * 4;
+            i[0] = base;
+            i[1] = base + 1;
+            i[2] = base + 2;
+            i[3] = base + 2;
+            i[4] = base + 3;
+            i[5] = base;
+        }
+    }
+}
 
-    VkShaderModule vertShaderModule = createShaderModule(device, "vert.spv");
-    VkShaderModule fragShaderModule = createShaderModule(device, "frag.spv");
+// Queues that signal the timeline, each through a semaphore of its own
+typedef enum {
+    TIMELINE_GRAPHICS,
+    TIMELINE_COMPUTE,
+    TIMELINE_TRANSFER,
+    TIMELINE_QUEUE_COUNT,
+} TimelineQueue;
+
+/**
+ * Timeline semaphore synchronization, --timeline-sync. Every submission takes
+ * the next value of one counter shared by all queues and signals it on the
+ * semaphore of its queue, which replaces the frame fences and the binary
+ * semaphores between queues. One semaphore per queue keeps the signals of
+ * each in increasing order, a single one could not be signaled by queues
+ * that finish out of order.
+ */
+typedef struct {
+    bool enabled;
+    VkSemaphore semaphores[TIMELINE_QUEUE_COUNT];
+    uint64_t lastValue; // taken by the latest submission
+    PFN_vkWaitSemaphoresKHR waitSemaphores;
+    PFN_vkGetSemaphoreCounterValueKHR getCounterValue;
+    uint32_t slowWaitMs;
+    uint32_t slowWaits; // CPU waits that took longer than slowWaitMs
+} Timeline;
+
+void createTimeline(Timeline *timeline, VkDevice device,
+                    uint32_t slowWaitMs) {
+    *timeline = (Timeline){
+        .enabled = true,
+        .lastValue = 0,
+        .slowWaitMs = slowWaitMs,
+        .slowWaits = 0,
+    };
 
-    VkPipelineLayout graphicsPipelineLayout =
-        createGraphicsPipelineLayout(device);
+    // the device always enables VK_KHR_timeline_semaphore, so the KHR entry
+    // points are there whatever the instance version
+    timeline->waitSemaphores = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(
+        device, "vkWaitSemaphoresKHR");
+    timeline->getCounterValue =
+        (PFN_vkGetSemaphoreCounterValueKHR)vkGetDeviceProcAddr(
+            device, "vkGetSemaphoreCounterValueKHR");
 
-    VkPipeline graphicsPipeline =
-        createGraphicsPipeline(device, graphicsPipelineLayout, renderPass,
-                               extent, vertShaderModule, fragShaderModule);
+    if (!timeline->waitSemaphores || !timeline->getCounterValue) {
+        fprintf(stderr,
+                "ERROR: failed to load timeline semaphore functions.\n");
+        exit(1);
+    }
 
-    VkFramebuffer swapchainFramebuffers[imageCount];
-    createFramebuffers(device, swapchainFramebuffers, imageCount,
-                       swapchainImageViews, renderPass, extent);
+    VkSemaphoreTypeCreateInfo typeInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+    };
 
-    VkCommandPool commandPool = createCommandPool(device, physicalDevice);
+    VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &typeInfo,
+    };
 
-    VkCommandBuffer commandBuffers[MAX_FRAMES_IN_FLIGHT];
-    createCommandBuffers(device, commandPool, commandBuffers,
-                         MAX_FRAMES_IN_FLIGHT);
+    for (uint32_t i = 0; i < TIMELINE_QUEUE_COUNT; i++) {
+        if (vkCreateSemaphore(device, &semaphoreInfo, NULL,
+                              &timeline->semaphores[i]) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create timeline semaphore.\n");
+            exit(1);
+        }
+    }
+}
 
-    VkSemaphore imageAvailableSemaphores[MAX_FRAMES_IN_FLIGHT];
-    createSemaphores(device, imageAvailableSemaphores, MAX_FRAMES_IN_FLIGHT);
+void destroyTimeline(VkDevice device, Timeline *timeline) {
+    if (!timeline->enabled) {
+        return;
+    }
 
-    VkSemaphore renderFinishedSemaphores[MAX_FRAMES_IN_FLIGHT];
-    createSemaphores(device, renderFinishedSemaphores, MAX_FRAMES_IN_FLIGHT);
+    for (uint32_t i = 0; i < TIMELINE_QUEUE_COUNT; i++) {
+        vkDestroySemaphore(device, timeline->semaphores[i], NULL);
+    }
 
-    VkFence inFlightFences[MAX_FRAMES_IN_FLIGHT];
-    createFence(device, inFlightFences, MAX_FRAMES_IN_FLIGHT);
+    timeline->enabled = false;
+}
 
-    uint32_t currentFrame = 0;
+// Reserves the value the next submission signals
+uint64_t nextTimelineValue(Timeline *timeline) {
+    return ++timeline->lastValue;
+}
 
-    // main loop
-    while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
+bool timelineReached(const Timeline *timeline, VkDevice device,
+                     TimelineQueue queue, uint64_t value) {
+    uint64_t current;
 
-        draw(device, commandBuffers[currentFrame], swapchain,
-             swapchainFramebuffers, graphicsPipeline, graphicsQueue,
-             presentQueue, renderPass, extent, inFlightFences[currentFrame],
-             imageAvailableSemaphores[currentFrame],
-             renderFinishedSemaphores[currentFrame]);
-        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+    if (timeline->getCounterValue(device, timeline->semaphores[queue],
+                                  &current) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to read timeline semaphore.\n");
+        exit(1);
     }
 
-    vkDeviceWaitIdle(device);
-
-    // clean up
+    return current >= value;
+}
 
-    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-        vkDestroySemaphore(device, imageAvailableSemaphores[i], NULL);
-        vkDestroySemaphore(device, renderFinishedSemaphores[i], NULL);
-        vkDestroyFence(device, inFlightFences[i], NULL);
+/**
+ * Blocks until the semaphore of queue reaches value. A wait that runs past
+ * slowWaitMs is counted and reported, then finished without a timeout.
+ */
+void waitTimeline(Timeline *timeline, VkDevice device, TimelineQueue queue,
+                  uint64_t value) {
+    VkSemaphoreWaitInfo waitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &timeline->semaphores[queue],
+        .pValues = &value,
     };
 
-    vkDestroyCommandPool(device, commandPool, NULL);
+    VkResult result = timeline->waitSemaphores(
+        device, &waitInfo, (uint64_t)timeline->slowWaitMs * 1000000);
 
-    vkDestroyShaderModule(device, fragShaderModule, NULL);
-    vkDestroyShaderModule(device, vertShaderModule, NULL);
+    if (result == VK_TIMEOUT) {
+        timeline->slowWaits++;
+        fprintf(stdout, "slow frame: GPU still busy after %d ms\n",
+                timeline->slowWaitMs);
 
-    for (uint32_t i = 0; i < imageCount; i++) {
-        vkDestroyFramebuffer(device, swapchainFramebuffers[i], NULL);
+        result = timeline->waitSemaphores(device, &waitInfo, UINT64_MAX);
     }
 
-    vkDestroyPipeline(device, graphicsPipeline, NULL);
-    vkDestroyPipelineLayout(device, graphicsPipelineLayout, NULL);
-    vkDestroyRenderPass(device, renderPass, NULL);
-
-    for (uint32_t i = 0; i < imageCount; i++) {
-        vkDestroyImageView(device, swapchainImageViews[i], NULL);
+    if (result != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to wait for timeline semaphore.\n");
+        exit(1);
+    }
+}
+
+#define STREAM_SLOT_COUNT 3
+
+typedef enum {
+    STREAM_IDLE,
+    STREAM_COPYING,   // submitted to the transfer queue
+    STREAM_ACQUIRING, // taken over by a frame that has not finished yet
+} StreamState;
+
+// One chunk in flight: its own staging and destination buffers, and what
+// the copy signals when it is done
+typedef struct {
+    StreamState state;
+    GpuBuffer staging; // persistently mapped
+    GpuBuffer destination;
+    VkCommandBuffer commandBuffer;
+    VkFence copyFence;
+    VkSemaphore copySemaphore; // waited on by the acquiring frame
+    uint64_t copyValue;        // replaces both with timeline sync
+    uint32_t acquiringFrame;   // frame slot of that frame
+} StreamSlot;
+
+/**
+ * Uploads a chunk to device local memory every frame, on a queue of its own
+ * so large uploads overlap rendering instead of stalling it.
+ *
+ * With a dedicated transfer family each copy ends with a release of the
+ * destination to the graphics family, and the first frame to find the copy
+ * done records the matching acquire and waits on its semaphore. Without one
+ * the chunks go through the graphics queue and no ownership changes hands.
+ */
+typedef struct {
+    bool enabled; // start a new chunk every frame
+    bool dedicated;
+    uint32_t family;
+    uint32_t graphicsFamily;
+    VkQueue queue;
+    VkCommandPool commandPool;
+    VkDeviceSize chunkSize;
+    StreamSlot slots[STREAM_SLOT_COUNT];
+    uint32_t nextSlot;
+    uint64_t uploadedBytes;
+    uint32_t busyFrames; // frames that found the next slot still busy
+    Timeline *timeline;
+} Streamer;
+
+void createStreamer(Streamer *streamer, Allocator *allocator,
+                    VkPhysicalDevice physicalDevice, VkDeviceSize chunkSize,
+                    Timeline *timeline) {
+    VkDevice device = allocator->device;
+    int32_t transferFamily = getTransferFamily(physicalDevice);
+
+    *streamer = (Streamer){
+        .enabled = false,
+        .dedicated = transferFamily != -1,
+        .graphicsFamily = getGraphicsFamily(physicalDevice),
+        .chunkSize = chunkSize,
+        .nextSlot = 0,
+        .timeline = timeline,
+    };
+
+    streamer->family =
+        streamer->dedicated ? transferFamily : streamer->graphicsFamily;
+    vkGetDeviceQueue(device, streamer->family, 0, &streamer->queue);
+
+    streamer->commandPool =
+        createCommandPool(device, streamer->family,
+                          VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+
+    for (uint32_t i = 0; i < STREAM_SLOT_COUNT; i++) {
+        StreamSlot *slot = &streamer->slots[i];
+
+        slot->state = STREAM_IDLE;
+
+        slot->staging.size = chunkSize;
+        createBuffer(allocator, chunkSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &slot->staging.buffer, &slot->staging.allocation);
+
+        // stands in for the asset, written once so the frames only pay for
+        // the transfer
+        memset(slot->staging.allocation.mapped, (int)i, chunkSize);
+
+        slot->destination.size = chunkSize;
+        createBuffer(allocator, chunkSize,
+                     VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     &slot->destination.buffer,
+                     &slot->destination.allocation);
+
+        createCommandBuffers(device, streamer->commandPool,
+                             &slot->commandBuffer, 1);
+
+        slot->copyFence = VK_NULL_HANDLE;
+        slot->copySemaphore = VK_NULL_HANDLE;
+        slot->copyValue = 0;
+
+        if (!timeline->enabled) {
+            createFence(device, &slot->copyFence, 1);
+            createSemaphores(device, &slot->copySemaphore, 1);
+        }
+    }
+}
+
+void destroyStreamer(Allocator *allocator, Streamer *streamer) {
+    VkDevice device = allocator->device;
+
+    if (streamer->commandPool == VK_NULL_HANDLE) {
+        return;
+    }
+
+    vkQueueWaitIdle(streamer->queue);
+
+    for (uint32_t i = 0; i < STREAM_SLOT_COUNT; i++) {
+        StreamSlot *slot = &streamer->slots[i];
+
+        destroyGpuBuffer(allocator, &slot->staging);
+        destroyGpuBuffer(allocator, &slot->destination);
+        vkDestroyFence(device, slot->copyFence, NULL);
+        vkDestroySemaphore(device, slot->copySemaphore, NULL);
+    }
+
+    vkDestroyCommandPool(device, streamer->commandPool, NULL);
+    streamer->commandPool = VK_NULL_HANDLE;
+}
+
+// The chunks acquired by a frame slot are free again once its fence was
+// waited on. After a device wait, pass UINT32_MAX to free all of them.
+void releaseStreamSlots(Streamer *streamer, uint32_t frameIndex) {
+    for (uint32_t i = 0; i < STREAM_SLOT_COUNT; i++) {
+        StreamSlot *slot = &streamer->slots[i];
+
+        if (slot->state == STREAM_ACQUIRING &&
+            (frameIndex == UINT32_MAX || slot->acquiringFrame == frameIndex)) {
+            slot->state = STREAM_IDLE;
+        }
+    }
+}
+
+/**
+ * Hands finished chunks over to the frame in slot frameIndex and starts the
+ * next one.
+ *
+ * Fills acquires with the ownership acquires the frame has to record, and
+ * waitSemaphores and waitValues with what its submission has to wait on, all
+ * sized for STREAM_SLOT_COUNT; returns the number of semaphores. Copies are
+ * only picked up once they are done, so the waits never stall.
+ */
+uint32_t pumpStreamer(Streamer *streamer, VkDevice device, uint32_t frameIndex,
+                      VkBufferMemoryBarrier *acquires, uint32_t *acquireCount,
+                      VkSemaphore *waitSemaphores, uint64_t *waitValues) {
+    Timeline *timeline = streamer->timeline;
+    uint32_t waitCount = 0;
+    uint64_t timelineWait = 0;
+    *acquireCount = 0;
+
+    for (uint32_t i = 0; i < STREAM_SLOT_COUNT; i++) {
+        StreamSlot *slot = &streamer->slots[i];
+
+        if (slot->state != STREAM_COPYING) {
+            continue;
+        }
+
+        bool done = timeline->enabled
+                        ? timelineReached(timeline, device, TIMELINE_TRANSFER,
+                                          slot->copyValue)
+                        : vkGetFenceStatus(device, slot->copyFence) ==
+                              VK_SUCCESS;
+
+        if (!done) {
+            continue;
+        }
+
+        if (streamer->dedicated) {
+            acquires[(*acquireCount)++] = (VkBufferMemoryBarrier){
+                .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+                .srcAccessMask = 0,
+                .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+                .srcQueueFamilyIndex = streamer->family,
+                .dstQueueFamilyIndex = streamer->graphicsFamily,
+                .buffer = slot->destination.buffer,
+                .offset = 0,
+                .size = VK_WHOLE_SIZE,
+            };
+        }
+
+        if (timeline->enabled) {
+            // the latest value covers every earlier copy
+            timelineWait = slot->copyValue > timelineWait ? slot->copyValue
+                                                          : timelineWait;
+        } else {
+            waitValues[waitCount] = 0;
+            waitSemaphores[waitCount++] = slot->copySemaphore;
+        }
+
+        slot->state = STREAM_ACQUIRING;
+        slot->acquiringFrame = frameIndex;
+    }
+
+    if (timelineWait > 0) {
+        waitValues[waitCount] = timelineWait;
+        waitSemaphores[waitCount++] = timeline->semaphores[TIMELINE_TRANSFER];
+    }
+
+    if (!streamer->enabled) {
+        return waitCount;
+    }
+
+    StreamSlot *slot = &streamer->slots[streamer->nextSlot];
+
+    if (slot->state != STREAM_IDLE) {
+        streamer->busyFrames++;
+        return waitCount;
+    }
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    if (vkBeginCommandBuffer(slot->commandBuffer, &beginInfo) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to begin recording command buffer.\n");
+        exit(1);
+    }
+
+    VkBufferCopy copyRegion = {
+        .srcOffset = 0,
+        .dstOffset = 0,
+        .size = streamer->chunkSize,
+    };
+    vkCmdCopyBuffer(slot->commandBuffer, slot->staging.buffer,
+                    slot->destination.buffer, 1, &copyRegion);
+
+    if (streamer->dedicated) {
+        VkBufferMemoryBarrier release = {
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = 0,
+            .srcQueueFamilyIndex = streamer->family,
+            .dstQueueFamilyIndex = streamer->graphicsFamily,
+            .buffer = slot->destination.buffer,
+            .offset = 0,
+            .size = VK_WHOLE_SIZE,
+        };
+
+        vkCmdPipelineBarrier(slot->commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL,
+                             1, &release, 0, NULL);
+    }
+
+    if (vkEndCommandBuffer(slot->commandBuffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to record command buffer.\n");
+        exit(1);
+    }
+
+    VkSubmitInfo submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &slot->commandBuffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &slot->copySemaphore,
+    };
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &slot->copyValue,
+    };
+
+    if (timeline->enabled) {
+        slot->copyValue = nextTimelineValue(timeline);
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.pSignalSemaphores = &timeline->semaphores[TIMELINE_TRANSFER];
+    } else {
+        vkResetFences(device, 1, &slot->copyFence);
+    }
+
+    if (vkQueueSubmit(streamer->queue, 1, &submitInfo, slot->copyFence) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to submit stream upload.\n");
+        exit(1);
+    }
+
+    slot->state = STREAM_COPYING;
+    streamer->uploadedBytes += streamer->chunkSize;
+    streamer->nextSlot = (streamer->nextSlot + 1) % STREAM_SLOT_COUNT;
+
+    return waitCount;
+}
+
+// Bounding sphere of the vertices around the center of their bounding box,
+// xyz is the center and w the radius
+void computeMeshBounds(const Vertex *vertices, uint32_t vertexCount,
+                       vec4 bounds) {
+    vec2 min = {vertices[0].position[0], vertices[0].position[1]};
+    vec2 max = {min[0], min[1]};
+
+    for (uint32_t i = 1; i < vertexCount; i++) {
+        for (uint32_t axis = 0; axis < 2; axis++) {
+            float value = vertices[i].position[axis];
+            min[axis] = value < min[axis] ? value : min[axis];
+            max[axis] = value > max[axis] ? value : max[axis];
+        }
+    }
+
+    float centerX = (min[0] + max[0]) * 0.5f;
+    float centerY = (min[1] + max[1]) * 0.5f;
+    float radiusSquared = 0.0f;
+
+    for (uint32_t i = 0; i < vertexCount; i++) {
+        float dx = vertices[i].position[0] - centerX;
+        float dy = vertices[i].position[1] - centerY;
+        float distanceSquared = dx * dx + dy * dy;
+        radiusSquared =
+            distanceSquared > radiusSquared ? distanceSquared : radiusSquared;
+    }
+
+    bounds[0] = centerX;
+    bounds[1] = centerY;
+    bounds[2] = 0.0f;
+    bounds[3] = sqrtf(radiusSquared);
+}
+
+typedef struct {
+    mat4 viewProj;
+} CameraUniforms;
+
+typedef struct {
+    mat4 model;
+} ObjectUniforms;
+
+// One element of the instance array, std430 layout. The vertex shader picks
+// its element with gl_InstanceIndex.
+typedef struct {
+    mat4 model; // relative to the object
+    vec4 color; // multiplies the vertex color
+} InstanceData;
+
+// Uniform and instance data of one frame, sub-allocated from a linear block
+// that stays mapped. The buffer spans the whole block and a single
+// descriptor set points at it, the offsets of each draw are passed as
+// dynamic offsets.
+typedef struct {
+    MemoryBlock *block;
+    VkBuffer buffer;
+    VkDescriptorSet descriptorSet;
+} UniformArena;
+
+UniformArena createUniformArena(Allocator *allocator,
+                                VkDescriptorPool descriptorPool,
+                                VkDescriptorSetLayout setLayout,
+                                VkDeviceSize size, uint32_t maxInstances) {
+    VkDevice device = allocator->device;
+    UniformArena arena;
+
+    VkBufferCreateInfo bufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = size,
+        .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+
+    if (vkCreateBuffer(device, &bufferInfo, NULL, &arena.buffer) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create uniform buffer.\n");
+        exit(1);
+    }
+
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(device, arena.buffer, &memRequirements);
+
+    arena.block = createLinearBlock(allocator, memRequirements.size,
+                                    memRequirements.memoryTypeBits,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    vkBindBufferMemory(device, arena.buffer, arena.block->memory, 0);
+
+    VkDescriptorSetAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = descriptorPool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &setLayout,
+    };
+
+    if (vkAllocateDescriptorSets(device, &allocInfo, &arena.descriptorSet) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to allocate descriptor set.\n");
+        exit(1);
+    }
+
+    VkDescriptorBufferInfo cameraInfo = {
+        .buffer = arena.buffer,
+        .offset = 0,
+        .range = sizeof(CameraUniforms),
+    };
+
+    VkDescriptorBufferInfo objectInfo = {
+        .buffer = arena.buffer,
+        .offset = 0,
+        .range = sizeof(ObjectUniforms),
+    };
+
+    // the range is fixed here, so it covers the largest instance count
+    VkDescriptorBufferInfo instanceInfo = {
+        .buffer = arena.buffer,
+        .offset = 0,
+        .range = (VkDeviceSize)maxInstances * sizeof(InstanceData),
+    };
+
+    // only read with --gpu-cull, which points the visible instances at the
+    // cull pass' output; until then they need some buffer to be valid
+    VkDescriptorBufferInfo arenaInfo = {
+        .buffer = arena.buffer,
+        .offset = 0,
+        .range = VK_WHOLE_SIZE,
+    };
+
+    VkWriteDescriptorSet writes[] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = arena.descriptorSet,
+            .dstBinding = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .pBufferInfo = &cameraInfo,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = arena.descriptorSet,
+            .dstBinding = 1,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .pBufferInfo = &objectInfo,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = arena.descriptorSet,
+            .dstBinding = 2,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+            .pBufferInfo = &instanceInfo,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = arena.descriptorSet,
+            .dstBinding = 3,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &arenaInfo,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = arena.descriptorSet,
+            .dstBinding = 4,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &arenaInfo,
+        },
+    };
+
+    vkUpdateDescriptorSets(device, 5, writes, 0, NULL);
+
+    return arena;
+}
+
+// The descriptor set goes away with its pool
+void destroyUniformArena(Allocator *allocator, UniformArena *arena) {
+    vkDestroyBuffer(allocator->device, arena->buffer, NULL);
+    destroyLinearBlock(allocator, arena->block);
+}
+
+// Output of one frame slot's cull pass
+typedef struct {
+    // a VkDrawIndexedIndirectCommand per draw with visible instances, packed
+    // at the front, the rest zeroed
+    GpuBuffer commands;
+    // object and instance, instanceCount slots per draw
+    GpuBuffer visible;
+    // the count of commands, then the visible instances per draw, which the
+    // host also reads
+    GpuBuffer counts;
+    VkDescriptorSet descriptorSet;
+    uint32_t drawCount; // of the last submission, to read counts back
+    uint32_t instanceCount;
+    bool pending; // counts were submitted and not read back yet
+} CullBuffers;
+
+// Compute pre-pass that tests every instance of every draw against the
+// camera frustum and its object's bounds. The draws left with visible
+// instances become indirect commands, all drawn by one indirect draw; the
+// vertex shader looks their instances up by instance index.
+typedef struct {
+    bool enabled;
+    IndirectCountSupport indirectCount; // set with the device
+    // NULL without indirectCount support, every command is drawn then
+    PFN_vkCmdDrawIndexedIndirectCountKHR drawIndexedIndirectCount;
+    VkDescriptorSetLayout setLayout;
+    VkDescriptorPool descriptorPool;
+    VkPipelineLayout pipelineLayout;
+    VkPipeline pipeline;
+    GpuBuffer objectBounds; // vec4 per object, uploaded with the mesh
+    CullBuffers frames[MAX_FRAMES_IN_FLIGHT];
+    uint64_t culledFrames;
+    uint64_t testedTotal;
+    uint64_t visibleTotal;
+    uint64_t drawTotal;
+    uint64_t visibleDrawTotal;
+} GpuCuller;
+
+// Push constants of cull.comp. Offsets and the stride count vec4s into the
+// uniform arena.
+typedef struct {
+    uint32_t cameraOffset;
+    uint32_t objectOffset;
+    uint32_t objectStride;
+    uint32_t instanceOffset;
+    uint32_t instanceCount;
+    uint32_t drawCount;
+    uint32_t indexCount;
+    uint32_t compact; // 0 tests every instance, 1 packs the draws
+} CullParams;
+
+#define CULL_GROUP_SIZE 64
+
+/**
+ * Builds the cull pipeline and the outputs of every frame slot. The object
+ * bounds have to be uploaded already, see createObjectBounds.
+ *
+ * Slot i reads arenas[i] whole, as a storage buffer, so the pass sees the
+ * same matrices as the draws, and points the arena's visible instances
+ * binding at its own. maxCulled bounds draws times instances.
+ */
+void createGpuCuller(GpuCuller *culler, Allocator *allocator,
+                     VkPipelineCache pipelineCache,
+                     VkShaderModule shaderModule, const UniformArena *arenas,
+                     uint32_t arenaCount, uint32_t maxDraws,
+                     uint32_t maxCulled) {
+    VkDevice device = allocator->device;
+
+    if (culler->indirectCount == INDIRECT_COUNT_CORE) {
+        culler->drawIndexedIndirectCount =
+            (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr(
+                device, "vkCmdDrawIndexedIndirectCount");
+    } else if (culler->indirectCount == INDIRECT_COUNT_EXTENSION) {
+        culler->drawIndexedIndirectCount =
+            (PFN_vkCmdDrawIndexedIndirectCountKHR)vkGetDeviceProcAddr(
+                device, "vkCmdDrawIndexedIndirectCountKHR");
+    }
+
+    VkDescriptorSetLayoutBinding bindings[5];
+    for (uint32_t i = 0; i < 5; i++) {
+        bindings[i] = (VkDescriptorSetLayoutBinding){
+            .binding = i,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        };
+    }
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 5,
+        .pBindings = bindings,
+    };
+
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, NULL,
+                                    &culler->setLayout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor set layout.\n");
+        exit(1);
+    }
+
+    VkDescriptorPoolSize poolSize = {
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = arenaCount * 5,
+    };
+
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = arenaCount,
+        .poolSizeCount = 1,
+        .pPoolSizes = &poolSize,
+    };
+
+    if (vkCreateDescriptorPool(device, &poolInfo, NULL,
+                               &culler->descriptorPool) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor pool.\n");
+        exit(1);
+    }
+
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(CullParams),
+    };
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &culler->setLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
+
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, NULL,
+                               &culler->pipelineLayout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create pipeline layout.\n");
+        exit(1);
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage =
+            {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                .module = shaderModule,
+                .pName = "main",
+            },
+        .layout = culler->pipelineLayout,
+    };
+
+    if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, NULL,
+                                 &culler->pipeline) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create cull pipeline.\n");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < arenaCount; i++) {
+        CullBuffers *buffers = &culler->frames[i];
+
+        buffers->commands.size = (VkDeviceSize)(maxDraws > 0 ? maxDraws : 1) *
+                                 sizeof(VkDrawIndexedIndirectCommand);
+        createBuffer(allocator, buffers->commands.size,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     &buffers->commands.buffer, &buffers->commands.allocation);
+
+        buffers->visible.size = (VkDeviceSize)(maxCulled > 0 ? maxCulled : 1) *
+                                2 * sizeof(uint32_t);
+        createBuffer(allocator, buffers->visible.size,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                     &buffers->visible.buffer, &buffers->visible.allocation);
+
+        // small and read back every frame, so it stays in mapped memory
+        buffers->counts.size =
+            (VkDeviceSize)(1 + maxDraws) * sizeof(uint32_t);
+        createBuffer(allocator, buffers->counts.size,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                         VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &buffers->counts.buffer, &buffers->counts.allocation);
+
+        buffers->pending = false;
+
+        VkDescriptorSetAllocateInfo allocInfo = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = culler->descriptorPool,
+            .descriptorSetCount = 1,
+            .pSetLayouts = &culler->setLayout,
+        };
+
+        if (vkAllocateDescriptorSets(device, &allocInfo,
+                                     &buffers->descriptorSet) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to allocate descriptor set.\n");
+            exit(1);
+        }
+
+        VkDescriptorBufferInfo bufferInfos[] = {
+            {arenas[i].buffer, 0, VK_WHOLE_SIZE},
+            {buffers->commands.buffer, 0, VK_WHOLE_SIZE},
+            {buffers->visible.buffer, 0, VK_WHOLE_SIZE},
+            {culler->objectBounds.buffer, 0, VK_WHOLE_SIZE},
+            {buffers->counts.buffer, 0, VK_WHOLE_SIZE},
+        };
+
+        VkWriteDescriptorSet writes[6];
+        for (uint32_t binding = 0; binding < 5; binding++) {
+            writes[binding] = (VkWriteDescriptorSet){
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = buffers->descriptorSet,
+                .dstBinding = binding,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &bufferInfos[binding],
+            };
+        }
+
+        // the draws of this slot read the visible instances through the
+        // arena's set
+        writes[5] = (VkWriteDescriptorSet){
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = arenas[i].descriptorSet,
+            .dstBinding = 3,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pBufferInfo = &bufferInfos[2],
+        };
+
+        vkUpdateDescriptorSets(device, 6, writes, 0, NULL);
+    }
+
+    culler->enabled = true;
+}
+
+void destroyGpuCuller(Allocator *allocator, GpuCuller *culler) {
+    if (!culler->enabled) {
+        return;
+    }
+
+    VkDevice device = allocator->device;
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        destroyGpuBuffer(allocator, &culler->frames[i].commands);
+        destroyGpuBuffer(allocator, &culler->frames[i].visible);
+        destroyGpuBuffer(allocator, &culler->frames[i].counts);
+    }
+
+    destroyGpuBuffer(allocator, &culler->objectBounds);
+
+    vkDestroyPipeline(device, culler->pipeline, NULL);
+    vkDestroyPipelineLayout(device, culler->pipelineLayout, NULL);
+    vkDestroyDescriptorPool(device, culler->descriptorPool, NULL);
+    vkDestroyDescriptorSetLayout(device, culler->setLayout, NULL);
+
+    culler->enabled = false;
+}
+
+// Adds up what a slot's last cull pass kept. Only after the slot's fence was
+// waited on.
+void readCullCounts(GpuCuller *culler, CullBuffers *buffers) {
+    if (!buffers->pending) {
+        return;
+    }
+
+    const uint32_t *counts = buffers->counts.allocation.mapped;
+    uint64_t visible = 0;
+
+    // the draw count comes first, then the instance count of every draw
+    for (uint32_t i = 0; i < buffers->drawCount; i++) {
+        visible += counts[1 + i];
+    }
+
+    culler->visibleTotal += visible;
+    culler->testedTotal +=
+        (uint64_t)buffers->drawCount * buffers->instanceCount;
+    culler->visibleDrawTotal += counts[0];
+    culler->drawTotal += buffers->drawCount;
+    culler->culledFrames++;
+    buffers->pending = false;
+}
+
+void printCullStats(const GpuCuller *culler) {
+    if (!culler->enabled || culler->culledFrames == 0) {
+        return;
+    }
+
+    double frames = (double)culler->culledFrames;
+    double visible = culler->visibleTotal / frames;
+    double tested = culler->testedTotal / frames;
+
+    fprintf(stdout,
+            "GPU culling (%s), mean of %llu frames: %.1f visible, %.1f "
+            "culled of %.1f instances, %.1f of %.1f draws drawn\n\n",
+            culler->drawIndexedIndirectCount ? "indirect count"
+                                             : "multi-draw indirect",
+            (unsigned long long)culler->culledFrames, visible,
+            tested - visible, tested, culler->visibleDrawTotal / frames,
+            culler->drawTotal / frames);
+}
+
+// Passes bracketed by timestamp queries, each one owns a begin and an end
+// query in every frame's pool.
+typedef enum {
+    GPU_PASS_CULL,     // empty unless --gpu-cull
+    GPU_PASS_SIMULATE, // empty unless the simulation runs on this queue
+    GPU_PASS_RENDER,
+    GPU_PASS_COUNT,
+} GpuPass;
+
+const char *gpuPassNames[GPU_PASS_COUNT] = {"cull_pass", "simulate_pass",
+                                            "render_pass"};
+
+#define GPU_TIMING_WINDOW 128
+
+// Turns the timestamps written into each frame's query pool into per-pass
+// milliseconds, keeping the last GPU_TIMING_WINDOW frames for a rolling mean.
+typedef struct {
+    bool enabled;
+    double timestampPeriod; // nanoseconds per tick
+    uint64_t timestampMask;
+    double lastMs[GPU_PASS_COUNT];
+    double samples[GPU_PASS_COUNT][GPU_TIMING_WINDOW];
+    // first timestamp to last, how long the frame kept the graphics queue
+    double lastBusyMs;
+    double busySamples[GPU_TIMING_WINDOW];
+    uint32_t sampleCount;
+} GpuTimer;
+
+GpuTimer createGpuTimer(VkPhysicalDevice physicalDevice) {
+    GpuTimer timer = {
+        .enabled = false,
+    };
+
+    uint32_t queueFamilyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                             NULL);
+
+    VkQueueFamilyProperties queueFamilies[queueFamilyCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                             queueFamilies);
+
+    uint32_t validBits =
+        queueFamilies[getGraphicsFamily(physicalDevice)].timestampValidBits;
+
+    if (validBits == 0) {
+        fprintf(stdout, "graphics queue has no timestamp support, GPU "
+                        "timings disabled\n");
+        return timer;
+    }
+
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProps);
+
+    timer.enabled = true;
+    timer.timestampPeriod = deviceProps.limits.timestampPeriod;
+    timer.timestampMask =
+        validBits >= 64 ? UINT64_MAX : (1ull << validBits) - 1;
+
+    return timer;
+}
+
+VkQueryPool createTimestampQueryPool(VkDevice device) {
+    VkQueryPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = GPU_PASS_COUNT * 2,
+    };
+
+    VkQueryPool queryPool;
+
+    if (vkCreateQueryPool(device, &poolInfo, NULL, &queryPool) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create query pool.\n");
+        exit(1);
+    }
+
+    return queryPool;
+}
+
+void writeGpuTimestamp(VkCommandBuffer commandBuffer, VkQueryPool queryPool,
+                       GpuPass pass, bool end) {
+    if (queryPool == VK_NULL_HANDLE) {
+        return;
+    }
+
+    vkCmdWriteTimestamp(commandBuffer,
+                        end ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+                            : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        queryPool, pass * 2 + (end ? 1 : 0));
+}
+
+/**
+ * Collects the timestamps a frame slot wrote the last time it was submitted.
+ *
+ * Must be called after that slot's fence has been waited on, so the results
+ * are already available and vkGetQueryPoolResults never blocks.
+ */
+void readGpuTimestamps(VkDevice device, GpuTimer *timer, VkQueryPool queryPool,
+                       bool *queryPending) {
+    if (queryPool == VK_NULL_HANDLE || !*queryPending) {
+        return;
+    }
+
+    uint64_t timestamps[GPU_PASS_COUNT * 2];
+
+    if (vkGetQueryPoolResults(device, queryPool, 0, GPU_PASS_COUNT * 2,
+                              sizeof(timestamps), timestamps, sizeof(uint64_t),
+                              VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+        return;
+    }
+
+    *queryPending = false;
+
+    uint32_t slot = timer->sampleCount % GPU_TIMING_WINDOW;
+
+    for (uint32_t pass = 0; pass < GPU_PASS_COUNT; pass++) {
+        uint64_t ticks = (timestamps[pass * 2 + 1] - timestamps[pass * 2]) &
+                         timer->timestampMask;
+
+        timer->lastMs[pass] = ticks * timer->timestampPeriod / 1000000.0;
+        timer->samples[pass][slot] = timer->lastMs[pass];
+    }
+
+    uint64_t busyTicks = (timestamps[GPU_PASS_COUNT * 2 - 1] - timestamps[0]) &
+                         timer->timestampMask;
+    timer->lastBusyMs = busyTicks * timer->timestampPeriod / 1000000.0;
+    timer->busySamples[slot] = timer->lastBusyMs;
+
+    timer->sampleCount++;
+}
+
+double getGpuPassRollingMs(const GpuTimer *timer, GpuPass pass) {
+    uint32_t count = timer->sampleCount < GPU_TIMING_WINDOW
+                         ? timer->sampleCount
+                         : GPU_TIMING_WINDOW;
+
+    if (count == 0) {
+        return 0.0;
+    }
+
+    double sum = 0.0;
+    for (uint32_t i = 0; i < count; i++) {
+        sum += timer->samples[pass][i];
+    }
+
+    return sum / count;
+}
+
+void printGpuTimes(const GpuTimer *timer) {
+    if (!timer->enabled) {
+        return;
+    }
+
+    uint32_t count = timer->sampleCount < GPU_TIMING_WINDOW
+                         ? timer->sampleCount
+                         : GPU_TIMING_WINDOW;
+
+    double busySum = 0.0;
+    for (uint32_t i = 0; i < count; i++) {
+        busySum += timer->busySamples[i];
+    }
+
+    fprintf(stdout, "GPU time, mean of the last %d frames:\n", count);
+    for (uint32_t pass = 0; pass < GPU_PASS_COUNT; pass++) {
+        fprintf(stdout, "\t%-14s %9.4f ms\n", gpuPassNames[pass],
+                getGpuPassRollingMs(timer, pass));
+    }
+    fprintf(stdout, "\t%-14s %9.4f ms\n", "graphics_busy",
+            count > 0 ? busySum / count : 0.0);
+    fprintf(stdout, "\n");
+}
+
+// Matches the Particle struct of particles.comp
+typedef struct {
+    vec4 position; // w is the remaining life in seconds
+    vec4 velocity;
+} Particle;
+
+// Push constants of particles.comp
+typedef struct {
+    float deltaTime;
+    uint32_t count;
+} ParticleParams;
+
+// What a frame slot uses to run the simulation on the compute queue
+typedef struct {
+    VkCommandBuffer commandBuffer;
+    // waited on before the slot records its next step
+    VkFence doneFence;
+    uint64_t doneValue; // replaces it with timeline sync
+    VkQueryPool queryPool;     // begin and end, VK_NULL_HANDLE without support
+    bool queryPending;
+} SimulationFrame;
+
+/**
+ * Particle simulation, a compute pass that stands in for any per-frame
+ * compute work. It runs either inside the frame's graphics command buffer or,
+ * with async set, on a queue of a compute-only family. Nothing draws the
+ * particles, so the graphics submission does not wait on the steps: they are
+ * ordered on the compute queue alone and overlap the rendering.
+ */
+typedef struct {
+    bool enabled;
+    bool async;
+    int32_t family; // compute-only family, -1 when there is none
+    VkQueue queue;
+    VkCommandPool commandPool;
+    VkDescriptorSetLayout setLayout;
+    VkDescriptorPool descriptorPool;
+    VkDescriptorSet descriptorSet;
+    VkPipelineLayout pipelineLayout;
+    VkPipeline pipeline;
+    GpuBuffer particles;
+    uint32_t particleCount;
+    bool cleared; // particles start zeroed, which respawns them all
+    SimulationFrame frames[MAX_FRAMES_IN_FLIGHT];
+    double timestampPeriod;
+    uint64_t timestampMask;
+    double lastMs; // of the last step on the compute queue
+    Timeline *timeline;
+} ParticleSim;
+
+void createParticleSim(ParticleSim *sim, Allocator *allocator,
+                       VkPhysicalDevice physicalDevice,
+                       VkPipelineCache pipelineCache,
+                       VkShaderModule shaderModule, uint32_t particleCount,
+                       Timeline *timeline) {
+    VkDevice device = allocator->device;
+    uint32_t graphicsFamily = getGraphicsFamily(physicalDevice);
+
+    *sim = (ParticleSim){
+        .enabled = true,
+        .async = false,
+        .family = getComputeFamily(physicalDevice),
+        .particleCount = particleCount,
+        .cleared = false,
+        .timeline = timeline,
+    };
+
+    // both queues step the same particles, without ownership transfers
+    uint32_t families[] = {graphicsFamily, sim->family};
+
+    VkBufferCreateInfo bufferInfo = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size = (VkDeviceSize)particleCount * sizeof(Particle),
+        .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                 VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        .sharingMode = sim->family != -1 ? VK_SHARING_MODE_CONCURRENT
+                                         : VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = sim->family != -1 ? 2 : 0,
+        .pQueueFamilyIndices = families,
+    };
+
+    if (vkCreateBuffer(device, &bufferInfo, NULL, &sim->particles.buffer) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create particle buffer.\n");
+        exit(1);
+    }
+
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements(device, sim->particles.buffer,
+                                  &memRequirements);
+
+    sim->particles.size = bufferInfo.size;
+    sim->particles.allocation =
+        allocateMemory(allocator, memRequirements,
+                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, RESOURCE_LINEAR);
+    vkBindBufferMemory(device, sim->particles.buffer,
+                       sim->particles.allocation.memory,
+                       sim->particles.allocation.offset);
+
+    VkDescriptorSetLayoutBinding binding = {
+        .binding = 0,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    };
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings = &binding,
+    };
+
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, NULL,
+                                    &sim->setLayout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor set layout.\n");
+        exit(1);
+    }
+
+    VkDescriptorPoolSize poolSize = {
+        .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+    };
+
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = 1,
+        .poolSizeCount = 1,
+        .pPoolSizes = &poolSize,
+    };
+
+    if (vkCreateDescriptorPool(device, &poolInfo, NULL,
+                               &sim->descriptorPool) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create descriptor pool.\n");
+        exit(1);
+    }
+
+    VkDescriptorSetAllocateInfo allocInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool = sim->descriptorPool,
+        .descriptorSetCount = 1,
+        .pSetLayouts = &sim->setLayout,
+    };
+
+    if (vkAllocateDescriptorSets(device, &allocInfo, &sim->descriptorSet) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to allocate descriptor set.\n");
+        exit(1);
+    }
+
+    VkDescriptorBufferInfo particleInfo = {
+        .buffer = sim->particles.buffer,
+        .offset = 0,
+        .range = VK_WHOLE_SIZE,
+    };
+
+    VkWriteDescriptorSet write = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = sim->descriptorSet,
+        .dstBinding = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo = &particleInfo,
+    };
+
+    vkUpdateDescriptorSets(device, 1, &write, 0, NULL);
+
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(ParticleParams),
+    };
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 1,
+        .pSetLayouts = &sim->setLayout,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &pushConstantRange,
+    };
+
+    if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, NULL,
+                               &sim->pipelineLayout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create pipeline layout.\n");
+        exit(1);
+    }
+
+    VkComputePipelineCreateInfo pipelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage =
+            {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                .module = shaderModule,
+                .pName = "main",
+            },
+        .layout = sim->pipelineLayout,
+    };
+
+    if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, NULL,
+                                 &sim->pipeline) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to create particle pipeline.\n");
+        exit(1);
+    }
+
+    if (sim->family == -1) {
+        return;
+    }
+
+    vkGetDeviceQueue(device, sim->family, 0, &sim->queue);
+
+    sim->commandPool = createCommandPool(
+        device, sim->family, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+
+    uint32_t queueFamilyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                             NULL);
+
+    VkQueueFamilyProperties queueFamilies[queueFamilyCount];
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+                                             queueFamilies);
+
+    uint32_t validBits = queueFamilies[sim->family].timestampValidBits;
+
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProps);
+
+    sim->timestampPeriod = deviceProps.limits.timestampPeriod;
+    sim->timestampMask =
+        validBits >= 64 ? UINT64_MAX : (1ull << validBits) - 1;
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        SimulationFrame *frame = &sim->frames[i];
+
+        createCommandBuffers(device, sim->commandPool, &frame->commandBuffer,
+                             1);
+
+        frame->doneFence = VK_NULL_HANDLE;
+        frame->doneValue = 0;
+
+        if (!timeline->enabled) {
+            createFence(device, &frame->doneFence, 1);
+        }
+
+        frame->queryPool = VK_NULL_HANDLE;
+        frame->queryPending = false;
+
+        if (validBits == 0) {
+            continue;
+        }
+
+        VkQueryPoolCreateInfo queryPoolInfo = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = 2,
+        };
+
+        if (vkCreateQueryPool(device, &queryPoolInfo, NULL,
+                              &frame->queryPool) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to create query pool.\n");
+            exit(1);
+        }
+    }
+}
+
+void destroyParticleSim(Allocator *allocator, ParticleSim *sim) {
+    VkDevice device = allocator->device;
+
+    if (!sim->enabled) {
+        return;
+    }
+
+    if (sim->family != -1) {
+        for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            vkDestroyFence(device, sim->frames[i].doneFence, NULL);
+
+            if (sim->frames[i].queryPool != VK_NULL_HANDLE) {
+                vkDestroyQueryPool(device, sim->frames[i].queryPool, NULL);
+            }
+        }
+
+        vkDestroyCommandPool(device, sim->commandPool, NULL);
+    }
+
+    destroyGpuBuffer(allocator, &sim->particles);
+    vkDestroyPipeline(device, sim->pipeline, NULL);
+    vkDestroyPipelineLayout(device, sim->pipelineLayout, NULL);
+    vkDestroyDescriptorPool(device, sim->descriptorPool, NULL);
+    vkDestroyDescriptorSetLayout(device, sim->setLayout, NULL);
+
+    sim->enabled = false;
+}
+
+// Records one step of the simulation, on whichever queue commandBuffer goes to
+void recordSimulation(VkCommandBuffer commandBuffer, ParticleSim *sim) {
+    if (!sim->cleared) {
+        vkCmdFillBuffer(commandBuffer, sim->particles.buffer, 0, VK_WHOLE_SIZE,
+                        0);
+        sim->cleared = true;
+    }
+
+    // orders the step after the previous one, and after the clear
+    VkMemoryBarrier stepBarrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask =
+            VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    };
+
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &stepBarrier, 0, NULL, 0,
+        NULL);
+
+    ParticleParams params = {
+        .deltaTime = 1.0f / 60.0f,
+        .count = sim->particleCount,
+    };
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      sim->pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            sim->pipelineLayout, 0, 1, &sim->descriptorSet, 0,
+                            NULL);
+    vkCmdPushConstants(commandBuffer, sim->pipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+    vkCmdDispatch(commandBuffer,
+                  (sim->particleCount + PARTICLE_GROUP_SIZE - 1) /
+                      PARTICLE_GROUP_SIZE,
+                  1, 1);
+}
+
+/**
+ * Submits the step of frame slot frameIndex to the compute queue. Steps
+ * follow each other in submission order on that queue, the barrier at the
+ * start of each one makes it wait for the last.
+ *
+ * Waits for the slot's previous step first, which is long done unless the
+ * compute queue falls a whole ring of frames behind.
+ */
+void submitSimulation(VkDevice device, ParticleSim *sim,
+                      uint32_t frameIndex) {
+    SimulationFrame *frame = &sim->frames[frameIndex];
+    VkCommandBuffer commandBuffer = frame->commandBuffer;
+
+    if (sim->timeline->enabled) {
+        waitTimeline(sim->timeline, device, TIMELINE_COMPUTE,
+                     frame->doneValue);
+    } else {
+        vkWaitForFences(device, 1, &frame->doneFence, VK_TRUE, UINT64_MAX);
+        vkResetFences(device, 1, &frame->doneFence);
+    }
+
+    if (frame->queryPool != VK_NULL_HANDLE && frame->queryPending) {
+        uint64_t timestamps[2];
+
+        if (vkGetQueryPoolResults(device, frame->queryPool, 0, 2,
+                                  sizeof(timestamps), timestamps,
+                                  sizeof(uint64_t),
+                                  VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+            uint64_t ticks =
+                (timestamps[1] - timestamps[0]) & sim->timestampMask;
+            sim->lastMs = ticks * sim->timestampPeriod / 1000000.0;
+            frame->queryPending = false;
+        }
+    }
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to begin recording command buffer.\n");
+        exit(1);
+    }
+
+    if (frame->queryPool != VK_NULL_HANDLE) {
+        vkCmdResetQueryPool(commandBuffer, frame->queryPool, 0, 2);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                            frame->queryPool, 0);
+    }
+
+    recordSimulation(commandBuffer, sim);
+
+    if (frame->queryPool != VK_NULL_HANDLE) {
+        vkCmdWriteTimestamp(commandBuffer,
+                            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                            frame->queryPool, 1);
+    }
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to record command buffer.\n");
+        exit(1);
+    }
+
+    VkSubmitInfo submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &commandBuffer,
+    };
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &frame->doneValue,
+    };
+
+    if (sim->timeline->enabled) {
+        frame->doneValue = nextTimelineValue(sim->timeline);
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores =
+            &sim->timeline->semaphores[TIMELINE_COMPUTE];
+    }
+
+    if (vkQueueSubmit(sim->queue, 1, &submitInfo, frame->doneFence) !=
+        VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to submit particle simulation.\n");
+        exit(1);
+    }
+
+    frame->queryPending = frame->queryPool != VK_NULL_HANDLE;
+}
+
+// Copy of the rendered image into a buffer, tightly packed
+typedef struct {
+    VkImage image;
+    VkImageLayout layout; // the image's layout once rendered, kept after
+    VkExtent2D extent;
+    VkBuffer buffer;
+} ReadbackCopy;
+
+// What recording a frame's draws needs, whichever path records them
+typedef struct {
+    VkPipeline pipeline;
+    VkPipelineLayout pipelineLayout;
+    VkExtent2D extent;
+    const Mesh *mesh;
+    uint32_t drawCount;
+    uint32_t instanceCount; // per draw, all draws share the instance array
+    VkDescriptorSet uniformSet;
+    uint32_t cameraOffset;
+    uint32_t objectOffset; // of the first draw, each next one is a stride on
+    uint32_t objectStride;
+    uint32_t instanceOffset;
+    // set when the draws come out of a cull pass, NULL draws directly
+    const GpuCuller *culler;
+    const CullBuffers *cullBuffers;
+    // streamed buffers whose ownership the frame takes over before its passes
+    const VkBufferMemoryBarrier *acquires;
+    uint32_t acquireCount;
+    // set when the simulation steps on the graphics queue, in this frame
+    ParticleSim *simulation;
+    // set when the frame is copied out after rendering
+    const ReadbackCopy *readback;
+} DrawList;
+
+// One invocation per item, folded into two dimensions past the group count
+// limit of a single one
+void dispatchCull(VkCommandBuffer commandBuffer, uint32_t invocationCount) {
+    uint32_t groupCount =
+        (invocationCount + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+    uint32_t groupsX = groupCount < 65535 ? groupCount : 65535;
+    uint32_t groupsY = groupsX > 0 ? (groupCount + groupsX - 1) / groupsX : 0;
+
+    if (groupCount > 0) {
+        vkCmdDispatch(commandBuffer, groupsX, groupsY, 1);
+    }
+}
+
+/**
+ * Records the cull pass of list. It has to run outside the render pass, the
+ * draws then read its output through recordDraws.
+ *
+ * The first dispatch tests every instance of every draw, packing each draw's
+ * visible ones at the front of its slots and counting them. The second packs
+ * the draws left with any into indirect commands and counts those.
+ */
+void recordCullPass(VkCommandBuffer commandBuffer, const DrawList *list) {
+    const GpuCuller *culler = list->culler;
+    const CullBuffers *buffers = list->cullBuffers;
+
+    // the counts start at zero, and so do the commands no draw is packed
+    // into
+    vkCmdFillBuffer(commandBuffer, buffers->commands.buffer, 0, VK_WHOLE_SIZE,
+                    0);
+    vkCmdFillBuffer(commandBuffer, buffers->counts.buffer, 0, VK_WHOLE_SIZE,
+                    0);
+
+    VkMemoryBarrier clearBarrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    };
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &clearBarrier, 0, NULL, 0, NULL);
+
+    CullParams params = {
+        .cameraOffset = list->cameraOffset / sizeof(vec4),
+        .objectOffset = list->objectOffset / sizeof(vec4),
+        .objectStride = list->objectStride / sizeof(vec4),
+        .instanceOffset = list->instanceOffset / sizeof(vec4),
+        .instanceCount = list->instanceCount,
+        .drawCount = list->drawCount,
+        .indexCount = list->mesh->indexCount,
+        .compact = 0,
+    };
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      culler->pipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                            culler->pipelineLayout, 0, 1,
+                            &buffers->descriptorSet, 0, NULL);
+    vkCmdPushConstants(commandBuffer, culler->pipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+    dispatchCull(commandBuffer, list->drawCount * list->instanceCount);
+
+    // the instance counts are final before any draw is packed
+    VkMemoryBarrier testBarrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    };
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &testBarrier, 0, NULL, 0, NULL);
+
+    params.compact = 1;
+    vkCmdPushConstants(commandBuffer, culler->pipelineLayout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+    dispatchCull(commandBuffer, list->drawCount);
+
+    VkMemoryBarrier cullBarrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                         VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_HOST_READ_BIT,
+    };
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                             VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                             VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 1, &cullBarrier, 0, NULL, 0, NULL);
+}
+
+// Every draw of the cull pass in one indirect draw. Each visible instance
+// carries where its draw's model matrix is, so one bind serves all of them.
+void recordCulledDraws(VkCommandBuffer commandBuffer, const DrawList *list) {
+    const GpuCuller *culler = list->culler;
+    const CullBuffers *buffers = list->cullBuffers;
+
+    uint32_t dynamicOffsets[] = {
+        list->cameraOffset,
+        list->objectOffset,
+        list->instanceOffset,
+    };
+
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            list->pipelineLayout, 0, 1, &list->uniformSet, 3,
+                            dynamicOffsets);
+
+    if (culler->drawIndexedIndirectCount) {
+        culler->drawIndexedIndirectCount(
+            commandBuffer, buffers->commands.buffer, 0, buffers->counts.buffer,
+            0, list->drawCount, sizeof(VkDrawIndexedIndirectCommand));
+        return;
+    }
+
+    // the commands past the packed ones are zeroed and draw nothing
+    vkCmdDrawIndexedIndirect(commandBuffer, buffers->commands.buffer, 0,
+                             list->drawCount,
+                             sizeof(VkDrawIndexedIndirectCommand));
+}
+
+/**
+ * Binds the pipeline and mesh and records draws [firstDraw, firstDraw +
+ * drawCount). Secondary command buffers inherit none of this state, so each
+ * sets it.
+ *
+ * The draws of a cull pass are one indirect draw, so they are recorded all
+ * at once by whoever is given any of them.
+ */
+void recordDraws(VkCommandBuffer commandBuffer, const DrawList *list,
+                 uint32_t firstDraw, uint32_t drawCount) {
+    const Mesh *mesh = list->mesh;
+    VkExtent2D extent = list->extent;
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      list->pipeline);
+
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &mesh->vertices.buffer,
+                           &offset);
+    vkCmdBindIndexBuffer(commandBuffer, mesh->indices.buffer, 0,
+                         VK_INDEX_TYPE_UINT32);
+
+    VkViewport viewport = {
+        .x = 0.0f,
+        .y = 0.0f,
+        .width = (float)(extent.width),
+        .height = (float)(extent.height),
+        .minDepth = 0.0f,
+        .maxDepth = 1.0f,
+    };
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+    VkRect2D scissor = {
+        .offset = {0, 0},
+        .extent = extent,
+    };
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    if (list->culler) {
+        if (drawCount > 0) {
+            recordCulledDraws(commandBuffer, list);
+        }
+
+        return;
+    }
+
+    for (uint32_t i = firstDraw; i < firstDraw + drawCount; i++) {
+        uint32_t dynamicOffsets[] = {
+            list->cameraOffset,
+            list->objectOffset + i * list->objectStride,
+            list->instanceOffset,
+        };
+
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                list->pipelineLayout, 0, 1, &list->uniformSet,
+                                3, dynamicOffsets);
+        vkCmdDrawIndexed(commandBuffer, mesh->indexCount, list->instanceCount,
+                         0, 0, 0);
+    }
+}
+
+// Rendering without render pass or framebuffer objects, Vulkan 1.3 only
+typedef struct {
+    bool enabled;
+    PFN_vkCmdBeginRendering beginRendering;
+    PFN_vkCmdEndRendering endRendering;
+    PFN_vkCmdPipelineBarrier2 pipelineBarrier2;
+    VkFormat format;
+    VkImageLayout finalLayout; // what the render pass would leave behind
+} DynamicRendering;
+
+// Where a frame renders to: a render pass and framebuffer, or with dynamic
+// rendering the image and its view
+typedef struct {
+    VkRenderPass renderPass;
+    VkFramebuffer framebuffer;
+    VkImage image;
+    VkImageView imageView;
+    const DynamicRendering *dynamic; // NULL with a render pass
+} PassTarget;
+
+// Moves image between the layouts around dynamic rendering, taking the place
+// of the render pass' layout transitions and external dependencies. Into
+// TRANSFER_SRC_OPTIMAL the transfers after it wait for it, as a readback must.
+void recordImageTransition(VkCommandBuffer commandBuffer,
+                           const DynamicRendering *dynamic, VkImage image,
+                           VkImageLayout oldLayout, VkImageLayout newLayout) {
+    bool toAttachment = newLayout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    bool toTransfer = newLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+
+    VkImageMemoryBarrier2 barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+        .srcAccessMask =
+            toAttachment ? VK_ACCESS_2_NONE
+                         : VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+        .dstStageMask = toAttachment
+                            ? VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT
+                        : toTransfer ? VK_PIPELINE_STAGE_2_TRANSFER_BIT
+                                     : VK_PIPELINE_STAGE_2_NONE,
+        .dstAccessMask = toAttachment ? VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT
+                         : toTransfer ? VK_ACCESS_2_TRANSFER_READ_BIT
+                                      : VK_ACCESS_2_NONE,
+        .oldLayout = oldLayout,
+        .newLayout = newLayout,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+    };
+
+    VkDependencyInfo dependencyInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .imageMemoryBarrierCount = 1,
+        .pImageMemoryBarriers = &barrier,
+    };
+
+    dynamic->pipelineBarrier2(commandBuffer, &dependencyInfo);
+}
+
+/**
+ * Copies the rendered image into copy->buffer and makes the copy visible to
+ * the host once the frame's fence or timeline value is signaled. The image
+ * goes through TRANSFER_SRC_OPTIMAL and ends in copy->layout, so present
+ * does not see a difference.
+ *
+ * The image is in currentLayout, left there by a dependency with transfer as
+ * its destination: the render pass' external one, or the transition after
+ * dynamic rendering.
+ */
+void recordReadback(VkCommandBuffer commandBuffer, const ReadbackCopy *copy,
+                    VkImageLayout currentLayout) {
+    // chains onto that dependency, which already made the image visible
+    VkImageMemoryBarrier imageBarrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = 0,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+        .oldLayout = currentLayout,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = copy->image,
+        .subresourceRange =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+    };
+
+    if (currentLayout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) {
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0,
+                             NULL, 1, &imageBarrier);
+    }
+
+    VkBufferImageCopy region = {
+        .bufferOffset = 0,
+        .bufferRowLength = 0, // tightly packed
+        .bufferImageHeight = 0,
+        .imageSubresource =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .imageOffset = {0, 0, 0},
+        .imageExtent = {copy->extent.width, copy->extent.height, 1},
+    };
+
+    vkCmdCopyImageToBuffer(commandBuffer, copy->image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, copy->buffer,
+                           1, &region);
+
+    VkBufferMemoryBarrier bufferBarrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer = copy->buffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+
+    // the copy only read the image, nothing to make available on the way back
+    imageBarrier.srcAccessMask = 0;
+    imageBarrier.dstAccessMask = 0;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    imageBarrier.newLayout = copy->layout;
+
+    uint32_t imageBarrierCount =
+        copy->layout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL ? 1 : 0;
+
+    vkCmdPipelineBarrier(
+        commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+        0, NULL, 1, &bufferBarrier, imageBarrierCount, &imageBarrier);
+}
+
+/**
+ * Records the frame's render pass into commandBuffer, or the equivalent
+ * dynamic rendering with the layout transitions around it.
+ *
+ * With secondaryCount zero the draws are recorded inline, otherwise the
+ * render pass only executes the already recorded secondary command buffers.
+ */
+void recordCommandBuffer(VkCommandBuffer commandBuffer, const PassTarget *pass,
+                         VkQueryPool queryPool, const DrawList *list,
+                         const VkCommandBuffer *secondaries,
+                         uint32_t secondaryCount) {
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = 0,               // Optional
+        .pInheritanceInfo = NULL, // Optional
+    };
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to begin recording command buffer.\n");
+        exit(1);
+    };
+
+    if (queryPool != VK_NULL_HANDLE) {
+        vkCmdResetQueryPool(commandBuffer, queryPool, 0, GPU_PASS_COUNT * 2);
+    }
+
+    VkOffset2D offset = {
+        .x = 0.0f,
+        .y = 0.0f,
+    };
+
+    VkClearValue clearColor = {.color = {0.0f, 0.0f, 0.0f, 0.0f}};
+
+    VkRenderPassBeginInfo renderPassInfo = {
+        .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+        .renderPass = pass->renderPass,
+        .framebuffer = pass->framebuffer,
+        .renderArea.offset = offset,
+        .renderArea.extent = list->extent,
+        .clearValueCount = 1,
+        .pClearValues = &clearColor,
+    };
+
+    if (list->acquireCount > 0) {
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                             VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 0, NULL,
+                             list->acquireCount, list->acquires, 0, NULL);
+    }
+
+    // written either way, every query of the pool has to be available
+    writeGpuTimestamp(commandBuffer, queryPool, GPU_PASS_CULL, false);
+    if (list->culler) {
+        recordCullPass(commandBuffer, list);
+    }
+    writeGpuTimestamp(commandBuffer, queryPool, GPU_PASS_CULL, true);
+
+    writeGpuTimestamp(commandBuffer, queryPool, GPU_PASS_SIMULATE, false);
+    if (list->simulation) {
+        recordSimulation(commandBuffer, list->simulation);
+    }
+    writeGpuTimestamp(commandBuffer, queryPool, GPU_PASS_SIMULATE, true);
+
+    writeGpuTimestamp(commandBuffer, queryPool, GPU_PASS_RENDER, false);
+
+    const DynamicRendering *dynamic = pass->dynamic;
+
+    if (dynamic) {
+        recordImageTransition(commandBuffer, dynamic, pass->image,
+                              VK_IMAGE_LAYOUT_UNDEFINED,
+                              VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+
+        VkRenderingAttachmentInfo colorAttachment = {
+            .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+            .imageView = pass->imageView,
+            .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+            .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+            .clearValue = clearColor,
+        };
+
+        VkRenderingInfo renderingInfo = {
+            .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+            .flags = secondaryCount > 0
+                         ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT
+                         : 0,
+            .renderArea.offset = offset,
+            .renderArea.extent = list->extent,
+            .layerCount = 1,
+            .colorAttachmentCount = 1,
+            .pColorAttachments = &colorAttachment,
+        };
+
+        dynamic->beginRendering(commandBuffer, &renderingInfo);
+    } else {
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                             secondaryCount > 0
+                                 ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+                                 : VK_SUBPASS_CONTENTS_INLINE);
+    }
+
+    if (secondaryCount > 0) {
+        vkCmdExecuteCommands(commandBuffer, secondaryCount, secondaries);
+    } else {
+        recordDraws(commandBuffer, list, 0, list->drawCount);
+    }
+
+    if (dynamic) {
+        // a frame read back goes straight to the copy's layout, the readback
+        // moves it on to the final one
+        dynamic->endRendering(commandBuffer);
+        recordImageTransition(commandBuffer, dynamic, pass->image,
+                              VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                              list->readback
+                                  ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                                  : dynamic->finalLayout);
+    } else {
+        vkCmdEndRenderPass(commandBuffer);
+    }
+
+    writeGpuTimestamp(commandBuffer, queryPool, GPU_PASS_RENDER, true);
+
+    if (list->readback) {
+        recordReadback(commandBuffer, list->readback,
+                       dynamic ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                               : list->readback->layout);
+    }
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to record command buffer.\n");
+        exit(1);
+    }
+}
+
+#define MAX_FRAME_TRANSIENTS 16
+
+// A buffer the GPU reads during one frame, such as a staging upload. It is
+// released the next time that frame's fence is waited on.
+typedef struct {
+    VkBuffer buffer;
+    Allocation allocation;
+} TransientBuffer;
+
+// Everything one frame in flight owns. Its fence guards all of it, so once
+// the fence is signaled the slot is reused without touching any other slot.
+typedef struct {
+    VkCommandPool commandPool;
+    VkCommandBuffer commandBuffer;
+    // one pool per recording task, picked by task index, so no two workers
+    // share a pool within a frame
+    uint32_t workerCount;
+    VkCommandPool workerPools[MAX_RECORD_THREADS];
+    VkCommandBuffer workerBuffers[MAX_RECORD_THREADS];
+    VkSemaphore imageAvailableSemaphore;
+    VkFence inFlightFence; // VK_NULL_HANDLE with timeline sync
+    uint64_t timelineValue; // graphics value of the last submission, or 0
+    VkQueryPool queryPool; // VK_NULL_HANDLE without timestamp support
+    bool queryPending;     // queryPool was submitted and not read back yet
+    uint32_t transientCount;
+    TransientBuffer transients[MAX_FRAME_TRANSIENTS];
+} FrameContext;
+
+void createFrameContexts(VkDevice device, VkPhysicalDevice physicalDevice,
+                         FrameContext *frames, uint32_t frameCount,
+                         uint32_t workerCount, bool timestamps,
+                         bool timelineSync) {
+    uint32_t graphicsFamily = getGraphicsFamily(physicalDevice);
+
+    for (uint32_t i = 0; i < frameCount; i++) {
+        FrameContext *frame = &frames[i];
+
+        // the whole pool is reset every frame, never single buffers
+        frame->commandPool = createCommandPool(
+            device, graphicsFamily, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+        createCommandBuffers(device, frame->commandPool,
+                             &frame->commandBuffer, 1);
+
+        frame->workerCount = workerCount;
+
+        for (uint32_t worker = 0; worker < workerCount; worker++) {
+            frame->workerPools[worker] = createCommandPool(
+                device, graphicsFamily, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+
+            VkCommandBufferAllocateInfo allocInfo = {
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+                .commandPool = frame->workerPools[worker],
+                .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+                .commandBufferCount = 1,
+            };
+
+            if (vkAllocateCommandBuffers(device, &allocInfo,
+                                         &frame->workerBuffers[worker]) !=
+                VK_SUCCESS) {
+                fprintf(stderr, "ERROR: failed to allocate command buffers.\n");
+                exit(1);
+            }
+        }
+
+        createSemaphores(device, &frame->imageAvailableSemaphore, 1);
+
+        frame->inFlightFence = VK_NULL_HANDLE;
+        frame->timelineValue = 0;
+
+        if (!timelineSync) {
+            createFence(device, &frame->inFlightFence, 1);
+        }
+
+        frame->queryPool =
+            timestamps ? createTimestampQueryPool(device) : VK_NULL_HANDLE;
+        frame->queryPending = false;
+        frame->transientCount = 0;
+    }
+}
+
+void deferBufferRelease(Allocator *allocator, Timeline *timeline,
+                        FrameContext *frame, VkBuffer buffer,
+                        Allocation allocation) {
+    if (frame->transientCount == MAX_FRAME_TRANSIENTS) {
+        // out of slots, fall back to waiting for the frame right away
+        if (timeline->enabled) {
+            waitTimeline(timeline, allocator->device, TIMELINE_GRAPHICS,
+                         frame->timelineValue);
+        } else {
+            vkWaitForFences(allocator->device, 1, &frame->inFlightFence,
+                            VK_TRUE, UINT64_MAX);
+        }
+
+        vkDestroyBuffer(allocator->device, buffer, NULL);
+        freeAllocation(allocator, &allocation);
+        return;
+    }
+
+    frame->transients[frame->transientCount++] = (TransientBuffer){
+        .buffer = buffer,
+        .allocation = allocation,
+    };
+}
+
+void releaseFrameTransients(Allocator *allocator, FrameContext *frame) {
+    for (uint32_t i = 0; i < frame->transientCount; i++) {
+        vkDestroyBuffer(allocator->device, frame->transients[i].buffer, NULL);
+        freeAllocation(allocator, &frame->transients[i].allocation);
+    }
+
+    frame->transientCount = 0;
+}
+
+void destroyFrameContexts(VkDevice device, Allocator *allocator,
+                          FrameContext *frames, uint32_t frameCount) {
+    for (uint32_t i = 0; i < frameCount; i++) {
+        FrameContext *frame = &frames[i];
+
+        releaseFrameTransients(allocator, frame);
+
+        if (frame->queryPool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(device, frame->queryPool, NULL);
+        }
+
+        vkDestroySemaphore(device, frame->imageAvailableSemaphore, NULL);
+        vkDestroyFence(device, frame->inFlightFence, NULL);
+        vkDestroyCommandPool(device, frame->commandPool, NULL);
+
+        for (uint32_t worker = 0; worker < frame->workerCount; worker++) {
+            vkDestroyCommandPool(device, frame->workerPools[worker], NULL);
+        }
+    }
+}
+
+// buffers the frames copy into, more than frames in flight so the writer can
+// fall a few frames behind before any are dropped; at most
+// FRAME_WRITER_QUEUE_SIZE, the writer may hold all of them
+#define READBACK_RING_SIZE 8
+
+// One buffer of the readback ring and the frame last copied into it
+typedef struct {
+    GpuBuffer buffer; // host visible, persistently mapped
+    bool pending;       // copied into by a frame that may still be running
+    uint32_t frameSlot; // of that frame
+    bool queued;        // handed to the writer, which reads it in place
+    uint64_t ticket;    // the writer is done with it once past this
+    uint32_t frameNumber;
+    double submitMs;
+} ReadbackSlot;
+
+/**
+ * Copies rendered frames out to disk without the render loop waiting on
+ * either the copy or the disk. Each frame copies its image into the next
+ * buffer of a ring; once the frame's fence or timeline value is waited on,
+ * the buffer goes to the writer thread as is. A frame that finds its buffer
+ * still held by the writer is dropped rather than waited for.
+ */
+typedef struct {
+    bool enabled;
+    FrameWriter writer;
+    VkExtent2D extent;
+    VkImageLayout layout; // of the target images once rendered
+    bool bgra;
+    ReadbackSlot slots[READBACK_RING_SIZE];
+    uint32_t nextSlot;
+    uint32_t frameNumber; // of the next frame, dropped ones included
+    uint32_t droppedFrames;
+} Readback;
+
+void createReadbackBuffers(Readback *readback, Allocator *allocator) {
+    VkDeviceSize size =
+        (VkDeviceSize)readback->extent.width * readback->extent.height * 4;
+
+    for (uint32_t i = 0; i < READBACK_RING_SIZE; i++) {
+        ReadbackSlot *slot = &readback->slots[i];
+
+        *slot = (ReadbackSlot){.pending = false, .queued = false};
+
+        slot->buffer.size = size;
+        createBuffer(allocator, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &slot->buffer.buffer, &slot->buffer.allocation);
+    }
+
+    readback->nextSlot = 0;
+}
+
+void destroyReadbackBuffers(Readback *readback, Allocator *allocator) {
+    for (uint32_t i = 0; i < READBACK_RING_SIZE; i++) {
+        destroyGpuBuffer(allocator, &readback->slots[i].buffer);
+    }
+}
+
+/**
+ * Starts the writer and allocates the ring for images of format and extent,
+ * which must be 8 bits per channel RGBA or BGRA. layout is the one the
+ * images are left in after rendering.
+ */
+void startReadback(Readback *readback, Allocator *allocator,
+                   const char *directory, FrameFormat fileFormat,
+                   VkFormat format, VkExtent2D extent, VkImageLayout layout) {
+    switch (format) {
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+        readback->bgra = false;
+        break;
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+        readback->bgra = true;
+        break;
+    default:
+        fprintf(stderr, "ERROR: --readback needs an 8-bit RGBA or BGRA "
+                        "target, got format %d.\n",
+                format);
+        exit(1);
+    }
+
+    readback->enabled = true;
+    readback->extent = extent;
+    readback->layout = layout;
+    readback->frameNumber = 0;
+    readback->droppedFrames = 0;
+
+    createReadbackBuffers(readback, allocator);
+    startFrameWriter(&readback->writer, directory, fileFormat);
+}
+
+// Hands the buffers frameSlot copied into to the writer, that frame must be
+// done. UINT32_MAX hands over every frame's, once the device is idle.
+void handOverReadbacks(Readback *readback, uint32_t frameSlot) {
+    double now = getTimeMs();
+
+    for (uint32_t i = 0; i < READBACK_RING_SIZE; i++) {
+        ReadbackSlot *slot = &readback->slots[i];
+
+        if (!slot->pending ||
+            (frameSlot != UINT32_MAX && slot->frameSlot != frameSlot)) {
+            continue;
+        }
+
+        FrameWrite write = {
+            .pixels = slot->buffer.allocation.mapped,
+            .width = readback->extent.width,
+            .height = readback->extent.height,
+            .bgra = readback->bgra,
+            .frameNumber = slot->frameNumber,
+            .submitMs = slot->submitMs,
+            .readyMs = now,
+        };
+
+        slot->ticket = queueFrameWrite(&readback->writer, &write);
+        slot->pending = false;
+        slot->queued = true;
+    }
+}
+
+// Returns the buffer the frame being recorded copies into, or NULL when the
+// writer still reads it and the frame is dropped.
+ReadbackSlot *nextReadbackSlot(Readback *readback) {
+    ReadbackSlot *slot = &readback->slots[readback->nextSlot];
+    uint32_t frameNumber = readback->frameNumber++;
+
+    if (slot->queued && slot->ticket >= getWrittenCount(&readback->writer)) {
+        readback->droppedFrames++;
+        return NULL;
+    }
+
+    readback->nextSlot = (readback->nextSlot + 1) % READBACK_RING_SIZE;
+
+    slot->queued = false;
+    slot->frameNumber = frameNumber;
+
+    return slot;
+}
+
+/**
+ * Reallocates the ring for a new target extent, the device must be idle.
+ * Waits for the writer to finish the frames it holds, which only happens on
+ * a resize that already stalls the loop.
+ */
+void resizeReadback(Readback *readback, Allocator *allocator,
+                    VkExtent2D extent) {
+    if (!readback->enabled || (extent.width == readback->extent.width &&
+                               extent.height == readback->extent.height)) {
+        return;
+    }
+
+    handOverReadbacks(readback, UINT32_MAX);
+    flushFrameWriter(&readback->writer);
+
+    destroyReadbackBuffers(readback, allocator);
+    readback->extent = extent;
+    createReadbackBuffers(readback, allocator);
+}
+
+// What a change invalidates in the pre-recorded command buffers
+typedef enum {
+    DIRTY_TARGET = 1 << 0,   // swapchain images, framebuffers or extent
+    DIRTY_PIPELINE = 1 << 1, // a pipeline was rebuilt
+    DIRTY_SCENE = 1 << 2,    // anything else a draw command refers to
+    DIRTY_ALL = DIRTY_TARGET | DIRTY_PIPELINE | DIRTY_SCENE,
+} DirtyFlags;
+
+// One command buffer per target image, recorded once and resubmitted every
+// time that image is drawn until something marks it dirty. Each gets its own
+// query pool, since the frame slot it is submitted from changes.
+typedef struct {
+    VkCommandPool commandPool;
+    uint32_t count;
+    VkCommandBuffer *commandBuffers;
+    VkQueryPool *queryPools; // NULL without timestamp support
+    bool *queryPending;
+} RecordedCommands;
+
+void destroyRecordedCommands(VkDevice device, RecordedCommands *recorded) {
+    if (recorded->count == 0) {
+        return;
+    }
+
+    if (recorded->queryPools) {
+        for (uint32_t i = 0; i < recorded->count; i++) {
+            vkDestroyQueryPool(device, recorded->queryPools[i], NULL);
+        }
+        free(recorded->queryPools);
+    }
+
+    // frees the command buffers with it
+    vkDestroyCommandPool(device, recorded->commandPool, NULL);
+
+    free(recorded->commandBuffers);
+    free(recorded->queryPending);
+
+    *recorded = (RecordedCommands){};
+}
+
+/**
+ * Rebuilds the graphics pipeline from its shader files whenever they change,
+ * on a thread of its own, while frames keep rendering with the current one.
+ * The new pipeline only replaces it at a frame boundary, and only if the
+ * rebuild succeeded.
+ */
+typedef struct {
+    bool enabled;
+    FileWatch watch;
+    bool changed;     // a file changed since the last rebuild started
+    double changedMs; // when that change was seen
+    // what the pipeline was created from at startup
+    VkDevice device;
+    VkPipelineCache pipelineCache;
+    VkPipelineLayout pipelineLayout;
+    VkRenderPass renderPass;
+    VkFormat colorFormat;
+    VkExtent2D extent;
+    const char *vertPath;
+    const char *fragPath;
+    PipelineKey key; // of the variant being rebuilt
+    // the rebuild in flight; its thread writes the results, under mutex
+    bool running;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    bool done;
+    VkPipeline pipeline; // VK_NULL_HANDLE when the rebuild failed
+    VkShaderModule vertShaderModule; // it was built from, for the variants
+    VkShaderModule fragShaderModule;
+    double buildMs;
+    // the variants replaced last, destroyed once no frame can still use them
+    VkPipeline retired[PIPELINE_VARIANT_SLOTS];
+    uint32_t retiredCount;
+    uint32_t retiredFrames; // frame boundaries left until then
+    uint32_t reloadCount;
+    uint32_t failedCount;
+} PipelineReload;
+
+typedef struct {
+    GLFWwindow *window; // NULL when headless
+    bool framebufferResized;
+    VkSurfaceKHR surface;
+    VkPhysicalDevice physicalDevice;
+    VkDevice device;
+    Allocator allocator;
+    VkQueue graphicsQueue;
+    VkQueue presentQueue;
+    RenderTarget target;
+    VkRenderPass renderPass; // VK_NULL_HANDLE with dynamic rendering
+    DynamicRendering dynamic;
+    VkPipelineLayout pipelineLayout;
+    PipelineKey pipelineKey; // of the graphics pipeline variant drawn with
+    PipelineVariants variants;
+    VkDescriptorSetLayout uniformSetLayout;
+    VkDescriptorPool descriptorPool;
+    VkDeviceSize uniformAlignment; // minUniformBufferOffsetAlignment
+    VkDeviceSize storageAlignment; // minStorageBufferOffsetAlignment
+    // indexed by frame slot; allocated for the deepest ring so changing the
+    // depth keeps them
+    UniformArena frameUniforms[MAX_FRAMES_IN_FLIGHT];
+    UniformArena replayUniforms; // written once per rebuild of recorded
+    GpuCuller culler;
+    Streamer streamer;
+    ParticleSim sim;
+    Timeline timeline; // disabled unless --timeline-sync
+    Readback readback; // disabled unless --readback
+    PipelineReload reload; // disabled unless --watch-shaders
+    GpuTimer gpuTimer;
+    uint32_t framesInFlight;
+    uint32_t currentFrame;
+    FrameContext frames[MAX_FRAMES_IN_FLIGHT];
+    Mesh mesh;
+    uint32_t drawCount;
+    uint32_t instanceCount;
+    uint32_t recordThreads; // 0 records inline on the main thread
+    ThreadPool recordPool;
+    bool replay; // submit recorded instead of recording every frame
+    uint32_t dirty; // DirtyFlags not yet applied to recorded
+    RecordedCommands recorded;
+    uint32_t resizeCount;
+    double resizeTotalMs;
+    double resizeMaxMs;
+    double launchMs; // when main started, 0 once the first frame is reported
+} Renderer;
+
+// Rebuilds the frame ring with a new depth, the device must be idle.
+void setFramesInFlight(Renderer *renderer, uint32_t framesInFlight) {
+    destroyFrameContexts(renderer->device, &renderer->allocator,
+                         renderer->frames, renderer->framesInFlight);
+
+    // the fences the images point at are gone with their frame slots
+    for (uint32_t i = 0; i < renderer->target.imageCount; i++) {
+        renderer->target.imagesInFlight[i] = VK_NULL_HANDLE;
+    }
+
+    renderer->framesInFlight = framesInFlight;
+    renderer->currentFrame = 0;
+
+    // the device is idle, so are the frames that acquired streamed chunks
+    releaseStreamSlots(&renderer->streamer, UINT32_MAX);
+
+    createFrameContexts(renderer->device, renderer->physicalDevice,
+                        renderer->frames, framesInFlight,
+                        renderer->recordThreads, renderer->gpuTimer.enabled,
+                        renderer->timeline.enabled);
+}
+
+// Restarts the recording workers, the device must be idle.
+void setRecordThreads(Renderer *renderer, uint32_t recordThreads) {
+    destroyThreadPool(&renderer->recordPool);
+
+    renderer->recordThreads = recordThreads;
+    createThreadPool(&renderer->recordPool, recordThreads);
+
+    // worker command pools are part of the frame slots
+    setFramesInFlight(renderer, renderer->framesInFlight);
+}
+
+// Shared by the workers recording one frame, one slice of draws each
+typedef struct {
+    VkDevice device;
+    FrameContext *frame;
+    const PassTarget *pass;
+    const DrawList *list;
+    uint32_t sliceCount;
+} SecondaryRecordJob;
+
+void recordSecondarySlice(void *context, uint32_t slice) {
+    SecondaryRecordJob *job = context;
+    VkCommandBuffer commandBuffer = job->frame->workerBuffers[slice];
+
+    uint32_t drawCount = job->list->drawCount;
+    uint32_t firstDraw = (uint64_t)drawCount * slice / job->sliceCount;
+    uint32_t endDraw = (uint64_t)drawCount * (slice + 1) / job->sliceCount;
+
+    // a cull pass' draws are one indirect draw, the first slice records it
+    if (job->list->culler) {
+        firstDraw = 0;
+        endDraw = slice == 0 ? drawCount : 0;
+    }
+
+    vkResetCommandPool(job->device, job->frame->workerPools[slice], 0);
+
+    const DynamicRendering *dynamic = job->pass->dynamic;
+
+    // without a render pass the secondaries continue the dynamic rendering
+    VkCommandBufferInheritanceRenderingInfo renderingInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+        .colorAttachmentCount = 1,
+        .pColorAttachmentFormats = dynamic ? &dynamic->format : NULL,
+        .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+    };
+
+    VkCommandBufferInheritanceInfo inheritanceInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+        .pNext = dynamic ? &renderingInfo : NULL,
+        .renderPass = job->pass->renderPass,
+        .subpass = 0,
+        .framebuffer = job->pass->framebuffer,
+    };
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                 VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+        .pInheritanceInfo = &inheritanceInfo,
+    };
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to begin recording command buffer.\n");
+        exit(1);
+    }
+
+    recordDraws(commandBuffer, job->list, firstDraw, endDraw - firstDraw);
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to record command buffer.\n");
+        exit(1);
+    }
+}
+
+// Records the draw list on the workers, one secondary command buffer per
+// worker, then the primary that executes them.
+void recordFrameThreaded(Renderer *renderer, FrameContext *frame,
+                         const PassTarget *pass, const DrawList *list) {
+    SecondaryRecordJob job = {
+        .device = renderer->device,
+        .frame = frame,
+        .pass = pass,
+        .list = list,
+        .sliceCount = frame->workerCount,
+    };
+
+    runThreadPoolTasks(&renderer->recordPool, recordSecondarySlice, &job,
+                       job.sliceCount);
+
+    recordCommandBuffer(frame->commandBuffer, pass, frame->queryPool, list,
+                        frame->workerBuffers, frame->workerCount);
+}
+
+PassTarget getPassTarget(const Renderer *renderer, uint32_t imageIndex) {
+    const RenderTarget *target = &renderer->target;
+
+    return (PassTarget){
+        .renderPass = renderer->renderPass,
+        .framebuffer = target->framebuffers[imageIndex],
+        .image = target->images[imageIndex],
+        .imageView = target->imageViews[imageIndex],
+        .dynamic = renderer->dynamic.enabled ? &renderer->dynamic : NULL,
+    };
+}
+
+/**
+ * Writes the camera, every object's uniforms and the instance array for one
+ * frame into arena and returns the draw list that reads them.
+ *
+ * The matrices are computed by cglm right into the mapped block: the arena
+ * was reset after the frame's fence, so nothing here maps memory or
+ * allocates. The block is likely write-combined, so nothing is read back.
+ */
+DrawList writeFrameUniforms(Renderer *renderer, UniformArena *arena,
+                            double timeMs) {
+    VkExtent2D extent = renderer->target.extent;
+    uint32_t drawCount = renderer->drawCount;
+    uint32_t instanceCount = renderer->instanceCount;
+    uint32_t objectStride =
+        alignUp(sizeof(ObjectUniforms), renderer->uniformAlignment);
+
+    resetLinearBlock(arena->block);
+
+    Allocation camera, objects, instances;
+    if (!linearAllocate(arena->block, sizeof(CameraUniforms),
+                        renderer->uniformAlignment, &camera) ||
+        !linearAllocate(arena->block, (VkDeviceSize)drawCount * objectStride,
+                        renderer->uniformAlignment, &objects) ||
+        !linearAllocate(arena->block,
+                        (VkDeviceSize)instanceCount * sizeof(InstanceData),
+                        renderer->storageAlignment, &instances)) {
+        fprintf(stderr, "ERROR: uniform arena is too small.\n");
+        exit(1);
+    }
+
+    // at this distance and field of view, y from -1 to 1 fills the height
+    vec3 eye = {0.0f, 0.0f, 2.0f};
+    vec3 center = {0.0f, 0.0f, 0.0f};
+    vec3 up = {0.0f, 1.0f, 0.0f};
+
+    mat4 view, proj;
+    glm_lookat(eye, center, up, view);
+    glm_perspective(2.0f * atanf(0.5f),
+                    (float)extent.width / (float)extent.height, 0.1f, 10.0f,
+                    proj);
+
+    CameraUniforms *cameraUniforms = camera.mapped;
+    glm_mat4_mul(proj, view, cameraUniforms->viewProj);
+
+    // objects sit on a square grid, each scaled down to its cell
+    uint32_t columns = (uint32_t)ceil(sqrt((double)drawCount));
+    float cellSize = 2.0f / columns;
+    float angle = (float)(timeMs / 1000.0) * 0.5f;
+    vec3 zAxis = {0.0f, 0.0f, 1.0f};
+
+    mat4 rotation;
+    glm_rotate_make(rotation, angle, zAxis);
+
+    for (uint32_t i = 0; i < drawCount; i++) {
+        vec3 position = {
+            -1.0f + (i % columns + 0.5f) * cellSize,
+            -1.0f + (i / columns + 0.5f) * cellSize,
+            0.0f,
+        };
+
+        mat4 placement;
+        glm_translate_make(placement, position);
+        glm_scale_uni(placement, 1.0f / columns);
+
+        ObjectUniforms *object =
+            (ObjectUniforms *)((char *)objects.mapped + i * objectStride);
+        glm_mat4_mul(placement, rotation, object->model);
+    }
+
+    // instances tile their object the same way, tinted by position; a lone
+    // instance keeps the mesh colors
+    uint32_t instanceColumns = (uint32_t)ceil(sqrt((double)instanceCount));
+    InstanceData *instanceData = instances.mapped;
+
+    for (uint32_t i = 0; i < instanceCount; i++) {
+        float u = (i % instanceColumns + 0.5f) / instanceColumns;
+        float v = (i / instanceColumns + 0.5f) / instanceColumns;
+        vec3 position = {-1.0f + 2.0f * u, -1.0f + 2.0f * v, 0.0f};
+        vec4 color = {1.0f, 1.0f, 1.0f, 1.0f};
+
+        if (instanceCount > 1) {
+            color[0] = 0.5f + 0.5f * u;
+            color[1] = 0.5f + 0.5f * v;
+            color[2] = 1.0f - 0.5f * u;
+        }
+
+        mat4 model;
+        glm_translate_make(model, position);
+        glm_scale_uni(model, 1.0f / instanceColumns);
+
+        glm_mat4_copy(model, instanceData[i].model);
+        glm_vec4_copy(color, instanceData[i].color);
+    }
+
+    DrawList list = {
+        // a hash lookup per recording, compiling the variant if it is new
+        .pipeline = getPipelineVariant(&renderer->variants,
+                                       &renderer->pipelineKey),
+        .pipelineLayout = renderer->pipelineLayout,
+        .extent = extent,
+        .mesh = &renderer->mesh,
+        .drawCount = drawCount,
+        .instanceCount = instanceCount,
+        .uniformSet = arena->descriptorSet,
+        .cameraOffset = camera.offset,
+        .objectOffset = objects.offset,
+        .objectStride = objectStride,
+        .instanceOffset = instances.offset,
+    };
+
+    return list;
+}
+
+// The instance sweep draws up to sweepInstances objects either way
+uint32_t getMaxDraws(const Options *options) {
+    return options->drawCount > options->sweepInstances
+               ? options->drawCount
+               : options->sweepInstances;
+}
+
+// Enough for the camera, every object at its own aligned offset and the
+// instance array, for up to maxDraws draws of maxInstances instances
+VkDeviceSize getUniformArenaSize(VkDeviceSize uniformAlignment,
+                                 VkDeviceSize storageAlignment,
+                                 uint32_t maxDraws, uint32_t maxInstances) {
+    return alignUp(sizeof(CameraUniforms), uniformAlignment) +
+           (VkDeviceSize)maxDraws *
+               alignUp(sizeof(ObjectUniforms), uniformAlignment) +
+           storageAlignment + (VkDeviceSize)maxInstances * sizeof(InstanceData);
+}
+
+void markDirty(Renderer *renderer, uint32_t flags) {
+    renderer->dirty |= flags;
+}
+
+void setReplay(Renderer *renderer, bool replay) {
+    renderer->replay = replay;
+    markDirty(renderer, DIRTY_ALL);
+}
+
+// Draws with the variant for key from now on, the next recording looks it up
+void setPipelineVariant(Renderer *renderer, const PipelineKey *key) {
+    renderer->pipelineKey = *key;
+    markDirty(renderer, DIRTY_PIPELINE);
+}
+
+void *pipelineReloadThread(void *arg) {
+    PipelineReload *reload = arg;
+    VkDevice device = reload->device;
+
+    double start = getTimeMs();
+
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkShaderModule vertShaderModule =
+        loadShaderModule(device, reload->vertPath);
+    VkShaderModule fragShaderModule =
+        loadShaderModule(device, reload->fragPath);
+
+    if (vertShaderModule != VK_NULL_HANDLE &&
+        fragShaderModule != VK_NULL_HANDLE &&
+        buildGraphicsPipeline(device, reload->pipelineCache,
+                              reload->pipelineLayout, reload->renderPass,
+                              reload->colorFormat, reload->extent,
+                              vertShaderModule, fragShaderModule,
+                              &reload->key, VK_NULL_HANDLE,
+                              &pipeline) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to rebuild graphics pipeline.\n");
+        pipeline = VK_NULL_HANDLE;
+    }
+
+    // on success the other variants are rebuilt from them later
+    if (pipeline == VK_NULL_HANDLE) {
+        vkDestroyShaderModule(device, vertShaderModule, NULL);
+        vkDestroyShaderModule(device, fragShaderModule, NULL);
+        vertShaderModule = VK_NULL_HANDLE;
+        fragShaderModule = VK_NULL_HANDLE;
+    }
+
+    pthread_mutex_lock(&reload->mutex);
+    reload->pipeline = pipeline;
+    reload->vertShaderModule = vertShaderModule;
+    reload->fragShaderModule = fragShaderModule;
+    reload->buildMs = getTimeMs() - start;
+    reload->done = true;
+    pthread_mutex_unlock(&reload->mutex);
+
+    return NULL;
+}
+
+// Watches the shader files the graphics pipeline was created from
+void startPipelineReload(Renderer *renderer, VkPipelineCache pipelineCache,
+                         const char *vertPath, const char *fragPath) {
+    PipelineReload *reload = &renderer->reload;
+
+    *reload = (PipelineReload){
+        .changed = false,
+        .device = renderer->device,
+        .pipelineCache = pipelineCache,
+        .pipelineLayout = renderer->pipelineLayout,
+        .renderPass = renderer->renderPass,
+        .colorFormat = renderer->target.format,
+        .vertPath = vertPath,
+        .fragPath = fragPath,
+        .running = false,
+        .retiredCount = 0,
+        .reloadCount = 0,
+        .failedCount = 0,
+    };
+
+    const char *files[] = {vertPath, fragPath};
+
+    if (!startFileWatch(&reload->watch, ".", files, 2)) {
+        fprintf(stdout, "inotify is not available, shaders will not be "
+                        "reloaded\n");
+        return;
+    }
+
+    pthread_mutex_init(&reload->mutex, NULL);
+    reload->enabled = true;
+}
+
+/**
+ * Moves the shader reload along, at a frame boundary. Never waits: a rebuild
+ * of the current variant starts on its own thread when a watched file
+ * changes, and the first boundary after it is done swaps it in, dropping
+ * every other variant. The frames already submitted keep the old pipelines,
+ * which are destroyed once every frame slot has been waited on again.
+ */
+void updatePipelineReload(Renderer *renderer) {
+    PipelineReload *reload = &renderer->reload;
+
+    if (!reload->enabled) {
+        return;
+    }
+
+    if (reload->retiredCount > 0 && reload->retiredFrames-- == 0) {
+        for (uint32_t i = 0; i < reload->retiredCount; i++) {
+            vkDestroyPipeline(renderer->device, reload->retired[i], NULL);
+        }
+
+        reload->retiredCount = 0;
+    }
+
+    if (reload->running) {
+        pthread_mutex_lock(&reload->mutex);
+        bool done = reload->done;
+        pthread_mutex_unlock(&reload->mutex);
+
+        if (done) {
+            // the thread has already returned, this does not block
+            pthread_join(reload->thread, NULL);
+            reload->running = false;
+
+            if (reload->pipeline == VK_NULL_HANDLE) {
+                reload->failedCount++;
+                fprintf(stdout, "shader reload failed, keeping the current "
+                                "pipeline\n");
+            } else {
+                // the renderer may have moved to another variant meanwhile,
+                // which is then rebuilt on its next lookup
+                reload->retiredCount = reloadPipelineVariants(
+                    &renderer->variants, &reload->key, reload->pipeline,
+                    reload->buildMs, reload->vertShaderModule,
+                    reload->fragShaderModule, reload->retired);
+                markDirty(renderer, DIRTY_PIPELINE);
+
+                reload->retiredFrames = renderer->framesInFlight;
+                reload->pipeline = VK_NULL_HANDLE;
+                reload->vertShaderModule = VK_NULL_HANDLE;
+                reload->fragShaderModule = VK_NULL_HANDLE;
+                reload->reloadCount++;
+
+                fprintf(stdout,
+                        "shaders reloaded in %.3f ms, pipeline built in "
+                        "%.3f ms\n",
+                        getTimeMs() - reload->changedMs, reload->buildMs);
+            }
+        }
+    }
+
+    if (pollFileWatch(&reload->watch) && !reload->changed) {
+        reload->changed = true;
+        reload->changedMs = getTimeMs();
+    }
+
+    // one rebuild and one set of retired pipelines at a time, changes
+    // meanwhile wait
+    if (!reload->changed || reload->running || reload->retiredCount > 0) {
+        return;
+    }
+
+    reload->changed = false;
+    reload->done = false;
+    reload->pipeline = VK_NULL_HANDLE;
+    reload->extent = renderer->target.extent;
+    reload->key = renderer->pipelineKey;
+
+    if (pthread_create(&reload->thread, NULL, pipelineReloadThread, reload) !=
+        0) {
+        fprintf(stderr, "ERROR: failed to create pipeline reload thread.\n");
+        exit(1);
+    }
+
+    reload->running = true;
+}
+
+// Waits for a rebuild still running, the device must be idle
+void stopPipelineReload(Renderer *renderer) {
+    PipelineReload *reload = &renderer->reload;
+
+    if (!reload->enabled) {
+        return;
+    }
+
+    if (reload->running) {
+        pthread_join(reload->thread, NULL);
+        reload->running = false;
+        vkDestroyPipeline(renderer->device, reload->pipeline, NULL);
+        vkDestroyShaderModule(renderer->device, reload->vertShaderModule,
+                              NULL);
+        vkDestroyShaderModule(renderer->device, reload->fragShaderModule,
+                              NULL);
+    }
+
+    for (uint32_t i = 0; i < reload->retiredCount; i++) {
+        vkDestroyPipeline(renderer->device, reload->retired[i], NULL);
+    }
+
+    reload->retiredCount = 0;
+
+    stopFileWatch(&reload->watch);
+    pthread_mutex_destroy(&reload->mutex);
+    reload->enabled = false;
+}
+
+// Both counts must fit the arenas, which are sized for the largest scene
+void setSceneSize(Renderer *renderer, uint32_t drawCount,
+                  uint32_t instanceCount) {
+    renderer->drawCount = drawCount;
+    renderer->instanceCount = instanceCount;
+    markDirty(renderer, DIRTY_SCENE);
+}
+
+/**
+ * Re-records one command buffer per target image.
+ *
+ * Waits for the device to go idle, as any of the old command buffers may
+ * still be pending. Dirty state is rare (resizes, pipeline swaps, scene edits)
+ * so nothing finer grained is worth it.
+ */
+void rebuildRecordedCommands(Renderer *renderer) {
+    VkDevice device = renderer->device;
+    RenderTarget *target = &renderer->target;
+    RecordedCommands *recorded = &renderer->recorded;
+
+    vkDeviceWaitIdle(device);
+
+    if (recorded->count != target->imageCount) {
+        destroyRecordedCommands(device, recorded);
+
+        recorded->count = target->imageCount;
+        recorded->commandPool = createCommandPool(
+            device, getGraphicsFamily(renderer->physicalDevice), 0);
+        recorded->commandBuffers =
+            calloc(recorded->count, sizeof(VkCommandBuffer));
+        recorded->queryPending = calloc(recorded->count, sizeof(bool));
+
+        if (!recorded->commandBuffers || !recorded->queryPending) {
+            fprintf(stderr, "ERROR: failed to allocate recorded commands.\n");
+            exit(1);
+        }
+
+        createCommandBuffers(device, recorded->commandPool,
+                             recorded->commandBuffers, recorded->count);
+
+        if (renderer->gpuTimer.enabled) {
+            recorded->queryPools = calloc(recorded->count, sizeof(VkQueryPool));
+
+            if (!recorded->queryPools) {
+                fprintf(stderr,
+                        "ERROR: failed to allocate recorded commands.\n");
+                exit(1);
+            }
+
+            for (uint32_t i = 0; i < recorded->count; i++) {
+                recorded->queryPools[i] = createTimestampQueryPool(device);
+            }
+        }
+    } else {
+        vkResetCommandPool(device, recorded->commandPool, 0);
+    }
+
+    // replayed frames all read this snapshot, the scene stops animating
+    DrawList list = writeFrameUniforms(renderer, &renderer->replayUniforms,
+                                       getTimeMs());
+
+    for (uint32_t i = 0; i < recorded->count; i++) {
+        PassTarget pass = getPassTarget(renderer, i);
+
+        recordCommandBuffer(
+            recorded->commandBuffers[i], &pass,
+            recorded->queryPools ? recorded->queryPools[i] : VK_NULL_HANDLE,
+            &list, NULL, 0);
+        recorded->queryPending[i] = false;
+    }
+
+    renderer->dirty = 0;
+}
+
+typedef enum {
+    FRAME_OK,
+    FRAME_SKIPPED, // swapchain went out of date before anything was recorded
+    FRAME_STALE,   // frame was submitted, but the swapchain must be rebuilt
+} FrameStatus;
+
+// inputMs is when the input this frame responds to was polled
+FrameStatus draw(Renderer *renderer, double inputMs, FrameTiming *timing) {
+    VkDevice device = renderer->device;
+    RenderTarget *target = &renderer->target;
+    FrameContext *frame = &renderer->frames[renderer->currentFrame];
+
+    double phaseStart = getTimeMs();
+
+    if (renderer->timeline.enabled) {
+        waitTimeline(&renderer->timeline, device, TIMELINE_GRAPHICS,
+                     frame->timelineValue);
+    } else {
+        vkWaitForFences(device, 1, &frame->inFlightFence, VK_TRUE,
+                        UINT64_MAX);
+    }
+
+    // the slot's previous submission has finished, so neither of these stalls
+    readGpuTimestamps(device, &renderer->gpuTimer, frame->queryPool,
+                      &frame->queryPending);
+    releaseFrameTransients(&renderer->allocator, frame);
+    readCullCounts(&renderer->culler,
+                   &renderer->culler.frames[renderer->currentFrame]);
+    releaseStreamSlots(&renderer->streamer, renderer->currentFrame);
+    handOverReadbacks(&renderer->readback, renderer->currentFrame);
+
+    timing->phases[PHASE_GPU_CULL_PASS] =
+        renderer->gpuTimer.lastMs[GPU_PASS_CULL];
+    timing->phases[PHASE_GPU_RENDER_PASS] =
+        renderer->gpuTimer.lastMs[GPU_PASS_RENDER];
+    timing->phases[PHASE_GPU_SIMULATE] =
+        renderer->sim.async ? renderer->sim.lastMs
+                            : renderer->gpuTimer.lastMs[GPU_PASS_SIMULATE];
+    timing->phases[PHASE_GPU_GRAPHICS_BUSY] = renderer->gpuTimer.lastBusyMs;
+
+    double now = getTimeMs();
+    timing->phases[PHASE_FENCE_WAIT] = now - phaseStart;
+    phaseStart = now;
+
+    bool presenting = target->swapchain != VK_NULL_HANDLE;
+
+    FrameStatus status = FRAME_OK;
+
+    uint32_t imageIndex;
+    if (presenting) {
+        VkResult result = vkAcquireNextImageKHR(
+            device, target->swapchain, UINT64_MAX,
+            frame->imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
+
+        // leave the fence signaled, nothing will be submitted to reset it
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            return FRAME_SKIPPED;
+        } else if (result == VK_SUBOPTIMAL_KHR) {
+            status = FRAME_STALE;
+        } else if (result != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: failed to acquire swapchain image.\n");
+            exit(1);
+        }
+    } else {
+        imageIndex = renderer->currentFrame % target->imageCount;
+    }
+
+    now = getTimeMs();
+    timing->phases[PHASE_ACQUIRE] = now - phaseStart;
+    phaseStart = now;
+
+    // with more images than frame slots, or when acquire returns them out of
+    // order, the image can still be in use by another slot's submission
+    if (renderer->timeline.enabled) {
+        waitTimeline(&renderer->timeline, device, TIMELINE_GRAPHICS,
+                     target->imageTimelineValues[imageIndex]);
+    } else {
+        VkFence imageFence = target->imagesInFlight[imageIndex];
+        if (imageFence != VK_NULL_HANDLE &&
+            imageFence != frame->inFlightFence) {
+            vkWaitForFences(device, 1, &imageFence, VK_TRUE, UINT64_MAX);
+        }
+        target->imagesInFlight[imageIndex] = frame->inFlightFence;
+
+        vkResetFences(device, 1, &frame->inFlightFence);
+    }
+
+    now = getTimeMs();
+    timing->phases[PHASE_FENCE_WAIT] += now - phaseStart;
+    phaseStart = now;
+
+    VkCommandBuffer commandBuffer = frame->commandBuffer;
+    bool *queryPending = &frame->queryPending;
+    bool timestamps = frame->queryPool != VK_NULL_HANDLE;
+
+    VkBufferMemoryBarrier streamAcquires[STREAM_SLOT_COUNT];
+    uint32_t streamAcquireCount = 0;
+    VkSemaphore streamSemaphores[STREAM_SLOT_COUNT];
+    uint64_t streamValues[STREAM_SLOT_COUNT];
+    uint32_t streamWaitCount = 0;
+
+    if (renderer->streamer.commandPool != VK_NULL_HANDLE) {
+        streamWaitCount = pumpStreamer(
+            &renderer->streamer, device, renderer->currentFrame,
+            streamAcquires, &streamAcquireCount, streamSemaphores,
+            streamValues);
+    }
+
+    // nothing in the frame reads the particles, the step runs alongside it
+    if (renderer->sim.enabled && renderer->sim.async) {
+        submitSimulation(device, &renderer->sim, renderer->currentFrame);
+    }
+
+    ReadbackCopy readbackCopy;
+    ReadbackSlot *readbackSlot = NULL;
+
+    if (renderer->replay) {
+        if (renderer->dirty) {
+            rebuildRecordedCommands(renderer);
+        }
+
+        RecordedCommands *recorded = &renderer->recorded;
+
+        // the image fence was waited on above, so its last submit is done
+        commandBuffer = recorded->commandBuffers[imageIndex];
+        queryPending = &recorded->queryPending[imageIndex];
+        timestamps = recorded->queryPools != NULL;
+
+        if (timestamps) {
+            readGpuTimestamps(device, &renderer->gpuTimer,
+                              recorded->queryPools[imageIndex], queryPending);
+        }
+    } else {
+        DrawList list = writeFrameUniforms(
+            renderer, &renderer->frameUniforms[renderer->currentFrame],
+            phaseStart);
+
+        list.acquires = streamAcquires;
+        list.acquireCount = streamAcquireCount;
+
+        if (renderer->sim.enabled && !renderer->sim.async) {
+            list.simulation = &renderer->sim;
+        }
+
+        if (renderer->readback.enabled) {
+            readbackSlot = nextReadbackSlot(&renderer->readback);
+        }
+
+        if (readbackSlot) {
+            readbackCopy = (ReadbackCopy){
+                .image = target->images[imageIndex],
+                .layout = renderer->readback.layout,
+                .extent = renderer->readback.extent,
+                .buffer = readbackSlot->buffer.buffer,
+            };
+
+            list.readback = &readbackCopy;
+        }
+
+        if (renderer->culler.enabled) {
+            CullBuffers *cull =
+                &renderer->culler.frames[renderer->currentFrame];
+
+            cull->drawCount = list.drawCount;
+            cull->instanceCount = list.instanceCount;
+            cull->pending = true;
+
+            list.culler = &renderer->culler;
+            list.cullBuffers = cull;
+        }
+
+        vkResetCommandPool(device, frame->commandPool, 0);
+
+        PassTarget pass = getPassTarget(renderer, imageIndex);
+
+        if (frame->workerCount > 0) {
+            recordFrameThreaded(renderer, frame, &pass, &list);
+        } else {
+            recordCommandBuffer(commandBuffer, &pass, frame->queryPool, &list,
+                                NULL, 0);
+        }
+    }
+
+    now = getTimeMs();
+    timing->phases[PHASE_RECORD] = now - phaseStart;
+    phaseStart = now;
+
+    // values of the timeline waits, ignored for the binary semaphores
+    VkSemaphore waitSemaphores[1 + STREAM_SLOT_COUNT];
+    VkPipelineStageFlags waitStages[1 + STREAM_SLOT_COUNT];
+    uint64_t waitValues[1 + STREAM_SLOT_COUNT];
+    uint32_t waitCount = 0;
+
+    if (presenting) {
+        waitSemaphores[waitCount] = frame->imageAvailableSemaphore;
+        waitValues[waitCount] = 0;
+        waitStages[waitCount++] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    }
+
+    // where the acquires take over, the copies are already done anyway
+    for (uint32_t i = 0; i < streamWaitCount; i++) {
+        waitSemaphores[waitCount] = streamSemaphores[i];
+        waitValues[waitCount] = streamValues[i];
+        waitStages[waitCount++] = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT;
+    }
+
+    // the present semaphore stays first, the present waits on it alone
+    VkSemaphore signalSemaphores[2];
+    uint64_t signalValues[2];
+    uint32_t signalCount = 0;
+
+    if (presenting) {
+        signalSemaphores[signalCount] = target->presentSemaphores[imageIndex];
+        signalValues[signalCount++] = 0;
+    }
+
+    if (renderer->timeline.enabled) {
+        frame->timelineValue = nextTimelineValue(&renderer->timeline);
+        target->imageTimelineValues[imageIndex] = frame->timelineValue;
+
+        signalSemaphores[signalCount] =
+            renderer->timeline.semaphores[TIMELINE_GRAPHICS];
+        signalValues[signalCount++] = frame->timelineValue;
+    }
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .waitSemaphoreValueCount = waitCount,
+        .pWaitSemaphoreValues = waitValues,
+        .signalSemaphoreValueCount = signalCount,
+        .pSignalSemaphoreValues = signalValues,
+    };
+
+    VkSubmitInfo submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = renderer->timeline.enabled ? &timelineInfo : NULL,
+        .waitSemaphoreCount = waitCount,
+        .pWaitSemaphores = waitSemaphores,
+        .pWaitDstStageMask = waitStages,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &commandBuffer,
+        .signalSemaphoreCount = signalCount,
+        .pSignalSemaphores = signalSemaphores,
+    };
+
+    if (vkQueueSubmit(renderer->graphicsQueue, 1, &submitInfo,
+                      frame->inFlightFence) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to submit draw command buffer.\n");
+        exit(1);
+    };
+
+    *queryPending = timestamps;
+
+    now = getTimeMs();
+    timing->phases[PHASE_SUBMIT] = now - phaseStart;
+
+    if (readbackSlot) {
+        readbackSlot->pending = true;
+        readbackSlot->frameSlot = renderer->currentFrame;
+        readbackSlot->submitMs = now;
+    }
+    phaseStart = now;
+
+    if (!presenting) {
+        // offscreen frames are done once submitted
+        timing->phases[PHASE_PRESENT] = 0.0;
+        timing->phases[PHASE_INPUT_TO_PRESENT] = now - inputMs;
+        return status;
+    }
+
+    VkSwapchainKHR swapchains[] = {target->swapchain};
+
+    VkPresentInfoKHR presentInfo = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores = signalSemaphores,
+        .swapchainCount = 1,
+        .pSwapchains = swapchains,
+        .pImageIndices = &imageIndex,
+        .pResults = NULL,
+    };
+
+    VkResult result = vkQueuePresentKHR(renderer->presentQueue, &presentInfo);
+
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+        status = FRAME_STALE;
+    } else if (result != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: failed to present swapchain image.\n");
+        exit(1);
+    }
+
+    now = getTimeMs();
+    timing->phases[PHASE_PRESENT] = now - phaseStart;
+    timing->phases[PHASE_INPUT_TO_PRESENT] = now - inputMs;
+
+    return status;
+}
+
+/**
+ * Renders warmupCount unmeasured frames, then frameCount measured ones (0 to
+ * keep going until the window is closed), recording each measured frame into
+ * run unless it is NULL.
+ *
+ * Returns the number of measured frames and their wall time in elapsedMs.
+ */
+uint32_t runFrames(Renderer *renderer, uint32_t warmupCount,
+                   uint32_t frameCount, BenchRun *run, double *elapsedMs) {
+    uint32_t totalFrames = frameCount == 0 ? 0 : warmupCount + frameCount;
+    uint32_t framesDrawn = 0;
+
+    double startTime = getTimeMs();
+
+    while (totalFrames == 0 || framesDrawn < totalFrames) {
+        double frameStart = getTimeMs();
+
+        if (framesDrawn == warmupCount) {
+            startTime = frameStart;
+        }
+
+        if (renderer->window) {
+            glfwPollEvents();
+
+            if (glfwWindowShouldClose(renderer->window)) {
+                break;
+            }
+        }
+
+        // input is sampled here, everything until the present is latency
+        double inputTime = getTimeMs();
+
+        updatePipelineReload(renderer);
+
+        FrameTiming timing = {};
+        FrameStatus status = draw(renderer, inputTime, &timing);
+
+        if (status != FRAME_OK || renderer->framebufferResized) {
+            renderer->framebufferResized = false;
+
+            double resizeMs = recreateSwapchain(
+                renderer->device, renderer->physicalDevice, renderer->surface,
+                renderer->window, &renderer->target, renderer->renderPass);
+
+            fprintf(stdout, "swapchain recreated at %dx%d in %.3f ms\n",
+                    renderer->target.extent.width,
+                    renderer->target.extent.height, resizeMs);
+
+            markDirty(renderer, DIRTY_TARGET);
+            resizeReadback(&renderer->readback, &renderer->allocator,
+                           renderer->target.extent);
+
+            renderer->resizeCount++;
+            renderer->resizeTotalMs += resizeMs;
+            if (resizeMs > renderer->resizeMaxMs) {
+                renderer->resizeMaxMs = resizeMs;
+            }
+        }
+
+        if (status == FRAME_SKIPPED) {
+            continue;
+        }
+
+        renderer->currentFrame =
+            (renderer->currentFrame + 1) % renderer->framesInFlight;
+        framesDrawn++;
+
+        if (renderer->launchMs > 0.0) {
+            fprintf(stdout, "first frame submitted %.3f ms after launch\n",
+                    getTimeMs() - renderer->launchMs);
+            renderer->launchMs = 0.0;
+        }
+
+        timing.phases[PHASE_FRAME] = getTimeMs() - frameStart;
+
+        if (run && framesDrawn > warmupCount) {
+            recordBenchFrame(run, &timing);
+        }
+    }
+
+    vkDeviceWaitIdle(renderer->device);
+
+    // whatever the last frames copied out, their fences won't be waited on
+    handOverReadbacks(&renderer->readback, UINT32_MAX);
+
+    *elapsedMs = getTimeMs() - startTime;
+
+    return framesDrawn > warmupCount ? framesDrawn - warmupCount : 0;
+}
+
+#define MAX_BENCH_RUNS 64
+
+// Benchmarks the renderer as it is currently configured, appending to runs.
+void runBenchmark(Renderer *renderer, BenchRun *runs, uint32_t *runCount,
+                  uint32_t warmupCount, uint32_t frameCount) {
+    if (*runCount == MAX_BENCH_RUNS ||
+        (renderer->window && glfwWindowShouldClose(renderer->window))) {
+        return;
+    }
+
+    char label[BENCH_LABEL_SIZE];
+    snprintf(label, sizeof(label),
+             "frames_in_flight=%d record=%s threads=%d draws=%d instances=%d "
+             "stream=%s compute=%s blend=%s",
+             renderer->framesInFlight,
+             renderer->replay ? "replay" : "per_frame",
+             renderer->replay ? 0 : renderer->recordThreads,
+             renderer->drawCount, renderer->instanceCount,
+             renderer->streamer.enabled ? "on" : "off",
+             !renderer->sim.enabled ? "off"
+             : renderer->sim.async  ? "async"
+                                    : "graphics",
+             blendModeNames[renderer->pipelineKey.blend]);
+
+    BenchRun *run = &runs[(*runCount)++];
+    *run = createBenchRun(label, warmupCount, frameCount);
+
+    uint64_t uploadedBefore = renderer->streamer.uploadedBytes;
+
+    runFrames(renderer, warmupCount, frameCount, run, &run->elapsedMs);
+    printBenchRun(run);
+
+    if (renderer->streamer.enabled) {
+        double uploadedMib =
+            (renderer->streamer.uploadedBytes - uploadedBefore) /
+            (1024.0 * 1024.0);
+
+        fprintf(stdout, "streamed %.1f MiB (%.1f MiB/s) on the %s queue\n\n",
+                uploadedMib, uploadedMib / (run->elapsedMs / 1000.0),
+                renderer->streamer.dedicated ? "transfer" : "graphics");
+    }
+}
+
+// How much worse frame times got from base to loaded, in percent
+void printFrameTimeChange(const char *what, const BenchRun *base,
+                          const BenchRun *loaded) {
+    BenchStats baseStats = computeBenchStats(base, PHASE_FRAME);
+    BenchStats loadedStats = computeBenchStats(loaded, PHASE_FRAME);
+
+    if (baseStats.mean <= 0.0 || baseStats.p99 <= 0.0) {
+        return;
+    }
+
+    fprintf(stdout, "%s: frame time mean %+.1f%%, p99 %+.1f%%\n\n", what,
+            (loadedStats.mean / baseStats.mean - 1.0) * 100.0,
+            (loadedStats.p99 / baseStats.p99 - 1.0) * 100.0);
+}
+
+// What the startup phases build and share. Each field is written by one
+// phase and read only by the phases that depend on it.
+typedef struct {
+    const Options *options;
+    Renderer *renderer;
+    int framebufferWidth; // queried up front, on the main thread
+    int framebufferHeight;
+    VkInstance instance;
+    uint32_t instanceVersion;
+    VkDebugUtilsMessengerEXT debugMessenger;
+    VkSurfaceFormatKHR surfaceFormat;
+    VkImageLayout finalLayout;
+    VkShaderModule vertShaderModule;
+    VkShaderModule fragShaderModule;
+    const char *pipelineCachePath; // NULL with --no-pipeline-cache
+    VkPipelineCache pipelineCache;
+    bool warmPipelineCache;
+    VkCommandPool uploadCommandPool; // for one-off submissions
+    Vertex *vertices;
+    uint32_t vertexCount;
+    uint32_t *indices;
+    uint32_t indexCount;
+    vec4 meshBounds; // see computeMeshBounds
+    double uploadMs;
+} Startup;
+
+void startInstance(void *context) {
+    Startup *startup = context;
+
+    startup->instance =
+        createInstance(startup->options->headless,
+                       startup->options->timelineSync,
+                       &startup->instanceVersion);
+
+    if (enableValidationLayers) {
+        startup->debugMessenger = setupDebugMessenger(startup->instance);
+    }
+}
+
+void startSurface(void *context) {
+    Startup *startup = context;
+
+    startup->renderer->surface =
+        createSurface(startup->instance, startup->renderer->window);
+}
+
+// Also settles what the render target will look like, the phases after this
+// one only create it
+void startDevice(void *context) {
+    Startup *startup = context;
+    const Options *options = startup->options;
+    Renderer *renderer = startup->renderer;
+    RenderTarget *target = &renderer->target;
+    VkSurfaceKHR surface = renderer->surface;
+
+    DeviceRequirements requirements = {
+        .indirectDraws = options->gpuCull,
+        .timelineSemaphores = options->timelineSync,
+    };
+
+    VkPhysicalDevice physicalDevice =
+        pickPhysicalDevice(startup->instance, startup->instanceVersion,
+                           surface, &requirements, options->device);
+
+    renderer->dynamic.enabled =
+        !options->renderPass &&
+        supportsDynamicRendering(physicalDevice, startup->instanceVersion);
+
+    if (options->gpuCull) {
+        renderer->culler.indirectCount =
+            getIndirectCountSupport(physicalDevice, startup->instanceVersion);
+    }
+
+    VkDevice device = createLogicalDevice(
+        physicalDevice, surface, options->gpuCull,
+        renderer->culler.indirectCount, options->timelineSync,
+        renderer->dynamic.enabled);
+
+    renderer->physicalDevice = physicalDevice;
+    renderer->device = device;
+    createAllocator(&renderer->allocator, device, physicalDevice);
+    renderer->graphicsQueue = getGraphicsQueue(device, physicalDevice);
+    renderer->presentQueue = VK_NULL_HANDLE;
+
+    if (options->timelineSync) {
+        createTimeline(&renderer->timeline, device, options->slowFrameMs);
+    }
+
+    if (surface == VK_NULL_HANDLE) {
+        target->format = OFFSCREEN_FORMAT;
+        target->extent = (VkExtent2D){WIDTH, HEIGHT};
+        startup->finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        return;
+    }
+
+    renderer->presentQueue =
+        getPresentationQueue(device, physicalDevice, surface);
+
+    startup->surfaceFormat = chooseSurfaceFormat(physicalDevice, surface);
+
+    target->format = startup->surfaceFormat.format;
+    target->colorSpace = startup->surfaceFormat.colorSpace;
+    target->presentMode =
+        choosePresentMode(physicalDevice, surface, options->presentPolicy);
+    target->requestedImageCount = options->swapchainImages;
+    target->extent =
+        chooseExtent(physicalDevice, surface, startup->framebufferWidth,
+                     startup->framebufferHeight);
+    startup->finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    // readback copies straight out of the swapchain images
+    target->usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    if (options->readbackDir) {
+        target->usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    }
+}
+
+void startSwapchain(void *context) {
+    Startup *startup = context;
+    Renderer *renderer = startup->renderer;
+    RenderTarget *target = &renderer->target;
+
+    if (renderer->surface == VK_NULL_HANDLE) {
+        // one image per frame slot, nothing else holds on to them
+        createOffscreenImages(renderer->device, &renderer->allocator, target,
+                              MAX_FRAMES_IN_FLIGHT);
+        return;
+    }
+
+    target->swapchain = createSwapchain(
+        renderer->device, renderer->physicalDevice, renderer->surface,
+        startup->surfaceFormat, target->extent, target->presentMode,
+        target->requestedImageCount, target->usage, VK_NULL_HANDLE);
+    getSwapchainImages(renderer->device, target);
+}
+
+void startImageViews(void *context) {
+    Startup *startup = context;
+    Renderer *renderer = startup->renderer;
+    RenderTarget *target = &renderer->target;
+
+    createImageViews(renderer->device, target->imageViews, target->images,
+                     target->imageCount, target->format);
+}
+
+// Only needs the format, not the images
+void startRenderPass(void *context) {
+    Startup *startup = context;
+    Renderer *renderer = startup->renderer;
+    VkDevice device = renderer->device;
+
+    renderer->renderPass = VK_NULL_HANDLE;
+
+    if (!renderer->dynamic.enabled) {
+        renderer->renderPass = createRenderPass(
+            device, renderer->target.format, startup->finalLayout);
+        return;
+    }
+
+    renderer->dynamic.beginRendering =
+        (PFN_vkCmdBeginRendering)vkGetDeviceProcAddr(device,
+                                                     "vkCmdBeginRendering");
+    renderer->dynamic.endRendering =
+        (PFN_vkCmdEndRendering)vkGetDeviceProcAddr(device, "vkCmdEndRendering");
+    renderer->dynamic.pipelineBarrier2 =
+        (PFN_vkCmdPipelineBarrier2)vkGetDeviceProcAddr(
+            device, "vkCmdPipelineBarrier2");
+    renderer->dynamic.format = renderer->target.format;
+    renderer->dynamic.finalLayout = startup->finalLayout;
+}
+
+// Nothing to do with dynamic rendering
+void startFramebuffers(void *context) {
+    Startup *startup = context;
+    Renderer *renderer = startup->renderer;
+    RenderTarget *target = &renderer->target;
+
+    if (renderer->renderPass != VK_NULL_HANDLE) {
+        createFramebuffers(renderer->device, target->framebuffers,
+                           target->imageCount, target->imageViews,
+                           renderer->renderPass, target->extent);
+    }
+}
+
+void startShaderModules(void *context) {
+    Startup *startup = context;
+    VkDevice device = startup->renderer->device;
+    bool fromDisk = startup->options->shadersFromDisk;
+
+    startup->vertShaderModule =
+        createShaderModule(device, "vert.spv", fromDisk);
+    startup->fragShaderModule =
+        createShaderModule(device, "frag.spv", fromDisk);
+}
+
+void startPipelineCache(void *context) {
+    Startup *startup = context;
+
+    startup->pipelineCache = createPipelineCache(
+        startup->renderer->device, startup->renderer->physicalDevice,
+        startup->pipelineCachePath, &startup->warmPipelineCache);
+}
+
+void startPipelineLayout(void *context) {
+    Startup *startup = context;
+    Renderer *renderer = startup->renderer;
+
+    renderer->uniformSetLayout = createUniformSetLayout(renderer->device);
+    renderer->pipelineLayout = createGraphicsPipelineLayout(
+        renderer->device, renderer->uniformSetLayout);
+}
+
+// Needs the target's format and the render pass, not the swapchain itself
+void startGraphicsPipeline(void *context) {
+    Startup *startup = context;
+    Renderer *renderer = startup->renderer;
+
+    createPipelineVariants(
+        &renderer->variants, renderer->device, startup->pipelineCache,
+        renderer->pipelineLayout, renderer->renderPass,
+        renderer->target.format, renderer->target.extent,
+        startup->vertShaderModule, startup->fragShaderModule,
+        &renderer->pipelineKey);
+}
+
+// Every blend mode with every cull mode, compiled ahead of their first use
+void startPipelineVariants(void *context) {
+    Startup *startup = context;
+    PipelineKey keys[BLEND_MODE_COUNT * CULL_MODE_COUNT];
+    uint32_t keyCount = 0;
+
+    for (uint32_t blend = 0; blend < BLEND_MODE_COUNT; blend++) {
+        for (uint32_t cull = 0; cull < CULL_MODE_COUNT; cull++) {
+            keys[keyCount] = startup->renderer->pipelineKey;
+            keys[keyCount].blend = blend;
+            keys[keyCount].cullMode = cull;
+            keyCount++;
+        }
+    }
+
+    prewarmPipelineVariants(&startup->renderer->variants, keys, keyCount,
+                            startup->options->startupThreads);
+}
+
+// CPU only, runs before the device even exists
+void startMeshGeneration(void *context) {
+    Startup *startup = context;
+
+    static Vertex triangleVertices[] = {
+        {{0.0f, -0.5f}, {1.0f, 0.0f, 0.0f}},
+        {{0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}},
+        {{-0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}},
+    };
+    static uint32_t triangleIndices[] = {0, 1, 2};
+
+    startup->vertices = triangleVertices;
+    startup->indices = triangleIndices;
+    startup->vertexCount = 3;
+    startup->indexCount = 3;
+
+    if (startup->options->meshGrid > 0) {
+        generateGridMesh(startup->options->meshGrid, &startup->vertices,
+                         &startup->vertexCount, &startup->indices,
+                         &startup->indexCount);
+    }
+
+    computeMeshBounds(startup->vertices, startup->vertexCount,
+                      startup->meshBounds);
+}
+
+// The only phase submitting anything, so it has the graphics queue to itself
+void startMeshUpload(void *context) {
+    Startup *startup = context;
+    Renderer *renderer = startup->renderer;
+
+    startup->uploadCommandPool = createCommandPool(
+        renderer->device, getGraphicsFamily(renderer->physicalDevice),
+        VK_COMMAND_POOL_CREATE_TRANSIENT_BIT);
+
+    renderer->mesh = createMesh(
+        &renderer->allocator, startup->uploadCommandPool,
+        renderer->graphicsQueue, startup->vertices, startup->vertexCount,
+        startup->indices, startup->indexCount, &startup->uploadMs);
+
+    // the objects the cull pass tests, before createGpuCuller binds them
+    if (startup->options->gpuCull) {
+        renderer->culler.objectBounds = createObjectBounds(
+            &renderer->allocator, startup->uploadCommandPool,
+            renderer->graphicsQueue, startup->meshBounds,
+            getMaxDraws(startup->options));
+    }
+
+    if (startup->options->meshGrid > 0) {
+        free(startup->vertices);
+        free(startup->indices);
+    }
+}
+
+int main(int argc, char **argv) {
+    double launchMs = getTimeMs();
+
+    Options options = parseOptions(argc, argv);
+
+    if (options.benchAllocator > 0) {
+        benchmarkAllocator(options.benchAllocator);
+        exit(0);
+    }
+
+    Renderer renderer = {
+        .launchMs = launchMs,
+    };
+
+    if (!options.headless) {
+        renderer.window = initWindow(&renderer.framebufferResized);
+    }
+
+    if (enableValidationLayers && !checkValidationLayerSupport()) {
+        fprintf(stderr,
+                "ERROR: validation layers requested, but not available\n");
+        exit(1);
+    }
+
+    renderer.pipelineKey = (PipelineKey){
+        .blend = options.blend,
+        .cullMode = options.cullMode,
+        .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .constants =
+            {
+                .alpha = options.alphaPercent / 100.0f,
+                .instanceColors = options.instanceColors,
+                .culledInstances = options.gpuCull,
+            },
+    };
+
+    Startup startup = {
+        .options = &options,
+        .renderer = &renderer,
+        .pipelineCachePath =
+            options.pipelineCache ? PIPELINE_CACHE_PATH : NULL,
+    };
+
+    if (renderer.window) {
+        glfwGetFramebufferSize(renderer.window, &startup.framebufferWidth,
+                               &startup.framebufferHeight);
+    }
+
+    // the dependencies between the phases, each waits for the ones it needs
+    // and nothing else
+    TaskGraph graph;
+    createTaskGraph(&graph, &startup);
+
+    uint32_t instancePhase =
+        addGraphTask(&graph, "instance", startInstance, 0);
+    uint32_t surfacePhase = 0;
+
+    if (renderer.window) {
+        surfacePhase =
+            addGraphTask(&graph, "surface", startSurface, instancePhase);
+    }
+
+    uint32_t devicePhase = addGraphTask(&graph, "device", startDevice,
+                                        instancePhase | surfacePhase);
+    uint32_t swapchainPhase = addGraphTask(
+        &graph, renderer.window ? "swapchain" : "offscreen images",
+        startSwapchain, devicePhase);
+    uint32_t imageViewPhase =
+        addGraphTask(&graph, "image views", startImageViews, swapchainPhase);
+    uint32_t renderPassPhase =
+        addGraphTask(&graph, "render pass", startRenderPass, devicePhase);
+    uint32_t framebufferPhase =
+        addGraphTask(&graph, "framebuffers", startFramebuffers,
+                     imageViewPhase | renderPassPhase);
+    uint32_t shaderPhase =
+        addGraphTask(&graph, "shader modules", startShaderModules, devicePhase);
+    uint32_t cachePhase =
+        addGraphTask(&graph, "pipeline cache", startPipelineCache, devicePhase);
+    uint32_t layoutPhase = addGraphTask(&graph, "pipeline layout",
+                                        startPipelineLayout, devicePhase);
+    uint32_t pipelinePhase = addGraphTask(
+        &graph, "graphics pipeline", startGraphicsPipeline,
+        shaderPhase | cachePhase | layoutPhase | renderPassPhase);
+    uint32_t prewarmPhase = 0;
+
+    if (options.prewarmPipelines) {
+        prewarmPhase = addGraphTask(&graph, "pipeline variants",
+                                    startPipelineVariants, pipelinePhase);
+    }
+
+    uint32_t meshPhase = addGraphTask(&graph, "mesh generation",
+                                      startMeshGeneration, 0);
+    addGraphTask(&graph, "mesh upload", startMeshUpload,
+                 devicePhase | meshPhase);
+
+    runTaskGraph(&graph, options.startupThreads);
+
+    VkInstance instance = startup.instance;
+    VkDebugUtilsMessengerEXT debugMessenger = startup.debugMessenger;
+    VkSurfaceKHR surface = renderer.surface;
+    VkPhysicalDevice physicalDevice = renderer.physicalDevice;
+    VkDevice device = renderer.device;
+    RenderTarget *target = &renderer.target;
+    VkImageLayout finalLayout = startup.finalLayout;
+    VkShaderModule vertShaderModule = startup.vertShaderModule;
+    VkShaderModule fragShaderModule = startup.fragShaderModule;
+    const char *pipelineCachePath = startup.pipelineCachePath;
+    VkPipelineCache pipelineCache = startup.pipelineCache;
+    VkCommandPool uploadCommandPool = startup.uploadCommandPool;
+
+    if (target->swapchain != VK_NULL_HANDLE) {
+        fprintf(stdout, "present mode %s (%s policy), %d swapchain images\n",
+                presentModeName(target->presentMode),
+                presentPolicyNames[options.presentPolicy], target->imageCount);
+    }
+
+    fprintf(stdout, "shader modules created in %.3f ms (%s)\n",
+            getGraphTaskMs(&graph, shaderPhase),
+            options.shadersFromDisk ? "from disk" : "built in");
+
+    fprintf(stdout, "graphics pipeline created in %.3f ms (%s start)\n",
+            getGraphTaskMs(&graph, pipelinePhase),
+            startup.warmPipelineCache ? "warm" : "cold");
+
+    if (options.prewarmPipelines) {
+        fprintf(stdout, "%d pipeline variants prewarmed in %.3f ms\n",
+                renderer.variants.count - 1,
+                getGraphTaskMs(&graph, prewarmPhase));
+    }
+
+    // what dynamic rendering saves at startup, the framebuffers are timed
+    // again on every resize
+    fprintf(stdout, "%s, render pass objects created in %.3f ms\n",
+            renderer.dynamic.enabled ? "dynamic rendering"
+                                     : "render pass and framebuffers",
+            getGraphTaskMs(&graph, renderPassPhase) +
+                getGraphTaskMs(&graph, framebufferPhase));
+
+    VkDeviceSize uploadBytes =
+        renderer.mesh.vertices.size + renderer.mesh.indices.size;
+    fprintf(stdout,
+            "mesh of %d vertices, %d indices: %.1f KiB uploaded in %.3f ms "
+            "(%.1f MiB/s)\n",
+            startup.vertexCount, startup.indexCount, uploadBytes / 1024.0,
+            startup.uploadMs,
+            uploadBytes / (1024.0 * 1024.0) / (startup.uploadMs / 1000.0));
+
+    printTaskGraph(&graph, "startup");
+
+    if (options.watchShaders) {
+        startPipelineReload(&renderer, pipelineCache, "vert.spv", "frag.spv");
+    }
+
+    renderer.gpuTimer = createGpuTimer(physicalDevice);
+
+    renderer.drawCount = options.drawCount;
+    renderer.instanceCount = options.instanceCount;
+
+    VkPhysicalDeviceProperties deviceProps;
+    vkGetPhysicalDeviceProperties(physicalDevice, &deviceProps);
+    renderer.uniformAlignment =
+        deviceProps.limits.minUniformBufferOffsetAlignment;
+    renderer.storageAlignment =
+        deviceProps.limits.minStorageBufferOffsetAlignment;
+
+    uint32_t maxDraws = getMaxDraws(&options);
+    uint32_t maxInstances = options.instanceCount > options.sweepInstances
+                                ? options.instanceCount
+                                : options.sweepInstances;
+
+    VkDeviceSize uniformArenaSize =
+        getUniformArenaSize(renderer.uniformAlignment,
+                            renderer.storageAlignment, maxDraws, maxInstances);
+
+    // one set per frame slot and one for the replayed command buffers
+    renderer.descriptorPool =
+        createDescriptorPool(device, MAX_FRAMES_IN_FLIGHT + 1);
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        renderer.frameUniforms[i] = createUniformArena(
+            &renderer.allocator, renderer.descriptorPool,
+            renderer.uniformSetLayout, uniformArenaSize, maxInstances);
+    }
+
+    renderer.replayUniforms = createUniformArena(
+        &renderer.allocator, renderer.descriptorPool,
+        renderer.uniformSetLayout, uniformArenaSize, maxInstances);
+
+    VkShaderModule cullShaderModule = VK_NULL_HANDLE;
+
+    if (options.gpuCull) {
+        // the sweep only ever multiplies one of its counts by one
+        uint64_t maxCulled =
+            (uint64_t)options.drawCount * options.instanceCount;
+        maxCulled = options.sweepInstances > maxCulled ? options.sweepInstances
+                                                       : maxCulled;
+
+        if (maxCulled > UINT32_MAX / (2 * sizeof(uint32_t))) {
+            fprintf(stderr, "ERROR: too many instances to cull.\n");
+            exit(1);
+        }
+
+        if (maxDraws > deviceProps.limits.maxDrawIndirectCount) {
+            fprintf(stderr,
+                    "ERROR: --gpu-cull draws at most %u objects on this "
+                    "device.\n",
+                    deviceProps.limits.maxDrawIndirectCount);
+            exit(1);
+        }
+
+        cullShaderModule =
+            createShaderModule(device, "cull.spv", options.shadersFromDisk);
+        createGpuCuller(&renderer.culler, &renderer.allocator, pipelineCache,
+                        cullShaderModule, renderer.frameUniforms,
+                        MAX_FRAMES_IN_FLIGHT, maxDraws, maxCulled);
+    }
+
+    if (options.streamMib > 0) {
+        createStreamer(&renderer.streamer, &renderer.allocator, physicalDevice,
+                       (VkDeviceSize)options.streamMib * 1024 * 1024,
+                       &renderer.timeline);
+        renderer.streamer.enabled = true;
+
+        fprintf(stdout, "streaming %d MiB chunks on the %s queue\n",
+                options.streamMib,
+                renderer.streamer.dedicated ? "dedicated transfer"
+                                            : "graphics");
+    }
+
+    VkShaderModule particleShaderModule = VK_NULL_HANDLE;
+
+    if (options.particleCount > 0) {
+        particleShaderModule = createShaderModule(device, "particles.spv",
+                                                  options.shadersFromDisk);
+        createParticleSim(&renderer.sim, &renderer.allocator, physicalDevice,
+                          pipelineCache, particleShaderModule,
+                          options.particleCount, &renderer.timeline);
+
+        bool async = options.asyncCompute || options.compareAsyncCompute;
+
+        if (async && renderer.sim.family == -1) {
+            fprintf(stdout, "no compute-only queue family, the simulation "
+                            "stays on the graphics queue\n");
+        }
+
+        renderer.sim.async = async && renderer.sim.family != -1;
+
+        fprintf(stdout, "simulating %d particles on the %s queue\n",
+                options.particleCount,
+                renderer.sim.async ? "compute" : "graphics");
+    }
+
+    if (options.readbackDir) {
+        startReadback(&renderer.readback, &renderer.allocator,
+                      options.readbackDir, options.readbackFormat,
+                      target->format, target->extent, finalLayout);
+
+        fprintf(stdout, "reading frames back to %s as %s\n",
+                options.readbackDir,
+                frameFormatNames[options.readbackFormat]);
     }
 
-    vkDestroySwapchainKHR(device, swapchain, NULL);
+    renderer.recordThreads = options.recordThreads;
+    createThreadPool(&renderer.recordPool, renderer.recordThreads);
+
+    renderer.framesInFlight = options.framesInFlight;
+    renderer.currentFrame = 0;
+    createFrameContexts(device, physicalDevice, renderer.frames,
+                        renderer.framesInFlight, renderer.recordThreads,
+                        renderer.gpuTimer.enabled, renderer.timeline.enabled);
+
+    setReplay(&renderer, options.replay);
+
+    // in benchmark mode --frames counts the measured frames only
+    uint32_t warmupCount = options.bench ? options.warmupCount : 0;
+
+    BenchRun benchRuns[MAX_BENCH_RUNS];
+    uint32_t benchRunCount = 0;
+
+    if (options.bench) {
+        uint32_t firstDepth =
+            options.sweepFramesInFlight ? 1 : options.framesInFlight;
+        uint32_t lastDepth = options.sweepFramesInFlight
+                                 ? MAX_FRAMES_IN_FLIGHT
+                                 : options.framesInFlight;
+
+        for (uint32_t depth = firstDepth; depth <= lastDepth; depth++) {
+            if (depth != renderer.framesInFlight) {
+                setFramesInFlight(&renderer, depth);
+            }
+
+            if (options.sweepRecordThreads) {
+                long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+                uint32_t maxThreads =
+                    cpuCount > 0 && cpuCount < MAX_RECORD_THREADS
+                        ? cpuCount
+                        : MAX_RECORD_THREADS;
+
+                setReplay(&renderer, false);
+
+                // 0 is the main thread recording inline, then 1, 2, 4...
+                for (uint32_t threads = 0; threads <= maxThreads;
+                     threads = threads == 0 ? 1 : threads * 2) {
+                    setRecordThreads(&renderer, threads);
+                    runBenchmark(&renderer, benchRuns, &benchRunCount,
+                                 warmupCount, options.frameCount);
+                }
+                continue;
+            }
+
+            if (options.sweepInstances > 0) {
+                // the same objects as instances of one draw call, then as
+                // one draw call each
+                for (uint64_t count = 1; count <= options.sweepInstances;
+                     count *= 10) {
+                    setSceneSize(&renderer, 1, count);
+                    runBenchmark(&renderer, benchRuns, &benchRunCount,
+                                 warmupCount, options.frameCount);
+                    setSceneSize(&renderer, count, 1);
+                    runBenchmark(&renderer, benchRuns, &benchRunCount,
+                                 warmupCount, options.frameCount);
+                }
+                continue;
+            }
+
+            if (options.compareAsyncCompute && renderer.sim.family != -1) {
+                uint32_t baseRun = benchRunCount;
+
+                renderer.sim.async = false;
+                runBenchmark(&renderer, benchRuns, &benchRunCount,
+                             warmupCount, options.frameCount);
+                renderer.sim.async = true;
+                runBenchmark(&renderer, benchRuns, &benchRunCount,
+                             warmupCount, options.frameCount);
+
+                if (benchRunCount == baseRun + 2) {
+                    printFrameTimeChange("async compute", &benchRuns[baseRun],
+                                         &benchRuns[baseRun + 1]);
+                }
+                continue;
+            }
+
+            if (options.compareBlend) {
+                uint32_t baseRun = benchRunCount;
+                PipelineKey key = renderer.pipelineKey;
+
+                // alpha blending is the base, what opaque saves is negative
+                key.blend = BLEND_ALPHA;
+                setPipelineVariant(&renderer, &key);
+                runBenchmark(&renderer, benchRuns, &benchRunCount,
+                             warmupCount, options.frameCount);
+                key.blend = BLEND_OPAQUE;
+                setPipelineVariant(&renderer, &key);
+                runBenchmark(&renderer, benchRuns, &benchRunCount,
+                             warmupCount, options.frameCount);
+
+                if (benchRunCount == baseRun + 2) {
+                    printFrameTimeChange("opaque pipeline",
+                                         &benchRuns[baseRun],
+                                         &benchRuns[baseRun + 1]);
+                }
+                continue;
+            }
+
+            if (options.compareStreaming) {
+                uint32_t baseRun = benchRunCount;
+
+                renderer.streamer.enabled = false;
+                runBenchmark(&renderer, benchRuns, &benchRunCount,
+                             warmupCount, options.frameCount);
+                renderer.streamer.enabled = true;
+                runBenchmark(&renderer, benchRuns, &benchRunCount,
+                             warmupCount, options.frameCount);
+
+                if (benchRunCount == baseRun + 2) {
+                    printFrameTimeChange("streaming", &benchRuns[baseRun],
+                                         &benchRuns[baseRun + 1]);
+                }
+                continue;
+            }
+
+            if (options.compareRecording) {
+                setReplay(&renderer, false);
+                runBenchmark(&renderer, benchRuns, &benchRunCount,
+                             warmupCount, options.frameCount);
+                setReplay(&renderer, true);
+            }
+
+            runBenchmark(&renderer, benchRuns, &benchRunCount, warmupCount,
+                         options.frameCount);
+        }
+    } else {
+        double elapsed;
+        uint32_t frameCount =
+            runFrames(&renderer, 0, options.frameCount, NULL, &elapsed);
+
+        if (options.headless) {
+            fprintf(stdout, "rendered %d frames in %.1f ms (%.1f fps)\n",
+                    frameCount, elapsed, frameCount * 1000.0 / elapsed);
+        }
+    }
+
+    if (options.benchOut && benchRunCount > 0) {
+        writeBenchReport(options.benchOut, benchRuns, benchRunCount);
+    }
+
+    for (uint32_t i = 0; i < benchRunCount; i++) {
+        destroyBenchRun(&benchRuns[i]);
+    }
+
+    printGpuTimes(&renderer.gpuTimer);
+    printCullStats(&renderer.culler);
+
+    if (renderer.timeline.enabled) {
+        fprintf(stdout, "%d slow frames, waited on for more than %d ms\n",
+                renderer.timeline.slowWaits, renderer.timeline.slowWaitMs);
+    }
+
+    if (renderer.readback.enabled) {
+        // writes out what is still queued before the stats are final
+        stopFrameWriter(&renderer.readback.writer);
+        printFrameWriterStats(&renderer.readback.writer);
+        fprintf(stdout, "\t%d frames dropped, the writer was still behind\n",
+                renderer.readback.droppedFrames);
+    }
+
+    printPipelineVariants(&renderer.variants);
+
+    if (renderer.reload.enabled) {
+        fprintf(stdout, "shaders reloaded %d times, %d failed\n",
+                renderer.reload.reloadCount, renderer.reload.failedCount);
+    }
+
+    if (renderer.resizeCount > 0) {
+        fprintf(stdout,
+                "swapchain recreated %d times, %.3f ms mean, %.3f ms max "
+                "(%s)\n",
+                renderer.resizeCount,
+                renderer.resizeTotalMs / renderer.resizeCount,
+                renderer.resizeMaxMs,
+                renderer.dynamic.enabled ? "dynamic rendering"
+                                         : "render pass");
+    }
+
+    printAllocatorStats("device memory",
+                        getAllocatorStats(&renderer.allocator));
+
+    // clean up
+
+    destroyFrameContexts(device, &renderer.allocator, renderer.frames,
+                         renderer.framesInFlight);
+    destroyRecordedCommands(device, &renderer.recorded);
+    stopPipelineReload(&renderer);
+    destroyThreadPool(&renderer.recordPool);
+    destroyMesh(&renderer.allocator, &renderer.mesh);
+
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        destroyUniformArena(&renderer.allocator, &renderer.frameUniforms[i]);
+    }
+    destroyUniformArena(&renderer.allocator, &renderer.replayUniforms);
+    destroyGpuCuller(&renderer.allocator, &renderer.culler);
+    destroyStreamer(&renderer.allocator, &renderer.streamer);
+    destroyParticleSim(&renderer.allocator, &renderer.sim);
+    destroyTimeline(device, &renderer.timeline);
+
+    if (renderer.readback.enabled) {
+        destroyReadbackBuffers(&renderer.readback, &renderer.allocator);
+    }
+
+    vkDestroyDescriptorPool(device, renderer.descriptorPool, NULL);
+    vkDestroyCommandPool(device, uploadCommandPool, NULL);
+
+    vkDestroyShaderModule(device, fragShaderModule, NULL);
+    vkDestroyShaderModule(device, vertShaderModule, NULL);
+
+    if (cullShaderModule != VK_NULL_HANDLE) {
+        vkDestroyShaderModule(device, cullShaderModule, NULL);
+    }
+
+    if (particleShaderModule != VK_NULL_HANDLE) {
+        vkDestroyShaderModule(device, particleShaderModule, NULL);
+    }
+
+    destroyRenderTarget(device, target);
+    destroyAllocator(&renderer.allocator);
+
+    if (pipelineCachePath) {
+        savePipelineCache(device, pipelineCache, pipelineCachePath);
+    }
+
+    vkDestroyPipelineCache(device, pipelineCache, NULL);
+    destroyPipelineVariants(&renderer.variants);
+    vkDestroyPipelineLayout(device, renderer.pipelineLayout, NULL);
+    vkDestroyDescriptorSetLayout(device, renderer.uniformSetLayout, NULL);
+    vkDestroyRenderPass(device, renderer.renderPass, NULL);
+
     vkDestroyDevice(device, NULL);
-    vkDestroySurfaceKHR(instance, surface, NULL);
+
+    if (surface != VK_NULL_HANDLE) {
+        vkDestroySurfaceKHR(instance, surface, NULL);
+    }
 
     if (enableValidationLayers) {
         DestroyDebugUtilsMessengerEXT(instance, debugMessenger, NULL);
     }
 
     vkDestroyInstance(instance, NULL);
-    glfwDestroyWindow(window);
-    glfwTerminate();
+
+    if (renderer.window) {
+        glfwDestroyWindow(renderer.window);
+        glfwTerminate();
+    }
 
     exit(0);
 }
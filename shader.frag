@@ -4,6 +4,8 @@ layout(location = 0) in vec3 fragColor;
 
 layout(location = 0) out vec4 outColor;
 
+layout(constant_id = 0) const float ALPHA = 1.0;
+
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    outColor = vec4(fragColor, ALPHA);
 }
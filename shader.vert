@@ -1,20 +1,56 @@
 #version 450
 
-layout(location = 0) out vec3 fragColor;
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec3 inColor;
+
+layout(set = 0, binding = 0) uniform Camera {
+    mat4 viewProj;
+} camera;
+
+layout(set = 0, binding = 1) uniform Object {
+    mat4 model;
+} object;
 
-vec2 positions[3] = vec2[](
-        vec2(0.0, -0.5),
-        vec2(0.5, 0.5),
-        vec2(-0.5, 0.5)
-    );
+struct Instance {
+    mat4 model;
+    vec4 color;
+};
 
-vec3 colors[3] = vec3[](
-        vec3(1.0, 0.0, 0.0),
-        vec3(0.0, 1.0, 0.0),
-        vec3(0.0, 0.0, 1.0)
-    );
+layout(std430, set = 0, binding = 2) readonly buffer Instances {
+    Instance instances[];
+};
+
+// With --gpu-cull every draw is one indirect command of the cull pass, whose
+// firstInstance points gl_InstanceIndex at the draw's visible instances: x
+// is where its model matrix is in Arena, in vec4s, and y the instance
+layout(std430, set = 0, binding = 3) readonly buffer VisibleInstances {
+    uvec2 visibleInstances[];
+};
+
+// The whole uniform arena, Object is only bound at the first draw's
+layout(std430, set = 0, binding = 4) readonly buffer Arena {
+    vec4 arena[];
+};
+
+layout(location = 0) out vec3 fragColor;
+
+layout(constant_id = 1) const bool INSTANCE_COLORS = true;
+layout(constant_id = 2) const bool CULLED_INSTANCES = false;
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    fragColor = colors[gl_VertexIndex];
+    mat4 model = object.model;
+    uint index = uint(gl_InstanceIndex);
+
+    if (CULLED_INSTANCES) {
+        uvec2 visible = visibleInstances[gl_InstanceIndex];
+        model = mat4(arena[visible.x], arena[visible.x + 1],
+                     arena[visible.x + 2], arena[visible.x + 3]);
+        index = visible.y;
+    }
+
+    Instance instance = instances[index];
+
+    gl_Position = camera.viewProj * model * instance.model *
+                  vec4(inPosition, 0.0, 1.0);
+    fragColor = INSTANCE_COLORS ? inColor * instance.color.rgb : inColor;
 }
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// SPIR-V compiled into the executable. The *.spv.inc files are generated by
+// the Makefile from the *.spv files, one uint32_t initializer per word.
+const uint32_t vertSpirv[] = {
+#include "vert.spv.inc"
+};
+
+const uint32_t fragSpirv[] = {
+#include "frag.spv.inc"
+};
+
+const uint32_t cullSpirv[] = {
+#include "cull.spv.inc"
+};
+
+const uint32_t particlesSpirv[] = {
+#include "particles.spv.inc"
+};
+
+typedef struct {
+    const char *filename; // of the .spv file it was generated from
+    const uint32_t *code;
+    size_t size; // in bytes
+} EmbeddedShader;
+
+const EmbeddedShader embeddedShaders[] = {
+    {"vert.spv", vertSpirv, sizeof(vertSpirv)},
+    {"frag.spv", fragSpirv, sizeof(fragSpirv)},
+    {"cull.spv", cullSpirv, sizeof(cullSpirv)},
+    {"particles.spv", particlesSpirv, sizeof(particlesSpirv)},
+};
+
+// Returns NULL when no shader was embedded under filename
+const EmbeddedShader *findEmbeddedShader(const char *filename) {
+    uint32_t count = sizeof(embeddedShaders) / sizeof(embeddedShaders[0]);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (strcmp(embeddedShaders[i].filename, filename) == 0) {
+            return &embeddedShaders[i];
+        }
+    }
+
+    return NULL;
+}
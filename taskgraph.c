@@ -0,0 +1,190 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "helpers.c"
+
+#define MAX_GRAPH_TASKS 32
+
+typedef void (*GraphFunction)(void *context);
+
+typedef struct {
+    const char *name;
+    GraphFunction function;
+    uint32_t dependencies; // bits of the tasks that must be done first
+    uint32_t thread;       // that ran it, 0 is the caller of runTaskGraph
+    double startMs;        // since the graph started
+    double endMs;
+} GraphTask;
+
+/**
+ * A handful of tasks with dependencies between them, run once on a few
+ * threads. Tasks can only depend on tasks added before them, so the graph
+ * has no cycles and always runs to the end. A task is picked as soon as its
+ * dependencies are done, the one added first when several are.
+ */
+typedef struct {
+    void *context; // passed to every task
+    uint32_t taskCount;
+    GraphTask tasks[MAX_GRAPH_TASKS];
+    pthread_mutex_t mutex;
+    pthread_cond_t taskDone;
+    uint32_t startedTasks; // bits
+    uint32_t doneTasks;    // bits
+    double startMs;
+    double elapsedMs;
+} TaskGraph;
+
+void createTaskGraph(TaskGraph *graph, void *context) {
+    *graph = (TaskGraph){
+        .context = context,
+        .taskCount = 0,
+    };
+}
+
+// Returns the bit of the new task, to list it in the dependencies of later
+// ones. A dependency of 0 is no dependency, such as a task left out.
+uint32_t addGraphTask(TaskGraph *graph, const char *name,
+                      GraphFunction function, uint32_t dependencies) {
+    uint32_t index = graph->taskCount;
+
+    if (index == MAX_GRAPH_TASKS || (dependencies >> index) != 0) {
+        fprintf(stderr, "ERROR: invalid task graph entry %s.\n", name);
+        exit(1);
+    }
+
+    graph->tasks[graph->taskCount++] = (GraphTask){
+        .name = name,
+        .function = function,
+        .dependencies = dependencies,
+    };
+
+    return 1u << index;
+}
+
+typedef struct {
+    TaskGraph *graph;
+    uint32_t thread;
+} GraphWorker;
+
+void *taskGraphWorker(void *arg) {
+    GraphWorker *worker = arg;
+    TaskGraph *graph = worker->graph;
+    uint32_t allTasks =
+        graph->taskCount == MAX_GRAPH_TASKS ? UINT32_MAX
+                                            : (1u << graph->taskCount) - 1;
+
+    pthread_mutex_lock(&graph->mutex);
+
+    while (graph->startedTasks != allTasks) {
+        GraphTask *task = NULL;
+        uint32_t bit = 0;
+
+        for (uint32_t i = 0; i < graph->taskCount; i++) {
+            bit = 1u << i;
+
+            if (!(graph->startedTasks & bit) &&
+                (graph->tasks[i].dependencies & ~graph->doneTasks) == 0) {
+                task = &graph->tasks[i];
+                break;
+            }
+        }
+
+        if (!task) {
+            pthread_cond_wait(&graph->taskDone, &graph->mutex);
+            continue;
+        }
+
+        graph->startedTasks |= bit;
+        task->thread = worker->thread;
+        task->startMs = getTimeMs() - graph->startMs;
+
+        pthread_mutex_unlock(&graph->mutex);
+        task->function(graph->context);
+        pthread_mutex_lock(&graph->mutex);
+
+        task->endMs = getTimeMs() - graph->startMs;
+        graph->doneTasks |= bit;
+        pthread_cond_broadcast(&graph->taskDone);
+    }
+
+    pthread_mutex_unlock(&graph->mutex);
+
+    return NULL;
+}
+
+// Runs every task on the calling thread and threadCount - 1 others, and
+// returns once all of them are done
+void runTaskGraph(TaskGraph *graph, uint32_t threadCount) {
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+
+    pthread_mutex_init(&graph->mutex, NULL);
+    pthread_cond_init(&graph->taskDone, NULL);
+    graph->startedTasks = 0;
+    graph->doneTasks = 0;
+    graph->startMs = getTimeMs();
+
+    pthread_t threads[threadCount];
+    GraphWorker workers[threadCount];
+
+    for (uint32_t i = 0; i < threadCount; i++) {
+        workers[i] = (GraphWorker){.graph = graph, .thread = i};
+    }
+
+    for (uint32_t i = 1; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, taskGraphWorker, &workers[i]) !=
+            0) {
+            fprintf(stderr, "ERROR: failed to create task graph thread.\n");
+            exit(1);
+        }
+    }
+
+    taskGraphWorker(&workers[0]);
+
+    for (uint32_t i = 1; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    graph->elapsedMs = getTimeMs() - graph->startMs;
+
+    pthread_cond_destroy(&graph->taskDone);
+    pthread_mutex_destroy(&graph->mutex);
+}
+
+// Time the task with this bit took, 0 for a task left out
+double getGraphTaskMs(const TaskGraph *graph, uint32_t bit) {
+    for (uint32_t i = 0; i < graph->taskCount; i++) {
+        if (bit == 1u << i) {
+            return graph->tasks[i].endMs - graph->tasks[i].startMs;
+        }
+    }
+
+    return 0.0;
+}
+
+// One line per task, when it started and how long it took on which thread
+void printTaskGraph(const TaskGraph *graph, const char *what) {
+    double workMs = 0.0;
+
+    for (uint32_t i = 0; i < graph->taskCount; i++) {
+        workMs += graph->tasks[i].endMs - graph->tasks[i].startMs;
+    }
+
+    fprintf(stdout, "%s: %.3f ms, %.3f ms of work in %d phases\n", what,
+            graph->elapsedMs, workMs, graph->taskCount);
+    fprintf(stdout, "\t%-20s %9s %9s %7s\n", "phase (ms)", "start", "time",
+            "thread");
+
+    for (uint32_t i = 0; i < graph->taskCount; i++) {
+        const GraphTask *task = &graph->tasks[i];
+
+        fprintf(stdout, "\t%-20s %9.3f %9.3f %7d\n", task->name,
+                task->startMs, task->endMs - task->startMs, task->thread);
+    }
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Runs task index taskIndex of a batch on the calling worker
+typedef void (*TaskFunction)(void *context, uint32_t taskIndex);
+
+// Fixed set of worker threads running batches of indexed tasks. Workers
+// keep a pointer to the pool, so it must not move once created.
+typedef struct {
+    uint32_t threadCount;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t workReady;
+    pthread_cond_t workDone;
+    TaskFunction function;
+    void *context;
+    uint32_t taskCount;
+    uint32_t nextTask;
+    uint32_t pendingTasks;
+    bool shutdown;
+} ThreadPool;
+
+void *threadPoolWorker(void *arg) {
+    ThreadPool *pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (true) {
+        while (!pool->shutdown && pool->nextTask == pool->taskCount) {
+            pthread_cond_wait(&pool->workReady, &pool->mutex);
+        }
+
+        if (pool->shutdown) {
+            break;
+        }
+
+        uint32_t taskIndex = pool->nextTask++;
+
+        pthread_mutex_unlock(&pool->mutex);
+        pool->function(pool->context, taskIndex);
+        pthread_mutex_lock(&pool->mutex);
+
+        if (--pool->pendingTasks == 0) {
+            pthread_cond_signal(&pool->workDone);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+void createThreadPool(ThreadPool *pool, uint32_t threadCount) {
+    *pool = (ThreadPool){
+        .threadCount = threadCount,
+        .threads = calloc(threadCount, sizeof(pthread_t)),
+        .taskCount = 0,
+        .nextTask = 0,
+        .pendingTasks = 0,
+        .shutdown = false,
+    };
+
+    if (threadCount > 0 && !pool->threads) {
+        fprintf(stderr, "ERROR: failed to allocate thread pool.\n");
+        exit(1);
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->workReady, NULL);
+    pthread_cond_init(&pool->workDone, NULL);
+
+    for (uint32_t i = 0; i < threadCount; i++) {
+        if (pthread_create(&pool->threads[i], NULL, threadPoolWorker, pool) !=
+            0) {
+            fprintf(stderr, "ERROR: failed to create worker thread.\n");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Runs function for every index in [0, taskCount) on the workers and returns
+ * once all of them have finished. Only one batch runs at a time.
+ */
+void runThreadPoolTasks(ThreadPool *pool, TaskFunction function, void *context,
+                        uint32_t taskCount) {
+    if (taskCount == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    pool->function = function;
+    pool->context = context;
+    pool->taskCount = taskCount;
+    pool->nextTask = 0;
+    pool->pendingTasks = taskCount;
+
+    pthread_cond_broadcast(&pool->workReady);
+
+    while (pool->pendingTasks > 0) {
+        pthread_cond_wait(&pool->workDone, &pool->mutex);
+    }
+
+    pool->taskCount = 0;
+    pool->nextTask = 0;
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void destroyThreadPool(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->workReady);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < pool->threadCount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->workDone);
+    pthread_cond_destroy(&pool->workReady);
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->threadCount = 0;
+}